@@ -0,0 +1,536 @@
+#include "devices/ahci.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "devices/timer.h"
+#include "threads/init.h"
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file is a driver for SATA disks attached to an
+   AHCI host bus adapter, such as the ICH9 that QEMU emulates for
+   its "q35" machine type.  See the Serial ATA AHCI 1.3
+   specification.
+
+   Each disk has up to 32 command slots, so that many requests can
+   be in flight at once.  Disks that support native command
+   queuing get READ and WRITE FPDMA QUEUED commands, which they may
+   complete in any order; others get READ and WRITE DMA EXT, which
+   the adapter runs one after another.  Like virtio disks, these
+   have no request queue in the block layer. */
+
+/* PCI subclass and programming interface of an AHCI adapter. */
+#define PCI_SUBCLASS_SATA 0x06
+#define PROG_IF_AHCI 0x01
+
+/* Adapter registers, as byte offsets from the base address. */
+#define HBA_CAP 0x00            /* Capabilities. */
+#define HBA_GHC 0x04            /* Global host control. */
+#define HBA_IS 0x08             /* Interrupt status. */
+#define HBA_PI 0x0c             /* Ports implemented. */
+
+/* Capabilities bits. */
+#define CAP_SNCQ 0x40000000     /* Supports native command queuing. */
+#define CAP_NCS(CAP) ((((CAP) >> 8) & 0x1f) + 1) /* Slots per port. */
+
+/* Global host control bits. */
+#define GHC_AE 0x80000000       /* AHCI enable. */
+#define GHC_IE 0x00000002       /* Interrupt enable. */
+#define GHC_HR 0x00000001       /* HBA reset. */
+
+/* Port registers, as byte offsets from the port's base. */
+#define PORT_CNT 32
+#define PORT_BASE(NO) (0x100 + (NO) * 0x80)
+#define PX_CLB 0x00             /* Command list base address. */
+#define PX_CLBU 0x04            /* Command list base address, upper. */
+#define PX_FB 0x08              /* Received FIS base address. */
+#define PX_FBU 0x0c             /* Received FIS base address, upper. */
+#define PX_IS 0x10              /* Interrupt status. */
+#define PX_IE 0x14              /* Interrupt enable. */
+#define PX_CMD 0x18             /* Command and status. */
+#define PX_TFD 0x20             /* Task file data. */
+#define PX_SIG 0x24             /* Device signature. */
+#define PX_SSTS 0x28            /* SATA status. */
+#define PX_SERR 0x30            /* SATA error. */
+#define PX_SACT 0x34            /* SATA active: queued commands. */
+#define PX_CI 0x38              /* Command issue. */
+
+/* Port command bits. */
+#define CMD_ST 0x0001           /* Start processing the command list. */
+#define CMD_FRE 0x0010          /* FIS receive enable. */
+#define CMD_FR 0x4000           /* FIS receive running. */
+#define CMD_CR 0x8000           /* Command list running. */
+
+/* Port interrupt bits. */
+#define IS_DHRS 0x00000001      /* Register FIS received. */
+#define IS_SDBS 0x00000008      /* Set Device Bits FIS received. */
+#define IS_ERRORS 0x78000000    /* Task file, host bus, interface errors. */
+
+/* Task file status bits. */
+#define TFD_BSY 0x80            /* Busy. */
+#define TFD_DRQ 0x08            /* Data request. */
+#define TFD_ERR 0x01            /* Error. */
+
+#define SSTS_DET_PRESENT 3      /* SATA status: device present, phy up. */
+#define SIG_ATA 0x00000101      /* Signature of an ATA disk. */
+
+/* ATA commands. */
+#define ATA_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
+#define ATA_READ_DMA_EXT 0x25           /* READ DMA EXT. */
+#define ATA_WRITE_DMA_EXT 0x35          /* WRITE DMA EXT. */
+#define ATA_READ_FPDMA_QUEUED 0x60      /* READ FPDMA QUEUED. */
+#define ATA_WRITE_FPDMA_QUEUED 0x61     /* WRITE FPDMA QUEUED. */
+
+/* Host to device register FIS. */
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_REG_H2D_DWORDS 5
+
+/* A command header in a port's command list. */
+struct cmd_header
+  {
+    uint16_t flags;             /* FIS length in dwords, CH_* bits. */
+    uint16_t prdt_cnt;          /* Entries in the command's PRDT. */
+    uint32_t byte_cnt;          /* Bytes transferred so far. */
+    uint32_t table;             /* Physical address of command table. */
+    uint32_t table_hi;
+    uint32_t reserved[4];
+  };
+
+#define CH_WRITE 0x0040         /* Direction: 1=memory to device. */
+
+/* A physical region descriptor: where one physically contiguous
+   piece of a command's data lives. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address, even. */
+    uint32_t addr_hi;
+    uint32_t reserved;
+    uint32_t byte_cnt;          /* Size in bytes minus 1, odd. */
+  };
+
+#define PRD_MAX_BYTES (4 * 1024 * 1024) /* Largest region. */
+#define PRD_CNT 8                       /* Regions per command. */
+
+/* A command table, one per command slot. */
+struct cmd_table
+  {
+    uint8_t fis[64];            /* Command FIS. */
+    uint8_t atapi[16];          /* ATAPI command, unused. */
+    uint8_t reserved[48];
+    struct prd prdt[PRD_CNT];   /* Physical region descriptor table. */
+  };
+
+/* Most sectors per command: the count is 16 bits, with 0 meaning
+   65536, and PRD_CNT regions cover that many. */
+#define MAX_XFER_SECTORS 65536
+
+/* Most command slots per port. */
+#define SLOT_CNT 32
+
+/* Memory that a port's adapter accesses.  The first page holds
+   the command list, the received FIS area, and a buffer for
+   IDENTIFY DEVICE; the rest hold the command tables. */
+#define RFIS_OFS 1024
+#define IDENTIFY_OFS 2048
+#define PORT_PAGES (1 + DIV_ROUND_UP (SLOT_CNT * sizeof (struct cmd_table), \
+                                      PGSIZE))
+
+/* A SATA disk attached to an AHCI port. */
+struct ahci_disk
+  {
+    char name[8];               /* Name, e.g. "sda". */
+    int port_no;                /* Port number. */
+    volatile uint32_t *regs;    /* Port registers. */
+    uint8_t *mem;               /* PORT_PAGES pages for the adapter. */
+    struct cmd_header *cmd_list; /* SLOT_CNT command headers. */
+    struct cmd_table *tables;   /* SLOT_CNT command tables. */
+    block_sector_t capacity;    /* Size in sectors. */
+    size_t slot_cnt;            /* Command slots in use. */
+    bool ncq;                   /* Use native command queuing? */
+
+    /* Protected by disabling interrupts. */
+    uint32_t free_slots;        /* Bitmap of free slots. */
+    uint32_t busy_slots;        /* Bitmap of issued slots. */
+    struct block_request *requests[SLOT_CNT]; /* Request in each slot. */
+    struct semaphore free_cnt;  /* Number of free slots. */
+  };
+
+/* Disks found on the adapter.  We support only one adapter. */
+static struct ahci_disk disks[PORT_CNT];
+static size_t disk_cnt;
+
+/* Adapter registers. */
+static volatile uint32_t *hba;
+
+static struct block_operations ahci_operations;
+
+static void probe_port (int port_no, uint32_t cap);
+static bool identify (struct ahci_disk *, uint32_t cap);
+static void build_command (struct ahci_disk *, int slot, uint8_t command,
+                           block_sector_t, size_t cnt, void *buffer,
+                           size_t size, bool write);
+static bool wait_for (volatile uint32_t *reg, uint32_t mask, uint32_t value,
+                      int ms);
+static void interrupt_handler (struct intr_frame *);
+
+/* Returns the adapter register at byte offset REG. */
+static uint32_t
+hba_read (size_t reg)
+{
+  return hba[reg / 4];
+}
+
+/* Writes VALUE to the adapter register at byte offset REG. */
+static void
+hba_write (size_t reg, uint32_t value)
+{
+  hba[reg / 4] = value;
+}
+
+/* Returns D's port register at byte offset REG. */
+static uint32_t
+port_read (const struct ahci_disk *d, size_t reg)
+{
+  return d->regs[reg / 4];
+}
+
+/* Writes VALUE to D's port register at byte offset REG. */
+static void
+port_write (struct ahci_disk *d, size_t reg, uint32_t value)
+{
+  d->regs[reg / 4] = value;
+}
+
+/* Finds an AHCI adapter on the PCI bus and registers the SATA
+   disks attached to it with the block device layer. */
+void
+ahci_init (void)
+{
+  struct pci_dev dev;
+  uint32_t bar, cap, ports;
+  uint8_t irq;
+  int port_no;
+  size_t i;
+
+  if (!pci_find_class (PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, 0, &dev)
+      || dev.prog_if != PROG_IF_AHCI)
+    return;
+
+  /* The registers are in memory space at BAR5. */
+  bar = pci_read_config (&dev, PCI_REG_BAR0 + 5 * 4);
+  irq = pci_read_config (&dev, PCI_REG_INTERRUPT) & 0xff;
+  if ((bar & 1) != 0 || (bar & ~0xfu) == 0 || irq >= 16)
+    {
+      printf ("ahci: adapter not configured\n");
+      return;
+    }
+  pci_enable (&dev, PCI_CMD_MEMORY | PCI_CMD_MASTER);
+  hba = paging_map_io (bar & ~0xfu, PORT_BASE (PORT_CNT));
+
+  /* Reset the adapter and put it in AHCI mode. */
+  hba_write (HBA_GHC, GHC_AE);
+  hba_write (HBA_GHC, GHC_AE | GHC_HR);
+  if (!wait_for (&hba[HBA_GHC / 4], GHC_HR, 0, 1000))
+    {
+      printf ("ahci: reset timed out\n");
+      return;
+    }
+  hba_write (HBA_GHC, GHC_AE);
+
+  cap = hba_read (HBA_CAP);
+  ports = hba_read (HBA_PI);
+  for (port_no = 0; port_no < PORT_CNT; port_no++)
+    if (ports & (1u << port_no))
+      probe_port (port_no, cap);
+  if (disk_cnt == 0)
+    return;
+
+  /* Turn on interrupts, which reading the partition tables
+     needs. */
+  intr_register_ext (irq + 0x20, interrupt_handler, "ahci");
+  hba_write (HBA_IS, hba_read (HBA_IS));
+  hba_write (HBA_GHC, GHC_AE | GHC_IE);
+
+  for (i = 0; i < disk_cnt; i++)
+    {
+      struct ahci_disk *d = &disks[i];
+      struct block *block;
+
+      block = block_register (d->name, BLOCK_RAW,
+                              d->ncq ? "AHCI, NCQ" : "AHCI",
+                              d->capacity, &ahci_operations, d);
+      partition_scan (block);
+    }
+}
+
+/* Sets up port PORT_NO of an adapter with capabilities CAP and,
+   if an ATA disk is attached to it, identifies the disk and adds
+   it to DISKS. */
+static void
+probe_port (int port_no, uint32_t cap)
+{
+  struct ahci_disk *d = &disks[disk_cnt];
+  size_t i;
+
+  snprintf (d->name, sizeof d->name, "sd%c", (int) ('a' + disk_cnt));
+  d->port_no = port_no;
+  d->regs = hba + PORT_BASE (port_no) / 4;
+
+  /* Stop the port so that we can set it up. */
+  port_write (d, PX_CMD, port_read (d, PX_CMD) & ~CMD_ST);
+  if (!wait_for (&d->regs[PX_CMD / 4], CMD_CR, 0, 500))
+    return;
+  port_write (d, PX_CMD, port_read (d, PX_CMD) & ~CMD_FRE);
+  if (!wait_for (&d->regs[PX_CMD / 4], CMD_FR, 0, 500)
+      || (port_read (d, PX_SSTS) & 0xf) != SSTS_DET_PRESENT)
+    return;
+
+  d->mem = palloc_get_multiple (PAL_ZERO, PORT_PAGES);
+  if (d->mem == NULL)
+    return;
+  d->cmd_list = (struct cmd_header *) d->mem;
+  d->tables = (struct cmd_table *) (d->mem + PGSIZE);
+  for (i = 0; i < SLOT_CNT; i++)
+    d->cmd_list[i].table = vtop (&d->tables[i]);
+  port_write (d, PX_CLB, vtop (d->cmd_list));
+  port_write (d, PX_CLBU, 0);
+  port_write (d, PX_FB, vtop (d->mem + RFIS_OFS));
+  port_write (d, PX_FBU, 0);
+  port_write (d, PX_SERR, 0xffffffff);
+  port_write (d, PX_IS, 0xffffffff);
+
+  /* Receive the disk's signature, then start the port. */
+  port_write (d, PX_CMD, port_read (d, PX_CMD) | CMD_FRE);
+  if (wait_for (&d->regs[PX_TFD / 4], TFD_BSY | TFD_DRQ, 0, 1000)
+      && port_read (d, PX_SIG) == SIG_ATA)
+    {
+      port_write (d, PX_IE, IS_DHRS | IS_SDBS | IS_ERRORS);
+      port_write (d, PX_CMD, port_read (d, PX_CMD) | CMD_ST);
+      if (identify (d, cap))
+        {
+          d->free_slots = (d->slot_cnt < 32
+                           ? (1u << d->slot_cnt) - 1 : 0xffffffff);
+          d->busy_slots = 0;
+          sema_init (&d->free_cnt, d->slot_cnt);
+          port_write (d, PX_IS, 0xffffffff);
+          disk_cnt++;
+          return;
+        }
+      printf ("%s: identification failed\n", d->name);
+    }
+
+  port_write (d, PX_CMD, port_read (d, PX_CMD) & ~(CMD_ST | CMD_FRE));
+  if (wait_for (&d->regs[PX_CMD / 4], CMD_CR | CMD_FR, 0, 500))
+    palloc_free_multiple (d->mem, PORT_PAGES);
+}
+
+/* Sends IDENTIFY DEVICE to disk D, whose port is running, on an
+   adapter with capabilities CAP, polling for the response since
+   interrupts are not on yet.  Sets D's capacity, slot count, and
+   use of NCQ.  Returns true if successful, false if the disk did
+   not respond or is unsuitable. */
+static bool
+identify (struct ahci_disk *d, uint32_t cap)
+{
+  const uint16_t *id = (const uint16_t *) (d->mem + IDENTIFY_OFS);
+  uint64_t capacity;
+
+  build_command (d, 0, ATA_IDENTIFY_DEVICE, 0, 0, (void *) id,
+                 BLOCK_SECTOR_SIZE, false);
+  barrier ();
+  port_write (d, PX_CI, 1);
+  if (!wait_for (&d->regs[PX_CI / 4], 1, 0, 1000)
+      || (port_read (d, PX_TFD) & TFD_ERR) != 0)
+    return false;
+
+  /* We use 48-bit commands only, which word 83 bit 10 says the
+     disk supports.  Words 100...103 then give the capacity. */
+  if ((id[83] & 0x400) == 0)
+    return false;
+  capacity = (id[100] | (uint64_t) id[101] << 16
+              | (uint64_t) id[102] << 32 | (uint64_t) id[103] << 48);
+  d->capacity = capacity < UINT32_MAX ? capacity : UINT32_MAX;
+
+  /* Word 76 bit 8 says the disk supports NCQ, with the queue depth
+     minus 1 in bits 4:0 of word 75.  NCQ tags are slot numbers,
+     so use no more slots than tags. */
+  d->slot_cnt = CAP_NCS (cap);
+  d->ncq = (cap & CAP_SNCQ) != 0 && (id[76] & 0x100) != 0;
+  if (d->ncq && d->slot_cnt > (size_t) (id[75] & 0x1f) + 1)
+    d->slot_cnt = (id[75] & 0x1f) + 1;
+  return true;
+}
+
+/* Fills in command slot SLOT of disk D to send COMMAND for CNT
+   sectors starting at SECTOR, transferring SIZE bytes between the
+   disk and BUFFER: to the disk if WRITE is true, otherwise from
+   it.  Does not issue the command. */
+static void
+build_command (struct ahci_disk *d, int slot, uint8_t command,
+               block_sector_t sector, size_t cnt, void *buffer, size_t size,
+               bool write)
+{
+  struct cmd_header *h = &d->cmd_list[slot];
+  struct cmd_table *t = &d->tables[slot];
+  uint8_t *fis = t->fis;
+  uintptr_t paddr = vtop (buffer);
+  size_t prd_cnt;
+
+  ASSERT (paddr % 2 == 0);
+
+  memset (fis, 0, FIS_REG_H2D_DWORDS * 4);
+  fis[0] = FIS_TYPE_REG_H2D;
+  fis[1] = 0x80;                /* Command, not device control. */
+  fis[2] = command;
+  fis[4] = sector;
+  fis[5] = sector >> 8;
+  fis[6] = sector >> 16;
+  fis[7] = 0x40;                /* LBA mode. */
+  fis[8] = sector >> 24;
+  if (command == ATA_READ_FPDMA_QUEUED || command == ATA_WRITE_FPDMA_QUEUED)
+    {
+      /* Queued commands take the count in the features
+         registers and the tag in the count register. */
+      fis[3] = cnt;
+      fis[11] = cnt >> 8;
+      fis[12] = slot << 3;
+    }
+  else
+    {
+      fis[12] = cnt;
+      fis[13] = cnt >> 8;
+    }
+
+  /* Kernel virtual memory maps linearly to physical memory, so
+     the buffer is one physically contiguous piece, which we only
+     have to split into regions of at most PRD_MAX_BYTES. */
+  for (prd_cnt = 0; size > 0; prd_cnt++)
+    {
+      size_t chunk = size < PRD_MAX_BYTES ? size : PRD_MAX_BYTES;
+
+      ASSERT (prd_cnt < PRD_CNT);
+      t->prdt[prd_cnt].addr = paddr;
+      t->prdt[prd_cnt].addr_hi = 0;
+      t->prdt[prd_cnt].byte_cnt = chunk - 1;
+      paddr += chunk;
+      size -= chunk;
+    }
+
+  h->flags = FIS_REG_H2D_DWORDS | (write ? CH_WRITE : 0);
+  h->prdt_cnt = prd_cnt;
+  h->byte_cnt = 0;
+}
+
+/* Hands request R to disk D, first waiting for a free command slot
+   if all of them are in flight. */
+static void
+ahci_submit (void *d_, struct block_request *r)
+{
+  struct ahci_disk *d = d_;
+  enum intr_level old_level;
+  uint8_t command;
+  int slot;
+
+  ASSERT (is_kernel_vaddr (r->buffer));
+  ASSERT (r->cnt <= MAX_XFER_SECTORS);
+
+  sema_down (&d->free_cnt);
+  old_level = intr_disable ();
+  for (slot = 0; (d->free_slots & (1u << slot)) == 0; slot++)
+    continue;
+  d->free_slots &= ~(1u << slot);
+
+  if (d->ncq)
+    command = r->write ? ATA_WRITE_FPDMA_QUEUED : ATA_READ_FPDMA_QUEUED;
+  else
+    command = r->write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT;
+  build_command (d, slot, command, r->sector, r->cnt, r->buffer,
+                 r->cnt * BLOCK_SECTOR_SIZE, r->write);
+  d->requests[slot] = r;
+  d->busy_slots |= 1u << slot;
+
+  /* The adapter must see the command before it is issued. */
+  barrier ();
+  if (d->ncq)
+    port_write (d, PX_SACT, 1u << slot);
+  port_write (d, PX_CI, 1u << slot);
+  intr_set_level (old_level);
+}
+
+static struct block_operations ahci_operations =
+  {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    ahci_submit
+  };
+
+/* Completes the requests whose commands disk D has finished. */
+static void
+complete_commands (struct ahci_disk *d)
+{
+  /* A queued command leaves CI when the disk accepts it and SACT
+     when it finishes, so read them in that order. */
+  uint32_t issued = port_read (d, PX_CI);
+  uint32_t active = port_read (d, PX_SACT);
+  uint32_t done = d->busy_slots & ~(issued | active);
+  int slot;
+
+  for (slot = 0; done != 0; slot++)
+    if (done & (1u << slot))
+      {
+        struct block_request *r = d->requests[slot];
+
+        done &= ~(1u << slot);
+        d->busy_slots &= ~(1u << slot);
+        d->free_slots |= 1u << slot;
+        sema_up (&d->free_cnt);
+        r->complete (r);
+      }
+}
+
+/* AHCI interrupt handler. */
+static void
+interrupt_handler (struct intr_frame *f UNUSED)
+{
+  uint32_t is = hba_read (HBA_IS);
+  struct ahci_disk *d;
+
+  for (d = disks; d < disks + disk_cnt; d++)
+    if (is & (1u << d->port_no))
+      {
+        uint32_t port_is = port_read (d, PX_IS);
+
+        port_write (d, PX_IS, port_is);
+        if (port_is & IS_ERRORS)
+          PANIC ("%s: command failed, status=%#"PRIx32", tfd=%#"PRIx32,
+                 d->name, port_is, port_read (d, PX_TFD));
+        complete_commands (d);
+      }
+  hba_write (HBA_IS, is);
+}
+
+/* Waits up to MS milliseconds for the bits of *REG selected by
+   MASK to equal VALUE.  Returns true if they do, false on
+   timeout. */
+static bool
+wait_for (volatile uint32_t *reg, uint32_t mask, uint32_t value, int ms)
+{
+  int i;
+
+  for (i = 0; i < ms; i++)
+    {
+      if ((*reg & mask) == value)
+        return true;
+      timer_msleep (1);
+    }
+  return (*reg & mask) == value;
+}
@@ -0,0 +1,6 @@
+#ifndef DEVICES_AHCI_H
+#define DEVICES_AHCI_H
+
+void ahci_init (void);
+
+#endif /* devices/ahci.h */
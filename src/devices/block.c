@@ -3,7 +3,27 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Requests to a block device, other than one stacked on another
+   device, wait in the device's queue until its queue thread
+   serves them in C-LOOK elevator order, merging requests for
+   adjacent sectors into a single transfer.  block_read() and the
+   other synchronous functions submit a request and wait for it.
+
+   Every request is timed from submission to completion, for the
+   statistics that block_get_stats() reports. */
+
+/* Size of the buffer for merging requests whose buffers are not
+   themselves adjacent. */
+#define BOUNCE_PAGES 4
+#define BOUNCE_SECTORS (BOUNCE_PAGES * PGSIZE / BLOCK_SECTOR_SIZE)
 
 /* A block device. */
 struct block
@@ -17,8 +37,17 @@ struct block
     const struct block_operations *ops;  /* Driver operations. */
     void *aux;                          /* Extra data owned by driver. */
 
-    unsigned long long read_cnt;        /* Number of sectors read. */
-    unsigned long long write_cnt;       /* Number of sectors written. */
+    /* Statistics.  Updated with interrupts off, since requests
+       may complete in interrupt handlers. */
+    struct iostat stats;                /* Name, type, and counters. */
+    int64_t busy_start;                 /* When IN_FLIGHT became nonzero. */
+
+    /* Request queue, unused if OPS->submit is nonnull. */
+    struct lock queue_lock;             /* Protects the members below. */
+    struct list queue;                  /* Pending requests, oldest first. */
+    struct condition queue_ready;       /* Signaled when QUEUE gets one. */
+    block_sector_t head;                /* Sector after the last served. */
+    uint8_t *bounce;                    /* Merge buffer, or null. */
   };
 
 /* List of all block devices. */
@@ -28,6 +57,9 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void submit_and_wait (struct block *, struct block_request *);
+static void finish_request (struct block_request *);
+static thread_func queue_thread;
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -120,9 +152,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_read_multiple (block, sector, 1, buffer);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +163,370 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_write_multiple (block, sector, 1, buffer);
+}
+
+/* Verifies that the CNT sectors starting at SECTOR are within
+   BLOCK.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  if (cnt > 0)
+    {
+      check_sector (block, sector);
+      check_sector (block, sector + (cnt - 1));
+    }
+}
+
+/* Reads CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that can do so transfer all of the sectors in
+   a single request.  Internally synchronizes accesses to block
+   devices, like block_read(). */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  struct block_request r;
+
+  r.sector = sector;
+  r.cnt = cnt;
+  r.buffer = buffer;
+  r.write = false;
+  submit_and_wait (block, &r);
+}
+
+/* Writes CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Drivers that can do so transfer all of the sectors in a single
+   request.  Returns after the block device has acknowledged
+   receiving the data.  Internally synchronizes accesses to block
+   devices, like block_write(). */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      size_t cnt, const void *buffer)
+{
+  struct block_request r;
+
+  r.sector = sector;
+  r.cnt = cnt;
+  r.buffer = (void *) buffer;
+  r.write = true;
+  submit_and_wait (block, &r);
+}
+
+/* Completion function for submit_and_wait(). */
+static void
+wake_submitter (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+/* Submits R to BLOCK and waits for it to complete. */
+static void
+submit_and_wait (struct block *block, struct block_request *r)
+{
+  struct semaphore done;
+
+  sema_init (&done, 0);
+  r->complete = wake_submitter;
+  r->aux = &done;
+  block_submit (block, r);
+  sema_down (&done);
+}
+
+/* Accounts for request R, about to be submitted to BLOCK.
+   Arranges for finish_request() to see R complete first, unless
+   R has already been submitted to a device stacked on BLOCK. */
+static void
+start_request (struct block *block, struct block_request *r)
+{
+  enum intr_level old_level;
+
+  if (r->complete != finish_request)
+    {
+      r->done = r->complete;
+      r->complete = finish_request;
+      r->path_cnt = 0;
+      r->start = timer_usecs ();
+    }
+  ASSERT (r->path_cnt < BLOCK_PATH_MAX);
+  r->path[r->path_cnt++] = block;
+
+  old_level = intr_disable ();
+  if (block->stats.in_flight++ == 0)
+    block->busy_start = r->start;
+  if (block->stats.in_flight > block->stats.max_in_flight)
+    block->stats.max_in_flight = block->stats.in_flight;
+  intr_set_level (old_level);
+}
+
+/* Returns the latency histogram bucket for a request that took
+   US microseconds. */
+static int
+latency_bucket (uint64_t us)
+{
+  int bucket = 0;
+
+  while (us >= 2 && bucket < IOSTAT_BUCKETS - 1)
+    {
+      us >>= 1;
+      bucket++;
+    }
+  return bucket;
+}
+
+/* Completion function for every request: accounts for R on each
+   device it was submitted to, then passes it on to the
+   submitter's completion function. */
+static void
+finish_request (struct block_request *r)
+{
+  int64_t now = timer_usecs ();
+  uint64_t latency = now > r->start ? now - r->start : 0;
+  uint64_t bytes = (uint64_t) r->cnt * BLOCK_SECTOR_SIZE;
+  enum intr_level old_level;
+  int i;
+
+  old_level = intr_disable ();
+  for (i = 0; i < r->path_cnt; i++)
+    {
+      struct block *block = r->path[i];
+      struct iostat *st = &block->stats;
+
+      if (r->write)
+        {
+          st->write_cnt++;
+          st->write_bytes += bytes;
+        }
+      else
+        {
+          st->read_cnt++;
+          st->read_bytes += bytes;
+        }
+      st->latency_us += latency;
+      st->latency_hist[latency_bucket (latency)]++;
+      if (--st->in_flight == 0 && now > block->busy_start)
+        st->busy_us += now - block->busy_start;
+    }
+  intr_set_level (old_level);
+
+  r->complete = r->done;
+  r->complete (r);
+}
+
+/* Submits request R to BLOCK and returns without waiting for it.
+   R->complete will be called once R is done.
+   Requests are not necessarily served in the order submitted.
+   A queued request is never served before an earlier one for
+   any of the same sectors, but devices with a submit operation
+   make no such promise, so callers that need one request to
+   follow another should wait for the first to complete. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  check_sectors (block, r->sector, r->cnt);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  start_request (block, r);
+
+  if (r->cnt == 0)
+    r->complete (r);
+  else if (block->ops->submit != NULL)
+    block->ops->submit (block->aux, r);
+  else
+    {
+      lock_acquire (&block->queue_lock);
+      list_push_back (&block->queue, &r->elem);
+      cond_signal (&block->queue_ready, &block->queue_lock);
+      lock_release (&block->queue_lock);
+    }
+}
+
+/* Returns true if requests A and B have any sectors in common. */
+static bool
+overlaps (const struct block_request *a, const struct block_request *b)
+{
+  return a->sector < b->sector + b->cnt && b->sector < a->sector + a->cnt;
+}
+
+/* Returns true if R, in BLOCK's queue, may be served now, that
+   is, no older request in the queue is for any of its sectors. */
+static bool
+may_serve (struct block *block, struct block_request *r)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&block->queue); e != &r->elem; e = list_next (e))
+    if (overlaps (list_entry (e, struct block_request, elem), r))
+      return false;
+  return true;
+}
+
+/* Returns true if, with the head at sector HEAD, C-LOOK serves a
+   request at sector A before one at sector B. */
+static bool
+clook_before (block_sector_t a, block_sector_t b, block_sector_t head)
+{
+  bool a_ahead = a >= head;
+  bool b_ahead = b >= head;
+
+  return a_ahead != b_ahead ? a_ahead : a < b;
+}
+
+/* Moves the next requests to serve from BLOCK's queue, which must
+   not be empty, to BATCH, and returns the number of sectors they
+   cover.
+
+   The first request is chosen in C-LOOK order: the one at the
+   lowest sector at or after the head, or failing that the lowest
+   sector overall, so that the head sweeps across the disk in one
+   direction and every request is served within one sweep.  Then
+   requests in the same direction that start where the batch
+   ends are added to it, as long as they fit in the bounce
+   buffer. */
+static size_t
+next_batch (struct block *block, struct list *batch)
+{
+  struct block_request *first = NULL;
+  struct list_elem *e;
+  size_t cnt;
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if ((first == NULL
+           || clook_before (r->sector, first->sector, block->head))
+          && may_serve (block, r))
+        first = r;
+    }
+  ASSERT (first != NULL);
+
+  list_remove (&first->elem);
+  list_push_back (batch, &first->elem);
+  cnt = first->cnt;
+
+  while (block->bounce != NULL)
+    {
+      struct block_request *next = NULL;
+
+      for (e = list_begin (&block->queue); e != list_end (&block->queue);
+           e = list_next (e))
+        {
+          struct block_request *r = list_entry (e, struct block_request,
+                                                elem);
+          if (r->write == first->write
+              && r->sector == first->sector + cnt
+              && cnt + r->cnt <= BOUNCE_SECTORS
+              && may_serve (block, r))
+            {
+              next = r;
+              break;
+            }
+        }
+      if (next == NULL)
+        break;
+
+      list_remove (&next->elem);
+      list_push_back (batch, &next->elem);
+      cnt += next->cnt;
+    }
+
+  block->head = first->sector + cnt;
+  return cnt;
+}
+
+/* Has BLOCK's driver transfer CNT sectors starting at SECTOR
+   between the device and BUFFER, writing to the device if WRITE
+   is true, otherwise reading from it. */
+static void
+transfer (struct block *block, bool write, block_sector_t sector,
+          size_t cnt, uint8_t *buffer)
+{
+  const struct block_operations *ops = block->ops;
+  size_t i;
+
+  if (write && ops->write_multiple != NULL)
+    ops->write_multiple (block->aux, sector, cnt, buffer);
+  else if (!write && ops->read_multiple != NULL)
+    ops->read_multiple (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      if (write)
+        ops->write (block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+      else
+        ops->read (block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+}
+
+/* Serves the CNT sectors of requests in BATCH, in order by
+   sector, on BLOCK, and completes them.  A batch of more than
+   one request goes through the bounce buffer, so that it takes
+   a single transfer. */
+static void
+serve_batch (struct block *block, struct list *batch, size_t cnt)
+{
+  struct block_request *first = list_entry (list_front (batch),
+                                            struct block_request, elem);
+  struct list_elem *e;
+
+  if (list_next (&first->elem) == list_end (batch))
+    transfer (block, first->write, first->sector, cnt, first->buffer);
+  else
+    {
+      uint8_t *p;
+
+      if (first->write)
+        for (p = block->bounce, e = list_begin (batch); e != list_end (batch);
+             e = list_next (e))
+          {
+            struct block_request *r = list_entry (e, struct block_request,
+                                                  elem);
+            memcpy (p, r->buffer, r->cnt * BLOCK_SECTOR_SIZE);
+            p += r->cnt * BLOCK_SECTOR_SIZE;
+          }
+      transfer (block, first->write, first->sector, cnt, block->bounce);
+      if (!first->write)
+        for (p = block->bounce, e = list_begin (batch); e != list_end (batch);
+             e = list_next (e))
+          {
+            struct block_request *r = list_entry (e, struct block_request,
+                                                  elem);
+            memcpy (r->buffer, p, r->cnt * BLOCK_SECTOR_SIZE);
+            p += r->cnt * BLOCK_SECTOR_SIZE;
+          }
+    }
+
+  /* A request may vanish as soon as it is completed, so take it
+     off the batch first. */
+  while (!list_empty (batch))
+    {
+      struct block_request *r = list_entry (list_pop_front (batch),
+                                            struct block_request, elem);
+      r->complete (r);
+    }
+}
+
+/* Thread function that serves the request queue of BLOCK_. */
+static void
+queue_thread (void *block_)
+{
+  struct block *block = block_;
+
+  for (;;)
+    {
+      struct list batch;
+      size_t cnt;
+
+      list_init (&batch);
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_ready, &block->queue_lock);
+      cnt = next_batch (block, &batch);
+      lock_release (&block->queue_lock);
+
+      serve_batch (block, &batch, cnt);
+    }
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,6 +550,19 @@ block_type (struct block *block)
   return block->type;
 }
 
+/* Stores a snapshot of BLOCK's statistics in ST. */
+void
+block_get_stats (struct block *block, struct iostat *st)
+{
+  enum intr_level old_level = intr_disable ();
+  int64_t now = timer_usecs ();
+
+  *st = block->stats;
+  if (st->in_flight > 0 && now > block->busy_start)
+    st->busy_us += now - block->busy_start;
+  intr_set_level (old_level);
+}
+
 /* Prints statistics for each block device used for a Pintos role. */
 void
 block_print_stats (void)
@@ -171,13 +574,46 @@ block_print_stats (void)
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
+          struct iostat st;
+
+          block_get_stats (block, &st);
           printf ("%s (%s): %llu reads, %llu writes\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  st.read_bytes / BLOCK_SECTOR_SIZE,
+                  st.write_bytes / BLOCK_SECTOR_SIZE);
         }
     }
 }
 
+/* Prints detailed statistics for every block device, including
+   the nonempty buckets of its latency histogram. */
+void
+block_print_iostat (void)
+{
+  struct block *block;
+
+  for (block = block_first (); block != NULL; block = block_next (block))
+    {
+      struct iostat st;
+      uint64_t req_cnt;
+      int i;
+
+      block_get_stats (block, &st);
+      req_cnt = st.read_cnt + st.write_cnt;
+      printf ("%s (%s): %llu reads (%llu kB), %llu writes (%llu kB), "
+              "busy %llu ms, %u in flight (max %u), mean latency %llu us\n",
+              st.name, st.type, st.read_cnt, st.read_bytes / 1024,
+              st.write_cnt, st.write_bytes / 1024, st.busy_us / 1000,
+              st.in_flight, st.max_in_flight,
+              req_cnt > 0 ? st.latency_us / req_cnt : 0);
+      for (i = 0; i < IOSTAT_BUCKETS; i++)
+        if (st.latency_hist[i] != 0)
+          printf ("  %8lu-%lu us: %u\n",
+                  i > 0 ? 1ul << i : 0ul, (2ul << i) - 1,
+                  st.latency_hist[i]);
+    }
+}
+
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
@@ -189,17 +625,38 @@ block_register (const char *name, enum block_type type,
                 const struct block_operations *ops, void *aux)
 {
   struct block *block = malloc (sizeof *block);
+  enum intr_level old_level;
+
   if (block == NULL)
     PANIC ("Failed to allocate memory for block device descriptor");
 
-  list_push_back (&all_blocks, &block->list_elem);
   strlcpy (block->name, name, sizeof block->name);
   block->type = type;
   block->size = size;
   block->ops = ops;
   block->aux = aux;
-  block->read_cnt = 0;
-  block->write_cnt = 0;
+  memset (&block->stats, 0, sizeof block->stats);
+  strlcpy (block->stats.name, name, sizeof block->stats.name);
+  strlcpy (block->stats.type, block_type_name (type),
+           sizeof block->stats.type);
+  block->busy_start = 0;
+  if (ops->submit == NULL)
+    {
+      ASSERT (ops->read != NULL && ops->write != NULL);
+      lock_init (&block->queue_lock);
+      list_init (&block->queue);
+      cond_init (&block->queue_ready);
+      block->head = 0;
+      block->bounce = palloc_get_multiple (0, BOUNCE_PAGES);
+      thread_create (block->name, PRI_MAX, queue_thread, block);
+    }
+
+  /* Drivers may register devices from several threads, so add
+     BLOCK to the list atomically, once it is ready for use, so
+     that other threads can search the list meanwhile. */
+  old_level = intr_disable ();
+  list_push_back (&all_blocks, &block->list_elem);
+  intr_set_level (old_level);
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
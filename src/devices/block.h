@@ -1,8 +1,11 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <list.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <iostat.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,18 +56,71 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Maximum number of devices a request passes through: a
+   partition and the disk that holds it. */
+#define BLOCK_PATH_MAX 2
+
+/* An asynchronous request to read or write consecutive sectors.
+   The submitter fills in SECTOR through AUX.  From then until
+   COMPLETE is called, once the transfer is done, the request
+   belongs to the block layer, which may change SECTOR and
+   COMPLETE.  COMPLETE may be called from an interrupt handler,
+   so it must not sleep. */
+struct block_request
+  {
+    struct list_elem elem;      /* Owned by the block layer. */
+    block_sector_t sector;      /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    void *buffer;               /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                 /* Write rather than read? */
+    void (*complete) (struct block_request *); /* Called when done. */
+    void *aux;                  /* For the submitter's use. */
+
+    /* Owned by the block layer, for statistics. */
+    struct block *path[BLOCK_PATH_MAX]; /* Devices submitted to. */
+    int path_cnt;               /* Number of devices in PATH. */
+    void (*done) (struct block_request *); /* Submitter's COMPLETE. */
+    int64_t start;              /* Time submitted, in microseconds. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+
 /* Statistics. */
+void block_get_stats (struct block *, struct iostat *);
 void block_print_stats (void);
+void block_print_iostat (void);
 
 /* Lower-level interface to block device drivers. */
 
 struct block_operations
   {
+    /* Transfer one sector.  Called only from the device's request
+       queue thread, so drivers need no locking of their own
+       unless they share hardware among devices. */
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional: transfer CNT consecutive sectors at once.  If
+       null, the sectors are transferred one at a time. */
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+
+    /* Optional: take request R directly, for devices stacked on
+       another, such as partitions, which pass it on to the
+       underlying device, and for devices that keep many requests
+       in flight and schedule them themselves.  Devices with this
+       operation have no queue in the block layer and need none
+       of the others. */
+    void (*submit) (void *aux, struct block_request *r);
   };
 
 struct block *block_register (const char *name, enum block_type,
@@ -5,13 +5,21 @@
 #include <stdio.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  Where the
+   controller is a PCI bus master, such as the PIIX emulated by
+   QEMU and Bochs, data is moved by DMA as described in the
+   "Programming Interface for Bus Master IDE Controller"
+   specification; otherwise, and for buffers DMA cannot reach, it
+   is moved by PIO. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -30,10 +38,27 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus master ports per channel. */
+#define BM_CHANNEL_PORTS 8
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_TO_MEMORY 0x08   /* Direction: 1=disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERR 0x02         /* Error, cleared by writing 1. */
+#define BM_STA_INTR 0x04        /* Interrupt, cleared by writing 1. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +74,32 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors that one READ or WRITE command can transfer. */
+#define MAX_XFER_SECTORS 256
+
+/* A physical region descriptor, which tells the bus master where
+   one physically contiguous piece of a DMA transfer lives.  A
+   region may not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address, even. */
+    uint16_t size;              /* Size in bytes, even, 0 for 64 kB. */
+    uint16_t flags;             /* PRD_EOT or 0. */
+  };
+
+#define PRD_BOUNDARY 65536      /* Regions may not cross this. */
+#define PRD_EOT 0x8000          /* Last descriptor in the table. */
+
+/* Descriptors per table.  The largest transfer is physically
+   contiguous and may cross two 64 kB boundaries, so it needs 3;
+   we round up to a power of 2 to make aligning the table easy. */
+#define PRD_CNT 4
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +108,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    size_t multiple;            /* Sectors per DRQ block for READ and
+                                   WRITE MULTIPLE, 0 if not in use. */
+    bool dma;                   /* Transfer data by DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -66,11 +120,14 @@ struct channel
     char name[8];               /* Name, e.g. "ide0". */
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
+    uint16_t bm_base;           /* Bus master base port, 0 if none. */
+    struct prd *prdt;           /* Bus master PRD table. */
 
     struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
+    struct semaphore probed;    /* Up'd once disks are registered. */
 
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
@@ -79,16 +136,33 @@ struct channel
 #define CHANNEL_CNT 2
 static struct channel channels[CHANNEL_CNT];
 
+/* PRD tables, one per channel.  The bus master requires each
+   table to be 4-byte aligned and not to cross a 64 kB boundary,
+   which aligning it to its own size ensures. */
+static struct prd prdts[CHANNEL_CNT][PRD_CNT]
+  __attribute__ ((aligned (sizeof (struct prd[PRD_CNT]))));
+
 static struct block_operations ide_operations;
 
-static void reset_channel (struct channel *);
+static thread_func probe_channel;
+static bool reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
-
-static void select_sector (struct ata_disk *, block_sector_t);
+static void enable_multiple_mode (struct ata_disk *, const uint16_t *id);
+static uint16_t find_bus_master (void);
+
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt,
+                      void *);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       const void *);
+static bool can_dma (const struct ata_disk *, const void *);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          const void *, bool to_disk);
+
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
-static void input_sector (struct channel *, void *);
-static void output_sector (struct channel *, const void *);
+static void input_sectors (struct channel *, void *, size_t cnt);
+static void output_sectors (struct channel *, const void *, size_t cnt);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -97,10 +171,20 @@ static void select_device_wait (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
-/* Initialize the disk subsystem and detect disks. */
+/* Initialize the disk subsystem and start detecting disks.  If
+   USE_DMA is true, data is transferred by bus-master DMA where
+   the controller and disks support it.
+
+   Each channel is probed by a thread of its own, since resetting
+   a channel means waiting for its disks, so that the channels
+   wait at the same time and the caller need not wait at all.
+   Use ide_wait() to wait until the disks are registered.  They
+   are registered in order by name, after any block devices that
+   the caller registers meanwhile. */
 void
-ide_init (void) 
+ide_init (bool use_dma) 
 {
+  uint16_t bm_base = use_dma ? find_bus_master () : 0;
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -123,9 +207,12 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * BM_CHANNEL_PORTS : 0;
+      c->prdt = prdts[chan_no];
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      sema_init (&c->probed, 0);
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,32 +223,67 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
       intr_register_ext (c->irq, interrupt_handler, c->name);
 
-      /* Reset hardware. */
-      reset_channel (c);
+      thread_create (c->name, PRI_DEFAULT, probe_channel, c);
+    }
+}
 
-      /* Distinguish ATA hard disks from other devices. */
-      if (check_device_type (&c->devices[0]))
-        check_device_type (&c->devices[1]);
+/* Waits until every IDE disk has been detected and registered. */
+void
+ide_wait (void)
+{
+  struct channel *c;
 
-      /* Read hard disk identity information. */
-      for (dev_no = 0; dev_no < 2; dev_no++)
-        if (c->devices[dev_no].is_ata)
-          identify_ata_device (&c->devices[dev_no]);
+  for (c = channels; c < channels + CHANNEL_CNT; c++)
+    {
+      sema_down (&c->probed);
+      sema_up (&c->probed);
     }
 }
+
+/* Thread function that detects the disks on channel C_ and
+   registers them. */
+static void
+probe_channel (void *c_)
+{
+  struct channel *c = c_;
+  int dev_no;
+
+  /* Reset hardware and distinguish ATA hard disks from other
+     devices. */
+  if (reset_channel (c) && check_device_type (&c->devices[0]))
+    check_device_type (&c->devices[1]);
+
+  /* Register disks in order by name, even though channels finish
+     resetting in any order. */
+  if (c > channels)
+    {
+      sema_down (&c[-1].probed);
+      sema_up (&c[-1].probed);
+    }
+
+  /* Read hard disk identity information. */
+  for (dev_no = 0; dev_no < 2; dev_no++)
+    if (c->devices[dev_no].is_ata)
+      identify_ata_device (&c->devices[dev_no]);
+
+  sema_up (&c->probed);
+}
 
 /* Disk detection and identification. */
 
 static char *descramble_ata_string (char *, int size);
 
 /* Resets an ATA channel and waits for any devices present on it
-   to finish the reset. */
-static void
+   to finish the reset.  Returns false, without resetting, if no
+   devices are present. */
+static bool
 reset_channel (struct channel *c) 
 {
   bool present[2];
@@ -187,6 +309,8 @@ reset_channel (struct channel *c)
       present[dev_no] = (inb (reg_nsect (c)) == 0x55
                          && inb (reg_lbal (c)) == 0xaa);
     }
+  if (!present[0] && !present[1])
+    return false;
 
   /* Issue soft reset sequence, which selects device 0 as a side effect.
      Also enable interrupts. */
@@ -196,7 +320,10 @@ reset_channel (struct channel *c)
   timer_usleep (10);
   outb (reg_ctl (c), 0);
 
-  timer_msleep (150);
+  /* The status is not valid until 2 ms after a reset.  Then we
+     poll for BSY to clear, since a reset does not interrupt when
+     it is done. */
+  timer_msleep (2);
 
   /* Wait for device 0 to clear BSY. */
   if (present[0]) 
@@ -219,6 +346,7 @@ reset_channel (struct channel *c)
         }
       wait_while_busy (&c->devices[1]);
     }
+  return true;
 }
 
 /* Checks whether device D is an ATA disk and sets D's is_ata
@@ -279,15 +407,18 @@ identify_ata_device (struct ata_disk *d)
       d->is_ata = false;
       return;
     }
-  input_sector (c, id);
+  input_sectors (c, id, 1);
 
   /* Calculate capacity.
      Read model name and serial number. */
   capacity = *(uint32_t *) &id[60 * 2];
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
+  /* Word 49 bit 8 says the disk supports DMA. */
+  d->dma = c->bm_base != 0 && (((const uint16_t *) id)[49] & 0x100) != 0;
   snprintf (extra_info, sizeof extra_info,
-            "model \"%s\", serial \"%s\"", model, serial);
+            "model \"%s\", serial \"%s\"%s", model, serial,
+            d->dma ? ", DMA" : "");
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
@@ -304,11 +435,69 @@ identify_ata_device (struct ata_disk *d)
     }
 
   /* Register. */
+  enable_multiple_mode (d, (const uint16_t *) id);
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
   partition_scan (block);
 }
 
+/* Turns on READ and WRITE MULTIPLE for disk D, whose IDENTIFY
+   DEVICE data is ID, with DRQ blocks of as many sectors as the
+   disk allows, up to a whole page, so that reading or writing a
+   page takes a single interrupt rather than one per sector.
+   Leaves D->multiple at 0 if the disk does not support it. */
+static void
+enable_multiple_mode (struct ata_disk *d, const uint16_t *id)
+{
+  struct channel *c = d->channel;
+  size_t max = id[47] & 0xff;
+  size_t multiple;
+
+  if (max > PGSIZE / BLOCK_SECTOR_SIZE)
+    max = PGSIZE / BLOCK_SECTOR_SIZE;
+  if (max < 2)
+    return;
+
+  /* The count must be a power of 2. */
+  for (multiple = 1; multiple * 2 <= max; multiple *= 2)
+    continue;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), multiple);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_status (c)) & STA_ERR) == 0)
+    d->multiple = multiple;
+}
+
+/* Looks for a PCI IDE controller that runs both channels at the
+   legacy ports and can act as a bus master, and allows it to do
+   so.  Returns the base of its bus master ports, or 0 if there
+   is no such controller. */
+static uint16_t
+find_bus_master (void)
+{
+  struct pci_dev dev;
+  uint32_t bar;
+
+  /* Programming interface bit 7 says the controller is a bus
+     master; bits 0 and 2 say a channel is in native mode, at
+     ports we don't know about. */
+  if (!pci_find_class (PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0, &dev)
+      || (dev.prog_if & 0x80) == 0
+      || (dev.prog_if & 0x05) != 0)
+    return 0;
+
+  /* The bus master ports are in I/O space at BAR4. */
+  bar = pci_read_config (&dev, PCI_REG_BAR0 + 4 * 4);
+  if ((bar & 1) == 0 || (bar & 0xfffc) == 0)
+    return 0;
+
+  pci_enable (&dev, PCI_CMD_IO | PCI_CMD_MASTER);
+  return bar & 0xfffc;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +526,106 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Reads CNT consecutive sectors starting at SEC_NO from disk D
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Up to MAX_XFER_SECTORS sectors are read per command,
+   by DMA if possible and otherwise by PIO.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t xfer = cnt < MAX_XFER_SECTORS ? cnt : MAX_XFER_SECTORS;
+
+      if (!can_dma (d, buffer) || !dma_transfer (d, sec_no, xfer, buffer,
+                                                 false))
+        pio_read (d, sec_no, xfer, buffer);
+
+      sec_no += xfer;
+      buffer += xfer * BLOCK_SECTOR_SIZE;
+      cnt -= xfer;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes CNT consecutive sectors starting at SEC_NO to disk D
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes,
+   transferring them as ide_read_multiple() does.  Returns after
+   the disk has acknowledged receiving the data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer_)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  const uint8_t *buffer = buffer_;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t xfer = cnt < MAX_XFER_SECTORS ? cnt : MAX_XFER_SECTORS;
+
+      if (!can_dma (d, buffer) || !dma_transfer (d, sec_no, xfer, buffer,
+                                                 true))
+        pio_write (d, sec_no, xfer, buffer);
+
+      sec_no += xfer;
+      buffer += xfer * BLOCK_SECTOR_SIZE;
+      cnt -= xfer;
+    }
   lock_release (&c->lock);
 }
 
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+ide_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d, sec_no, 1, buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data. */
+static void
+ide_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d, sec_no, 1, buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    NULL
   };
-
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT, which may be up to MAX_XFER_SECTORS, to
+   the disk's sector selection and count registers.  (We use LBA
+   mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_XFER_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_XFER_SECTORS);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -401,8 +633,8 @@ select_sector (struct ata_disk *d, block_sector_t sec_no)
         DEV_MBS | DEV_LBA | (d->dev_no == 1 ? DEV_DEV : 0) | (sec_no >> 24));
 }
 
-/* Writes COMMAND to channel C and prepares for receiving a
-   completion interrupt. */
+/* Writes COMMAND, which may be a PIO or a DMA command, to channel
+   C and prepares for receiving a completion interrupt. */
 static void
 issue_pio_command (struct channel *c, uint8_t command) 
 {
@@ -414,22 +646,163 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
-/* Reads a sector from channel C's data register in PIO mode into
-   SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
+/* Reads CNT sectors from channel C's data register in PIO mode
+   into SECTORS, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
 static void
-input_sector (struct channel *c, void *sector) 
+input_sectors (struct channel *c, void *sectors, size_t cnt) 
 {
-  insw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  insw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
-/* Writes SECTOR to channel C's data register in PIO mode.
-   SECTOR must contain BLOCK_SECTOR_SIZE bytes. */
+/* Writes CNT sectors from SECTORS to channel C's data register in
+   PIO mode.  SECTORS must contain CNT * BLOCK_SECTOR_SIZE bytes. */
 static void
-output_sector (struct channel *c, const void *sector) 
+output_sectors (struct channel *c, const void *sectors, size_t cnt) 
 {
-  outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  outsw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Reads CNT sectors, at most MAX_XFER_SECTORS, starting at SEC_NO
+   from disk D into BUFFER by PIO.  With READ MULTIPLE the disk
+   interrupts once per DRQ block of D->multiple sectors rather
+   than once per sector.  D's channel must be locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          void *buffer_)
+{
+  struct channel *c = d->channel;
+  size_t per_drq = d->multiple > 0 ? d->multiple : 1;
+  uint8_t *buffer = buffer_;
+  size_t done;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0
+                         ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY));
+  for (done = 0; done < cnt; done += per_drq)
+    {
+      size_t block_cnt = cnt - done < per_drq ? cnt - done : per_drq;
+
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      input_sectors (c, buffer + done * BLOCK_SECTOR_SIZE, block_cnt);
+    }
+}
+
+/* Writes CNT sectors, at most MAX_XFER_SECTORS, starting at
+   SEC_NO to disk D from BUFFER by PIO, as pio_read() reads them.
+   D's channel must be locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const void *buffer_)
+{
+  struct channel *c = d->channel;
+  size_t per_drq = d->multiple > 0 ? d->multiple : 1;
+  const uint8_t *buffer = buffer_;
+  size_t done;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0
+                         ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY));
+  for (done = 0; done < cnt; done += per_drq)
+    {
+      size_t block_cnt = cnt - done < per_drq ? cnt - done : per_drq;
+
+      /* The disk asks for the first block right away and
+         interrupts when it is ready for each later one. */
+      if (done > 0)
+        sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      output_sectors (c, buffer + done * BLOCK_SECTOR_SIZE, block_cnt);
+    }
+  sema_down (&c->completion_wait);
+}
+
+/* Returns true if disk D can transfer data to or from BUFFER by
+   DMA.  The bus master needs a physical address, and only kernel
+   virtual addresses map to physical memory linearly, so that a
+   buffer contiguous in one is contiguous in the other. */
+static bool
+can_dma (const struct ata_disk *d, const void *buffer)
+{
+  return d->dma && is_kernel_vaddr (buffer) && (uintptr_t) buffer % 2 == 0;
+}
+
+/* Fills in the PRD table of channel C to describe the SIZE bytes
+   at BUFFER. */
+static void
+build_prdt (struct channel *c, const void *buffer, size_t size)
+{
+  uintptr_t paddr = vtop (buffer);
+  struct prd *prd;
+
+  for (prd = c->prdt; ; prd++)
+    {
+      size_t room = PRD_BOUNDARY - paddr % PRD_BOUNDARY;
+      size_t chunk = size < room ? size : room;
+
+      ASSERT (prd < c->prdt + PRD_CNT);
+      prd->addr = paddr;
+      prd->size = chunk % PRD_BOUNDARY;
+      prd->flags = 0;
+
+      paddr += chunk;
+      size -= chunk;
+      if (size == 0)
+        break;
+    }
+  prd->flags = PRD_EOT;
+}
+
+/* Transfers CNT sectors, at most MAX_XFER_SECTORS, starting at
+   SEC_NO between disk D and BUFFER by bus-master DMA: to the disk
+   if TO_DISK is true, otherwise from it.  The calling thread
+   sleeps until the disk interrupts at the end of the transfer,
+   leaving the CPU to other threads.  D's channel must be locked.
+
+   Returns true if successful.  On failure, turns off DMA for D
+   and returns false, so that the caller can retry by PIO. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              const void *buffer, bool to_disk)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = to_disk ? 0 : BM_CMD_TO_MEMORY;
+  uint8_t bm_status, status;
+
+  ASSERT (can_dma (d, buffer));
+
+  /* Set up the bus master. */
+  build_prdt (c, buffer, cnt * BLOCK_SECTOR_SIZE);
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+
+  /* Issue the command, start the bus master, and wait. */
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, to_disk ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), direction | BM_CMD_START);
+  sema_down (&c->completion_wait);
+
+  /* Stop the bus master and check for errors. */
+  outb (reg_bm_command (c), direction);
+  bm_status = inb (reg_bm_status (c));
+  status = inb (reg_status (c));
+  outb (reg_bm_status (c), bm_status | BM_STA_ERR | BM_STA_INTR);
+  if ((bm_status & BM_STA_ERR) != 0 || (status & STA_ERR) != 0)
+    {
+      printf ("%s: DMA %s failed, sector=%"PRDSNu", using PIO\n",
+              d->name, to_disk ? "write" : "read", sec_no);
+      d->dma = false;
+      return false;
+    }
+  return true;
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
@@ -1,6 +1,9 @@
 #ifndef DEVICES_IDE_H
 #define DEVICES_IDE_H
 
-void ide_init (void);
+#include <stdbool.h>
+
+void ide_init (bool use_dma);
+void ide_wait (void);
 
 #endif /* devices/ide.h */
@@ -0,0 +1,189 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/interrupt.h"
+#include "threads/io.h"
+
+/* This code reads and writes PCI configuration space using
+   configuration mechanism #1, which every PCI host bridge
+   emulated by QEMU and Bochs supports.  See the PCI Local Bus
+   Specification for details. */
+
+/* I/O ports for configuration mechanism #1. */
+#define CONFIG_ADDRESS 0xcf8    /* Selects a configuration register. */
+#define CONFIG_DATA 0xcfc       /* Reads or writes the selected register. */
+
+/* Number of buses, devices per bus, and functions per device. */
+#define BUS_CNT 256
+#define SLOT_CNT 32
+#define FUNC_CNT 8
+
+static uint32_t read_config (uint8_t bus, uint8_t slot, uint8_t func,
+                             uint8_t reg);
+static void write_config (uint8_t bus, uint8_t slot, uint8_t func,
+                          uint8_t reg, uint32_t value);
+static void select_register (uint8_t bus, uint8_t slot, uint8_t func,
+                             uint8_t reg);
+
+/* Searches the PCI buses for the IDX'th function, counting from
+   0, for which MATCH returns true given AUX.  If there is one,
+   stores its description in *DEV and returns true; otherwise,
+   returns false. */
+static bool
+find (bool (*match) (const struct pci_dev *, const void *aux),
+      const void *aux, size_t idx, struct pci_dev *dev)
+{
+  int bus, slot, func;
+
+  for (bus = 0; bus < BUS_CNT; bus++)
+    for (slot = 0; slot < SLOT_CNT; slot++)
+      for (func = 0; func < FUNC_CNT; func++)
+        {
+          uint32_t id = read_config (bus, slot, func, PCI_REG_ID);
+          uint32_t class_reg;
+
+          if ((id & 0xffff) == 0xffff)
+            {
+              /* No function 0 means no device at all. */
+              if (func == 0)
+                break;
+              continue;
+            }
+
+          class_reg = read_config (bus, slot, func, PCI_REG_CLASS);
+          dev->bus = bus;
+          dev->slot = slot;
+          dev->func = func;
+          dev->vendor_id = id & 0xffff;
+          dev->device_id = id >> 16;
+          dev->class = class_reg >> 24;
+          dev->subclass = class_reg >> 16 & 0xff;
+          dev->prog_if = class_reg >> 8 & 0xff;
+          if (match (dev, aux) && idx-- == 0)
+            return true;
+
+          /* Only multi-function devices have functions 1...7. */
+          if (func == 0
+              && !(read_config (bus, slot, 0, PCI_REG_HEADER) & 0x800000))
+            break;
+        }
+  return false;
+}
+
+/* Returns true if DEV has the class and subclass in AUX. */
+static bool
+match_class (const struct pci_dev *dev, const void *aux)
+{
+  const uint8_t *class = aux;
+  return dev->class == class[0] && dev->subclass == class[1];
+}
+
+/* Searches the PCI buses for the IDX'th function, counting from
+   0, of the given CLASS and SUBCLASS.  If there is one, stores
+   its description in *DEV and returns true; otherwise, returns
+   false. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, size_t idx,
+                struct pci_dev *dev)
+{
+  uint8_t aux[2];
+
+  aux[0] = class;
+  aux[1] = subclass;
+  return find (match_class, aux, idx, dev);
+}
+
+/* Returns true if DEV has the vendor and device IDs in AUX. */
+static bool
+match_id (const struct pci_dev *dev, const void *aux)
+{
+  const uint16_t *id = aux;
+  return dev->vendor_id == id[0] && dev->device_id == id[1];
+}
+
+/* Searches the PCI buses for the IDX'th function, counting from
+   0, with the given VENDOR_ID and DEVICE_ID, as pci_find_class()
+   does. */
+bool
+pci_find_device (uint16_t vendor_id, uint16_t device_id, size_t idx,
+                 struct pci_dev *dev)
+{
+  uint16_t aux[2];
+
+  aux[0] = vendor_id;
+  aux[1] = device_id;
+  return find (match_id, aux, idx, dev);
+}
+
+/* Returns the 32-bit configuration register at byte offset REG,
+   which must be a multiple of 4, in DEV's configuration space. */
+uint32_t
+pci_read_config (const struct pci_dev *dev, uint8_t reg)
+{
+  return read_config (dev->bus, dev->slot, dev->func, reg);
+}
+
+/* Writes VALUE to the 32-bit configuration register at byte
+   offset REG, which must be a multiple of 4, in DEV's
+   configuration space. */
+void
+pci_write_config (const struct pci_dev *dev, uint8_t reg, uint32_t value)
+{
+  write_config (dev->bus, dev->slot, dev->func, reg, value);
+}
+
+/* Sets COMMAND_BITS, a combination of PCI_CMD_* bits, in DEV's
+   command register, leaving the other bits alone and the status
+   register unchanged. */
+void
+pci_enable (const struct pci_dev *dev, uint16_t command_bits)
+{
+  uint32_t command = pci_read_config (dev, PCI_REG_COMMAND);
+
+  /* Status bits are cleared by writing 1s, so write back 0s. */
+  pci_write_config (dev, PCI_REG_COMMAND,
+                    (command & 0xffff) | command_bits);
+}
+
+/* Reads configuration register REG in function FUNC of device
+   SLOT on BUS. */
+static uint32_t
+read_config (uint8_t bus, uint8_t slot, uint8_t func, uint8_t reg)
+{
+  enum intr_level old_level = intr_disable ();
+  uint32_t value;
+
+  select_register (bus, slot, func, reg);
+  value = inl (CONFIG_DATA);
+  intr_set_level (old_level);
+
+  return value;
+}
+
+/* Writes VALUE to configuration register REG in function FUNC of
+   device SLOT on BUS. */
+static void
+write_config (uint8_t bus, uint8_t slot, uint8_t func, uint8_t reg,
+              uint32_t value)
+{
+  enum intr_level old_level = intr_disable ();
+
+  select_register (bus, slot, func, reg);
+  outl (CONFIG_DATA, value);
+  intr_set_level (old_level);
+}
+
+/* Points CONFIG_DATA at configuration register REG in function
+   FUNC of device SLOT on BUS.  The caller must keep interrupts
+   off until it has accessed CONFIG_DATA, so that no other access
+   can intervene. */
+static void
+select_register (uint8_t bus, uint8_t slot, uint8_t func, uint8_t reg)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (slot < SLOT_CNT && func < FUNC_CNT);
+  ASSERT (reg % 4 == 0);
+
+  outl (CONFIG_ADDRESS, (0x80000000u | (uint32_t) bus << 16
+                         | (uint32_t) slot << 11 | (uint32_t) func << 8
+                         | reg));
+}
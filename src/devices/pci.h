@@ -0,0 +1,47 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Configuration space registers, as byte offsets. */
+#define PCI_REG_ID 0x00         /* Device ID 31:16, vendor ID 15:0. */
+#define PCI_REG_COMMAND 0x04    /* Status 31:16, command 15:0. */
+#define PCI_REG_CLASS 0x08      /* Class, subclass, prog. interface, rev. */
+#define PCI_REG_HEADER 0x0c     /* Header type in bits 23:16. */
+#define PCI_REG_BAR0 0x10       /* First of six base address registers. */
+#define PCI_REG_INTERRUPT 0x3c  /* Interrupt line in bits 7:0. */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MEMORY 0x0002   /* Respond to memory space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* May act as a bus master. */
+
+/* Device classes and subclasses. */
+#define PCI_CLASS_STORAGE 0x01  /* Mass storage controller. */
+#define PCI_SUBCLASS_IDE 0x01   /* IDE controller. */
+
+/* A PCI function. */
+struct pci_dev
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t slot;               /* Device number on the bus. */
+    uint8_t func;               /* Function number within the device. */
+    uint16_t vendor_id;         /* Vendor ID. */
+    uint16_t device_id;         /* Device ID. */
+    uint8_t class;              /* Class code. */
+    uint8_t subclass;           /* Subclass code. */
+    uint8_t prog_if;            /* Programming interface. */
+  };
+
+bool pci_find_class (uint8_t class, uint8_t subclass, size_t idx,
+                     struct pci_dev *);
+bool pci_find_device (uint16_t vendor_id, uint16_t device_id, size_t idx,
+                      struct pci_dev *);
+
+uint32_t pci_read_config (const struct pci_dev *, uint8_t reg);
+void pci_write_config (const struct pci_dev *, uint8_t reg, uint32_t);
+void pci_enable (const struct pci_dev *, uint16_t command_bits);
+
+#endif /* devices/pci.h */
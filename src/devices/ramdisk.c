@@ -0,0 +1,130 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A RAM disk is a block device whose sectors live in memory, so
+   that reading and writing them are plain memory copies, done
+   right away in the submitting thread, with no queue, interrupt,
+   or context switch in between.  That makes it handy for
+   profiling the file system and VM on their own, and for fast
+   scratch or swap space that need not outlive the kernel.
+
+   Its pages come from the user pool and, once that runs out,
+   from the kernel pool, but never so many from the kernel pool
+   that fewer than KERNEL_RESERVE_PAGES are left there for the
+   kernel's own use.  They need not be contiguous. */
+
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+#define KERNEL_RESERVE_PAGES 256
+
+/* A RAM disk. */
+struct ramdisk
+  {
+    size_t page_cnt;            /* Number of pages. */
+    uint8_t **pages;            /* The pages, in sector order. */
+  };
+
+/* Number of RAM disks created so far. */
+static int ramdisk_cnt;
+
+static struct block_operations ramdisk_operations;
+
+static void destroy (struct ramdisk *);
+
+/* Creates a RAM disk of SIZE sectors, initially all zeros, and
+   registers it as a block device of the given TYPE, which it
+   takes on as a role if no other device of that type precedes it
+   in probe order.  Returns the new block device, or a null
+   pointer if memory is short, in which case nothing is left
+   allocated. */
+struct block *
+ramdisk_create (enum block_type type, block_sector_t size)
+{
+  struct ramdisk *rd;
+  char name[16];
+  size_t i;
+
+  rd = malloc (sizeof *rd);
+  if (rd == NULL)
+    return NULL;
+  rd->page_cnt = DIV_ROUND_UP (size, SECTORS_PER_PAGE);
+  rd->pages = calloc (rd->page_cnt, sizeof *rd->pages);
+  if (rd->pages == NULL)
+    {
+      free (rd);
+      return NULL;
+    }
+  for (i = 0; i < rd->page_cnt; i++)
+    {
+      rd->pages[i] = palloc_get_page (PAL_USER | PAL_ZERO);
+      if (rd->pages[i] == NULL && palloc_free_cnt (0) > KERNEL_RESERVE_PAGES)
+        rd->pages[i] = palloc_get_page (PAL_ZERO);
+      if (rd->pages[i] == NULL)
+        {
+          destroy (rd);
+          return NULL;
+        }
+    }
+
+  snprintf (name, sizeof name, "rd%d", ramdisk_cnt++);
+  return block_register (name, type, "RAM disk", size,
+                         &ramdisk_operations, rd);
+}
+
+/* Frees RD and whatever pages it has. */
+static void
+destroy (struct ramdisk *rd)
+{
+  size_t i;
+
+  for (i = 0; i < rd->page_cnt; i++)
+    if (rd->pages[i] != NULL)
+      palloc_free_page (rd->pages[i]);
+  free (rd->pages);
+  free (rd);
+}
+
+/* Copies the sectors of request R between RAM disk RD and R's
+   buffer, then completes R. */
+static void
+ramdisk_submit (void *rd_, struct block_request *r)
+{
+  struct ramdisk *rd = rd_;
+  block_sector_t sector = r->sector;
+  uint8_t *buffer = r->buffer;
+  size_t left = r->cnt;
+
+  while (left > 0)
+    {
+      size_t page_ofs = sector % SECTORS_PER_PAGE;
+      size_t cnt = SECTORS_PER_PAGE - page_ofs;
+      uint8_t *data = (rd->pages[sector / SECTORS_PER_PAGE]
+                       + page_ofs * BLOCK_SECTOR_SIZE);
+
+      if (cnt > left)
+        cnt = left;
+      if (r->write)
+        memcpy (data, buffer, cnt * BLOCK_SECTOR_SIZE);
+      else
+        memcpy (buffer, data, cnt * BLOCK_SECTOR_SIZE);
+
+      sector += cnt;
+      buffer += cnt * BLOCK_SECTOR_SIZE;
+      left -= cnt;
+    }
+  r->complete (r);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    ramdisk_submit
+  };
@@ -0,0 +1,8 @@
+#ifndef DEVICES_RAMDISK_H
+#define DEVICES_RAMDISK_H
+
+#include "devices/block.h"
+
+struct block *ramdisk_create (enum block_type, block_sector_t size);
+
+#endif /* devices/ramdisk.h */
@@ -1,7 +1,7 @@
 #include "devices/serial.h"
 #include <debug.h>
+#include <string.h>
 #include "devices/input.h"
-#include "devices/intq.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
@@ -33,6 +33,14 @@
 #define MCR_REG (IO_BASE + 4)   /* MODEM Control Register. */
 #define LSR_REG (IO_BASE + 5)   /* Line Status Register (read-only). */
 
+/* FIFO Control Register bits. */
+#define FCR_ENABLE 0x01         /* Enable receive and transmit FIFOs. */
+#define FCR_CLEAR_RECV 0x02     /* Empty receive FIFO. */
+#define FCR_CLEAR_XMIT 0x04     /* Empty transmit FIFO. */
+
+/* Size of the transmit FIFO, in bytes. */
+#define XMIT_FIFO_SIZE 16
+
 /* Interrupt Enable Register bits. */
 #define IER_RECV 0x01           /* Interrupt when data received. */
 #define IER_XMIT 0x02           /* Interrupt when transmit finishes. */
@@ -46,15 +54,31 @@
 
 /* Line Status Register. */
 #define LSR_DR 0x01             /* Data Ready: received data byte is in RBR. */
-#define LSR_THRE 0x20           /* THR Empty. */
+#define LSR_THRE 0x20           /* THR Empty, or transmit FIFO empty. */
+#define LSR_TEMT 0x40           /* Transmitter completely empty. */
+
+/* Default data rate, in bits per second. */
+#define DEFAULT_BPS 115200
 
 /* Transmission mode. */
 static enum { UNINIT, POLL, QUEUE } mode;
 
-/* Data to be transmitted. */
-static struct intq txq;
+/* Data to be transmitted, a ring buffer large enough that
+   printing a screenful at a time rarely has to wait for the
+   serial port.  TXQ_HEAD and TXQ_TAIL count the bytes ever put
+   in and taken out, so that their difference is the number of
+   bytes in the ring. */
+#define TXQ_SIZE 4096           /* Power of 2. */
+static uint8_t txq[TXQ_SIZE];
+static unsigned txq_head;       /* Next byte is put at this count. */
+static unsigned txq_tail;       /* Next byte is taken at this count. */
+
+/* Threads waiting for room in TXQ. */
+static struct semaphore txq_room;
+static int txq_waiters;
 
 static void set_serial (int bps);
+static uint8_t txq_getc (void);
 static void putc_poll (uint8_t);
 static void write_ier (void);
 static intr_handler_func serial_interrupt;
@@ -68,10 +92,10 @@ init_poll (void)
 {
   ASSERT (mode == UNINIT);
   outb (IER_REG, 0);                    /* Turn off all interrupts. */
-  outb (FCR_REG, 0);                    /* Disable FIFO. */
-  set_serial (9600);                    /* 9.6 kbps, N-8-1. */
+  outb (FCR_REG, FCR_ENABLE | FCR_CLEAR_RECV | FCR_CLEAR_XMIT);
+  set_serial (DEFAULT_BPS);             /* N-8-1. */
   outb (MCR_REG, MCR_OUT2);             /* Required to enable interrupts. */
-  intq_init (&txq);
+  sema_init (&txq_room, 0);
   mode = POLL;
 } 
 
@@ -98,34 +122,65 @@ serial_init_queue (void)
 void
 serial_putc (uint8_t byte) 
 {
+  serial_putbuf (&byte, 1);
+}
+
+/* Sends the N bytes in BUFFER to the serial port.  In queued
+   mode, waits only if the transmit queue fills up. */
+void
+serial_putbuf (const void *buffer_, size_t n)
+{
+  const uint8_t *buffer = buffer_;
   enum intr_level old_level = intr_disable ();
 
   if (mode != QUEUE)
     {
       /* If we're not set up for interrupt-driven I/O yet,
-         use dumb polling to transmit a byte. */
+         use dumb polling to transmit. */
       if (mode == UNINIT)
         init_poll ();
-      putc_poll (byte); 
+      while (n-- > 0)
+        putc_poll (*buffer++);
     }
-  else 
-    {
-      /* Otherwise, queue a byte and update the interrupt enable
-         register. */
-      if (old_level == INTR_OFF && intq_full (&txq)) 
-        {
-          /* Interrupts are off and the transmit queue is full.
-             If we wanted to wait for the queue to empty,
-             we'd have to reenable interrupts.
-             That's impolite, so we'll send a character via
-             polling instead. */
-          putc_poll (intq_getc (&txq)); 
-        }
-
-      intq_putc (&txq, byte); 
-      write_ier ();
-    }
-  
+  else
+    while (n > 0)
+      {
+        /* Copy as much as fits before the end of the ring. */
+        size_t ofs = txq_head % TXQ_SIZE;
+        size_t room = TXQ_SIZE - (txq_head - txq_tail);
+        size_t cnt = n;
+
+        if (cnt > room)
+          cnt = room;
+        if (cnt > TXQ_SIZE - ofs)
+          cnt = TXQ_SIZE - ofs;
+        memcpy (txq + ofs, buffer, cnt);
+        txq_head += cnt;
+        buffer += cnt;
+        n -= cnt;
+
+        /* Start transmitting, if we weren't already. */
+        write_ier ();
+
+        if (n > 0 && cnt == room)
+          {
+            /* The queue is full. */
+            if (old_level == INTR_OFF)
+              {
+                /* Interrupts are off, so we can't wait for the
+                   interrupt handler to make room.  That's
+                   impolite, so we make some by polling
+                   instead. */
+                putc_poll (txq_getc ());
+              }
+            else
+              {
+                txq_waiters++;
+                sema_down (&txq_room);
+              }
+          }
+      }
+
   intr_set_level (old_level);
 }
 
@@ -135,8 +190,28 @@ void
 serial_flush (void) 
 {
   enum intr_level old_level = intr_disable ();
-  while (!intq_empty (&txq))
-    putc_poll (intq_getc (&txq));
+  while (txq_head != txq_tail)
+    putc_poll (txq_getc ());
+  intr_set_level (old_level);
+}
+
+/* Changes the serial port's data rate to BPS bits per second,
+   which must divide 115,200 evenly, once everything already
+   queued has been sent at the old rate. */
+void
+serial_set_bps (int bps)
+{
+  enum intr_level old_level;
+
+  ASSERT (bps >= 300 && bps <= 115200 && 115200 % bps == 0);
+
+  old_level = intr_disable ();
+  if (mode == UNINIT)
+    init_poll ();
+  serial_flush ();
+  while ((inb (LSR_REG) & LSR_TEMT) == 0)
+    continue;
+  set_serial (bps);
   intr_set_level (old_level);
 }
 
@@ -182,7 +257,7 @@ write_ier (void)
 
   /* Enable transmit interrupt if we have any characters to
      transmit. */
-  if (!intq_empty (&txq))
+  if (txq_head != txq_tail)
     ier |= IER_XMIT;
 
   /* Enable receive interrupt if we have room to store any
@@ -193,6 +268,15 @@ write_ier (void)
   outb (IER_REG, ier);
 }
 
+/* Removes and returns the oldest byte in the transmit queue,
+   which must not be empty. */
+static uint8_t
+txq_getc (void)
+{
+  ASSERT (txq_head != txq_tail);
+  return txq[txq_tail++ % TXQ_SIZE];
+}
+
 /* Polls the serial port until it's ready,
    and then transmits BYTE. */
 static void
@@ -218,10 +302,23 @@ serial_interrupt (struct intr_frame *f UNUSED)
   while (!input_full () && (inb (LSR_REG) & LSR_DR) != 0)
     input_putc (inb (RBR_REG));
 
-  /* As long as we have a byte to transmit, and the hardware is
-     ready to accept a byte for transmission, transmit a byte. */
-  while (!intq_empty (&txq) && (inb (LSR_REG) & LSR_THRE) != 0) 
-    outb (THR_REG, intq_getc (&txq));
+  /* If the transmit FIFO is empty, refill it from the queue.
+     THRE doesn't say how much room the FIFO has otherwise, so we
+     transmit only when it is empty. */
+  if ((inb (LSR_REG) & LSR_THRE) != 0)
+    {
+      int i;
+
+      for (i = 0; i < XMIT_FIFO_SIZE && txq_head != txq_tail; i++)
+        outb (THR_REG, txq_getc ());
+    }
+
+  /* Wake up writers once the queue is half empty, rather than as
+     soon as there is any room, so that each of them can copy in
+     a good-sized chunk. */
+  if (txq_waiters > 0 && txq_head - txq_tail <= TXQ_SIZE / 2)
+    for (; txq_waiters > 0; txq_waiters--)
+      sema_up (&txq_room);
 
   /* Update interrupt enable register based on queue status. */
   write_ier ();
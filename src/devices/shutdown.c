@@ -5,12 +5,16 @@
 #include "devices/serial.h"
 #include "devices/timer.h"
 #include "threads/io.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/exception.h"
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
+#include "filesys/journal.h"
 #include "filesys/filesys.h"
 #endif
 
@@ -57,6 +61,8 @@ void
 shutdown_reboot (void)
 {
   printf ("Rebooting...\n");
+  console_flush ();
+  serial_flush ();
 
     /* See [kbd] for details on how to program the keyboard
      * controller. */
@@ -97,6 +103,7 @@ shutdown_power_off (void)
   print_stats ();
 
   printf ("Powering off...\n");
+  console_flush ();
   serial_flush ();
 
   /* ACPI power-off */
@@ -132,7 +139,11 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  cache_print_stats ();
+  dcache_print_stats ();
+  journal_print_stats ();
 #endif
+  lock_print_stats ();
   console_print_stats ();
   kbd_print_stats ();
 #ifdef USERPROG
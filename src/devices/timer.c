@@ -24,11 +24,16 @@ static int64_t ticks;
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* Number of time-stamp counter increments per microsecond.
+   Initialized by timer_calibrate(). */
+static uint64_t tsc_per_usec;
+
 static intr_handler_func timer_interrupt;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
 static void real_time_delay (int64_t num, int32_t denom);
+static uint64_t rdtsc (void);
 
 /* Sets up the timer to interrupt TIMER_FREQ times per second,
    and registers the corresponding interrupt. */
@@ -39,11 +44,14 @@ timer_init (void)
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 }
 
-/* Calibrates loops_per_tick, used to implement brief delays. */
+/* Calibrates loops_per_tick, used to implement brief delays,
+   and tsc_per_usec, used to measure them. */
 void
 timer_calibrate (void) 
 {
   unsigned high_bit, test_bit;
+  uint64_t tsc;
+  int64_t start;
 
   ASSERT (intr_get_level () == INTR_ON);
   printf ("Calibrating timer...  ");
@@ -63,9 +71,33 @@ timer_calibrate (void)
     if (!too_many_loops (high_bit | test_bit))
       loops_per_tick |= test_bit;
 
+  /* Count time-stamp counter increments over one whole tick. */
+  start = ticks;
+  while (ticks == start)
+    barrier ();
+  tsc = rdtsc ();
+  start = ticks;
+  while (ticks == start)
+    barrier ();
+  tsc_per_usec = (rdtsc () - tsc) * TIMER_FREQ / 1000000;
+  if (tsc_per_usec == 0)
+    tsc_per_usec = 1;
+
   printf ("%'"PRIu64" loops/s.\n", (uint64_t) loops_per_tick * TIMER_FREQ);
 }
 
+/* Returns the time in microseconds, as measured by the CPU's
+   time-stamp counter, which is much finer grained than timer
+   ticks.  Only differences between values are meaningful.
+   Until timer_calibrate() is called, counts in whole ticks. */
+int64_t
+timer_usecs (void)
+{
+  if (tsc_per_usec == 0)
+    return timer_ticks () * (1000000 / TIMER_FREQ);
+  return rdtsc () / tsc_per_usec;
+}
+
 /* Returns the number of timer ticks since the OS booted. */
 int64_t
 timer_ticks (void) 
@@ -202,6 +234,16 @@ too_many_loops (unsigned loops)
   return start != ticks;
 }
 
+/* Returns the CPU's time-stamp counter, which counts up at a
+   fixed rate from when the CPU was reset. */
+static uint64_t
+rdtsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
 /* Iterates through a simple loop LOOPS times, for implementing
    brief delays.
 
@@ -0,0 +1,357 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "devices/partition.h"
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file is a driver for the virtio block devices
+   that QEMU provides with "-drive if=virtio", through the legacy
+   PCI interface of the Virtio PCI Card Specification v0.9.5.
+
+   Requests go from block_submit() straight onto the device's
+   virtqueue, so that many can be in flight at once, and complete
+   from the interrupt handler in whatever order the host finishes
+   them.  The host does its own scheduling, so these devices have
+   no request queue in the block layer. */
+
+/* PCI IDs of a legacy virtio block device. */
+#define VIRTIO_VENDOR_ID 0x1af4
+#define VIRTIO_BLK_DEVICE_ID 0x1001
+
+/* Legacy virtio register port addresses. */
+#define reg_host_features(DISK) ((DISK)->io_base + 0x00) /* Host features. */
+#define reg_guest_features(DISK) ((DISK)->io_base + 0x04) /* Ours. */
+#define reg_queue_pfn(DISK) ((DISK)->io_base + 0x08)    /* Queue page. */
+#define reg_queue_size(DISK) ((DISK)->io_base + 0x0c)   /* Queue size. */
+#define reg_queue_select(DISK) ((DISK)->io_base + 0x0e) /* Queue select. */
+#define reg_queue_notify(DISK) ((DISK)->io_base + 0x10) /* Queue notify. */
+#define reg_status(DISK) ((DISK)->io_base + 0x12)       /* Device status. */
+#define reg_isr(DISK) ((DISK)->io_base + 0x13)          /* ISR status. */
+#define reg_capacity(DISK) ((DISK)->io_base + 0x14)     /* Sectors, 64 bits. */
+
+/* Device Status bits. */
+#define STATUS_ACKNOWLEDGE 0x01 /* Guest has noticed the device. */
+#define STATUS_DRIVER 0x02      /* Guest can drive the device. */
+#define STATUS_DRIVER_OK 0x04   /* Driver is ready. */
+
+/* ISR Status bits. */
+#define ISR_QUEUE 0x01          /* A virtqueue has used buffers. */
+
+/* A virtqueue descriptor, which describes one buffer. */
+struct vring_desc
+  {
+    uint64_t addr;              /* Physical address. */
+    uint32_t len;               /* Length in bytes. */
+    uint16_t flags;             /* DESC_F_* bits. */
+    uint16_t next;              /* Next descriptor if DESC_F_NEXT. */
+  };
+
+#define DESC_F_NEXT 0x01        /* NEXT is valid. */
+#define DESC_F_WRITE 0x02       /* Device writes, rather than reads, it. */
+
+/* The ring of descriptor chains that we offer the device. */
+struct vring_avail
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where we put the next entry. */
+    uint16_t ring[];            /* Heads of descriptor chains. */
+  };
+
+/* The ring of descriptor chains that the device has finished. */
+struct vring_used
+  {
+    uint16_t flags;
+    uint16_t idx;               /* Where the device puts the next entry. */
+    struct
+      {
+        uint32_t id;            /* Head of descriptor chain. */
+        uint32_t len;           /* Bytes written into it. */
+      }
+    ring[];
+  };
+
+/* Request types. */
+#define REQ_IN 0                /* Read. */
+#define REQ_OUT 1               /* Write. */
+
+/* Request status written by the device. */
+#define REQ_S_OK 0
+
+/* One request in flight.  Slot I uses the chain of descriptors
+   3 * I (header), 3 * I + 1 (data), and 3 * I + 2 (status). */
+struct slot
+  {
+    struct
+      {
+        uint32_t type;          /* REQ_IN or REQ_OUT. */
+        uint32_t reserved;
+        uint64_t sector;        /* First sector. */
+      }
+    header;
+    uint8_t status;             /* Written by the device. */
+    struct block_request *request; /* Request being served. */
+    struct slot *next_free;     /* Next free slot. */
+  };
+
+#define SLOT_DESCS 3            /* Descriptors per slot. */
+
+/* A virtio block device. */
+struct virtio_blk
+  {
+    char name[8];               /* Name, e.g. "vda". */
+    uint16_t io_base;           /* Base I/O port. */
+    uint8_t irq;                /* Interrupt in use. */
+
+    uint16_t queue_size;        /* Descriptors in the virtqueue. */
+    size_t vring_pages;         /* Pages in the virtqueue. */
+    struct vring_desc *desc;    /* Descriptor table. */
+    struct vring_avail *avail;  /* Available ring. */
+    volatile struct vring_used *used; /* Used ring. */
+    uint16_t used_idx;          /* Next used ring entry to consume. */
+
+    /* Protected by disabling interrupts. */
+    struct slot *slots;         /* QUEUE_SIZE / SLOT_DESCS slots. */
+    struct slot *free_slots;    /* Free slots, linked by NEXT_FREE. */
+    struct semaphore free_cnt;  /* Number of free slots. */
+  };
+
+/* Most virtio block devices we support. */
+#define DISK_CNT 8
+static struct virtio_blk disks[DISK_CNT];
+static size_t disk_cnt;
+
+static struct block_operations virtio_blk_operations;
+
+static bool init_disk (struct virtio_blk *, const struct pci_dev *);
+static bool init_queue (struct virtio_blk *);
+static void interrupt_handler (struct intr_frame *);
+
+/* Finds virtio block devices on the PCI bus and registers them
+   with the block device layer. */
+void
+virtio_blk_init (void)
+{
+  struct pci_dev dev;
+  size_t i;
+
+  for (i = 0; disk_cnt < DISK_CNT
+         && pci_find_device (VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, i, &dev);
+       i++)
+    {
+      struct virtio_blk *d = &disks[disk_cnt];
+      block_sector_t capacity;
+      struct block *block;
+
+      snprintf (d->name, sizeof d->name, "vd%c", (int) ('a' + disk_cnt));
+      if (!init_disk (d, &dev))
+        {
+          printf ("%s: initialization failed\n", d->name);
+          continue;
+        }
+      disk_cnt++;
+
+      capacity = inl (reg_capacity (d));
+      if (inl (reg_capacity (d) + 4) != 0)
+        capacity = UINT32_MAX;
+      block = block_register (d->name, BLOCK_RAW, "virtio", capacity,
+                              &virtio_blk_operations, d);
+      partition_scan (block);
+    }
+}
+
+/* Initializes disk D, which is PCI function DEV, and sets it
+   running.  Returns true if successful, false on failure. */
+static bool
+init_disk (struct virtio_blk *d, const struct pci_dev *dev)
+{
+  uint32_t bar = pci_read_config (dev, PCI_REG_BAR0);
+  uint8_t irq = pci_read_config (dev, PCI_REG_INTERRUPT) & 0xff;
+  struct virtio_blk *other;
+
+  /* The legacy registers are in I/O space at BAR0. */
+  if ((bar & 1) == 0 || (bar & 0xfffc) == 0 || irq >= 16)
+    return false;
+  d->io_base = bar & 0xfffc;
+  d->irq = irq + 0x20;
+  pci_enable (dev, PCI_CMD_IO | PCI_CMD_MASTER);
+
+  /* Reset the device, tell it that we know how to drive it, and
+     decline all of its optional features. */
+  outb (reg_status (d), 0);
+  outb (reg_status (d), STATUS_ACKNOWLEDGE);
+  outb (reg_status (d), STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+  inl (reg_host_features (d));
+  outl (reg_guest_features (d), 0);
+  if (!init_queue (d))
+    {
+      outb (reg_status (d), 0);
+      return false;
+    }
+
+  /* Several devices may share an interrupt line. */
+  for (other = disks; other < d; other++)
+    if (other->irq == d->irq)
+      break;
+  if (other == d)
+    intr_register_ext (d->irq, interrupt_handler, d->name);
+
+  outb (reg_status (d),
+        STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+  return true;
+}
+
+/* Sets up D's virtqueue 0, through which all requests go.
+   Returns true if successful, false on failure. */
+static bool
+init_queue (struct virtio_blk *d)
+{
+  size_t avail_size, used_ofs, slot_cnt, i;
+  uint8_t *vring;
+
+  outw (reg_queue_select (d), 0);
+  d->queue_size = inw (reg_queue_size (d));
+  slot_cnt = d->queue_size / SLOT_DESCS;
+  if (slot_cnt == 0)
+    return false;
+
+  /* The descriptor table is followed by the available ring and,
+     at the next page boundary, the used ring. */
+  avail_size = (sizeof *d->avail + sizeof *d->avail->ring * d->queue_size
+                + sizeof (uint16_t));
+  used_ofs = ROUND_UP (sizeof *d->desc * d->queue_size + avail_size, PGSIZE);
+  d->vring_pages = DIV_ROUND_UP (used_ofs + sizeof *d->used
+                                 + sizeof *d->used->ring * d->queue_size
+                                 + sizeof (uint16_t), PGSIZE);
+  vring = palloc_get_multiple (PAL_ZERO, d->vring_pages);
+  d->slots = malloc (slot_cnt * sizeof *d->slots);
+  if (vring == NULL || d->slots == NULL)
+    {
+      if (vring != NULL)
+        palloc_free_multiple (vring, d->vring_pages);
+      free (d->slots);
+      return false;
+    }
+  d->desc = (struct vring_desc *) vring;
+  d->avail = (struct vring_avail *) (vring + sizeof *d->desc * d->queue_size);
+  d->used = (struct vring_used *) (vring + used_ofs);
+  d->used_idx = 0;
+
+  /* Chain each slot's descriptors together once and for all. */
+  d->free_slots = NULL;
+  for (i = slot_cnt; i-- > 0; )
+    {
+      struct slot *s = &d->slots[i];
+      struct vring_desc *desc = &d->desc[i * SLOT_DESCS];
+
+      desc[0].addr = vtop (&s->header);
+      desc[0].len = sizeof s->header;
+      desc[0].flags = DESC_F_NEXT;
+      desc[0].next = i * SLOT_DESCS + 1;
+      desc[1].next = i * SLOT_DESCS + 2;
+      desc[2].addr = vtop (&s->status);
+      desc[2].len = sizeof s->status;
+      desc[2].flags = DESC_F_WRITE;
+
+      s->next_free = d->free_slots;
+      d->free_slots = s;
+    }
+  sema_init (&d->free_cnt, slot_cnt);
+
+  outl (reg_queue_pfn (d), vtop (vring) / PGSIZE);
+  return true;
+}
+
+/* Hands request R to disk D, first waiting for a free slot if
+   all of them are in flight. */
+static void
+virtio_blk_submit (void *d_, struct block_request *r)
+{
+  struct virtio_blk *d = d_;
+  enum intr_level old_level;
+  struct vring_desc *data;
+  struct slot *s;
+  size_t head;
+
+  /* Only kernel virtual addresses map linearly to physical
+     memory, so that the device can access the buffer as a
+     single piece. */
+  ASSERT (is_kernel_vaddr (r->buffer));
+
+  sema_down (&d->free_cnt);
+  old_level = intr_disable ();
+  s = d->free_slots;
+  d->free_slots = s->next_free;
+
+  s->header.type = r->write ? REQ_OUT : REQ_IN;
+  s->header.reserved = 0;
+  s->header.sector = r->sector;
+  s->status = 0xff;
+  s->request = r;
+
+  head = (s - d->slots) * SLOT_DESCS;
+  data = &d->desc[head + 1];
+  data->addr = vtop (r->buffer);
+  data->len = r->cnt * BLOCK_SECTOR_SIZE;
+  data->flags = DESC_F_NEXT | (r->write ? 0 : DESC_F_WRITE);
+
+  /* The device must see the chain before the new index. */
+  d->avail->ring[d->avail->idx % d->queue_size] = head;
+  barrier ();
+  d->avail->idx++;
+  barrier ();
+  outw (reg_queue_notify (d), 0);
+  intr_set_level (old_level);
+}
+
+static struct block_operations virtio_blk_operations =
+  {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    virtio_blk_submit
+  };
+
+/* Completes the requests that disk D has finished. */
+static void
+complete_requests (struct virtio_blk *d)
+{
+  while (d->used_idx != d->used->idx)
+    {
+      uint32_t id = d->used->ring[d->used_idx % d->queue_size].id;
+      struct slot *s = &d->slots[id / SLOT_DESCS];
+      struct block_request *r = s->request;
+
+      barrier ();
+      if (s->status != REQ_S_OK)
+        PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+               d->name, r->write ? "write" : "read", r->sector);
+      d->used_idx++;
+
+      s->next_free = d->free_slots;
+      d->free_slots = s;
+      sema_up (&d->free_cnt);
+      r->complete (r);
+    }
+}
+
+/* Virtio interrupt handler. */
+static void
+interrupt_handler (struct intr_frame *f)
+{
+  struct virtio_blk *d;
+
+  /* Reading the ISR status acknowledges the interrupt, so read
+     it for every device on the line. */
+  for (d = disks; d < disks + disk_cnt; d++)
+    if (d->irq == f->vec_no && (inb (reg_isr (d)) & ISR_QUEUE) != 0)
+      complete_requests (d);
+}
@@ -0,0 +1,51 @@
+/* iostat.c
+
+   Prints statistics for each block device: how many requests it
+   has served and how many bytes they moved, how long it has been
+   busy, how deep its queue is and has been, and how long its
+   requests take.  Run it twice and compare, to see what a
+   program in between did to the disks.  This won't work until
+   project 4. */
+
+#include <iostat.h>
+#include <stdio.h>
+#include <syscall.h>
+
+#define MAX_DEVICES 16
+
+int
+main (void)
+{
+  struct iostat st[MAX_DEVICES];
+  int cnt = iostat (st, MAX_DEVICES);
+  int i, j;
+
+  if (cnt > MAX_DEVICES)
+    cnt = MAX_DEVICES;
+  printf ("%-8s %-8s %8s %10s %8s %10s %8s %6s %10s\n",
+          "device", "type", "reads", "kB read", "writes", "kB written",
+          "busy ms", "depth", "latency us");
+  for (i = 0; i < cnt; i++)
+    {
+      unsigned long long req_cnt = st[i].read_cnt + st[i].write_cnt;
+
+      printf ("%-8s %-8s %8llu %10llu %8llu %10llu %8llu %2u/%-3u %10llu\n",
+              st[i].name, st[i].type, st[i].read_cnt,
+              st[i].read_bytes / 1024, st[i].write_cnt,
+              st[i].write_bytes / 1024, st[i].busy_us / 1000,
+              st[i].in_flight, st[i].max_in_flight,
+              req_cnt > 0 ? st[i].latency_us / req_cnt : 0);
+    }
+
+  printf ("\nlatency histogram (requests per range of microseconds):\n");
+  for (i = 0; i < cnt; i++)
+    {
+      printf ("%s:", st[i].name);
+      for (j = 0; j < IOSTAT_BUCKETS; j++)
+        if (st[i].latency_hist[j] != 0)
+          printf (" %lu-%lu:%u", j > 0 ? 1ul << j : 0ul, (2ul << j) - 1,
+                  st[i].latency_hist[j]);
+      printf ("\n");
+    }
+  return EXIT_SUCCESS;
+}
@@ -24,38 +24,35 @@ list_dir (const char *dir, bool verbose)
 
   if (isdir (dir_fd))
     {
-      char name[READDIR_MAX_LEN];
+      struct dirent ents[64];
+      int size;
 
       printf ("%s", dir);
       if (verbose)
         printf (" (inumber %d)", inumber (dir_fd));
       printf (":\n");
 
-      while (readdir (dir_fd, name)) 
+      /* Each call returns as many entries as fit in ENTS, with
+         their types and sizes, so there is no need to open them. */
+      while ((size = getdents (dir_fd, ents, sizeof ents)) > 0) 
         {
-          printf ("%s", name); 
-          if (verbose) 
-            {
-              char full_name[128];
-              int entry_fd;
-
-              snprintf (full_name, sizeof full_name, "%s/%s", dir, name);
-              entry_fd = open (full_name);
+          int cnt = size / sizeof *ents;
+          int i;
 
-              printf (": ");
-              if (entry_fd != -1)
+          for (i = 0; i < cnt; i++)
+            {
+              printf ("%s", ents[i].d_name); 
+              if (verbose) 
                 {
-                  if (isdir (entry_fd))
+                  printf (": ");
+                  if (ents[i].d_type == DT_DIR)
                     printf ("directory");
                   else
-                    printf ("%d-byte file", filesize (entry_fd));
-                  printf (", inumber %d", inumber (entry_fd));
+                    printf ("%d-byte file", ents[i].d_size);
+                  printf (", inumber %d", ents[i].d_ino);
                 }
-              else
-                printf ("open failed");
-              close (entry_fd);
+              printf ("\n");
             }
-          printf ("\n");
         }
     }
   else 
@@ -0,0 +1,556 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Page cache.
+
+   Caches file data in page-sized, page-aligned units, keyed by
+   the inode's sector and the page's index within the file.  All
+   file data goes through the cache: inode_read_at() and
+   inode_write_at() copy to and from cached pages, and a memory
+   mapping maps the cached page itself into the process, so that
+   a file's data is held in memory only once no matter how it is
+   accessed, and read() and write() see the contents of a mapping
+   immediately.
+
+   Pages are written back to disk when they are evicted, when the
+   last opener of their inode closes it, and when the file system
+   is shut down.  A page that a caller is using, or that is mapped
+   into some process, is "pinned" and cannot be evicted.  At most
+   CACHE_SIZE unpinned pages are kept; the cache grows beyond that
+   only if nothing in it can be evicted, and shrinks back as
+   clean pages are unpinned.
+
+   A file's data blocks are allocated only when its pages are
+   written back (see inode_allocate()).  Until then, inode.c
+   reserves space for a dirty page's unallocated blocks and
+   records them in the page, and write-back passes the
+   reservations on.  To give the allocator a whole run to place at
+   once, a page is written back together with up to CLUSTER_PAGES
+   - 1 dirty pages of the same file around it.
+
+   Write-back allocates blocks, writes to the journal, and waits
+   for disk I/O, so it is done without cache_lock.  The pages being
+   written are marked clean and WRITING first.  A page that is
+   WRITING may still be used and dirtied again, but it is not
+   evicted or discarded, and it is not picked for another
+   write-back, until the writer clears WRITING and signals
+   writeback_done.
+
+   Allocating blocks for write-back is a journal operation, which
+   may have to wait for a commit when the running transaction is
+   full.  Eviction cannot wait, because its caller may hold locks
+   that an operation in progress is waiting for, so if there is no
+   room it leaves the page dirty and the cache grows by a page
+   instead, until the journal thread commits. */
+#define CACHE_SIZE 64
+#define CLUSTER_PAGES 16
+
+/* A cached page of file data. */
+struct cache_page
+  {
+    struct hash_elem hash_elem;         /* Element in pages. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    struct inode *inode;                /* File that the page is from. */
+    block_sector_t sector;              /* Inode sector of INODE. */
+    off_t idx;                          /* Page number within the file. */
+    void *kpage;                        /* Page contents. */
+    bool valid;                         /* Contents have been read? */
+    bool dirty;                         /* Needs to be written back? */
+    bool writing;                       /* Being written back? */
+    unsigned reserved;                  /* Blocks with space reserved. */
+    int pin_cnt;                        /* Number of users, 0 if on LRU. */
+    struct lock io_lock;                /* Held while reading contents. */
+  };
+
+static struct hash pages;               /* All cached pages. */
+static struct list lru_list;            /* Unpinned pages, most recent first. */
+static size_t page_cnt;                 /* Number of cached pages. */
+static struct lock cache_lock;          /* Protects all of the above. */
+static struct condition writeback_done; /* Some page stopped WRITING. */
+static struct lock_stats cache_lock_stats;
+
+/* Statistics. */
+static long long hit_cnt;               /* Pages found in the cache. */
+static long long miss_cnt;              /* Pages not found. */
+static long long writeback_cnt;         /* Dirty pages written back. */
+static long long cluster_cnt;           /* Runs of pages written back. */
+
+static hash_hash_func page_hash;
+static hash_less_func page_less;
+static struct cache_page *find (block_sector_t sector, off_t idx);
+static struct cache_page *add_page (struct inode *, off_t idx, void *kpage);
+static void *get_kpage (void);
+static void flush (struct inode *, bool write);
+static bool write_back (struct cache_page *, bool wait);
+static void discard (struct cache_page *);
+static size_t count_bits (unsigned);
+
+/* Initializes the page cache. */
+void
+cache_init (void)
+{
+  hash_init (&pages, page_hash, page_less, NULL);
+  list_init (&lru_list);
+  lock_init (&cache_lock);
+  cond_init (&writeback_done);
+  lock_stats_init (&cache_lock_stats, "page cache");
+  lock_set_stats (&cache_lock, &cache_lock_stats);
+}
+
+/* Returns page IDX of INODE, pinned so that it stays in the cache
+   until released with cache_put().  If READ is false, the caller
+   promises to overwrite the whole page, so a page that is not
+   already cached is zeroed instead of being read from disk.
+   Returns a null pointer if no memory is available. */
+struct cache_page *
+cache_get (struct inode *inode, off_t idx, bool read)
+{
+  block_sector_t sector = inode_get_inumber (inode);
+  struct cache_page *p;
+
+  lock_acquire (&cache_lock);
+  p = find (sector, idx);
+  if (p == NULL)
+    {
+      /* Getting a page may release cache_lock to write back the
+         page it evicts, so someone else may cache this page
+         meanwhile. */
+      void *kpage = get_kpage ();
+
+      p = find (sector, idx);
+      if (p == NULL)
+        {
+          miss_cnt++;
+          p = add_page (inode, idx, kpage);
+          kpage = NULL;
+        }
+      if (kpage != NULL)
+        palloc_free_page (kpage);
+      if (p == NULL)
+        {
+          lock_release (&cache_lock);
+          return NULL;
+        }
+    }
+  else
+    hit_cnt++;
+  if (p->pin_cnt++ == 0)
+    list_remove (&p->lru_elem);
+  lock_release (&cache_lock);
+
+  /* Read the contents, unless someone else already has.  Holding
+     IO_LOCK makes anyone else who wants this page wait until the
+     read is done. */
+  lock_acquire (&p->io_lock);
+  if (!p->valid)
+    {
+      if (read)
+        inode_read_page (inode, idx, p->kpage);
+      else
+        memset (p->kpage, 0, PGSIZE);
+      p->valid = true;
+    }
+  lock_release (&p->io_lock);
+
+  return p;
+}
+
+/* Returns the contents of P, which must be pinned. */
+void *
+cache_data (struct cache_page *p)
+{
+  ASSERT (p->pin_cnt > 0);
+  return p->kpage;
+}
+
+/* Unpins P, which was obtained with cache_get().  If DIRTY is
+   true, the caller modified P, so it will be written back. */
+void
+cache_put (struct cache_page *p, bool dirty)
+{
+  lock_acquire (&cache_lock);
+  ASSERT (p->pin_cnt > 0);
+  if (dirty)
+    p->dirty = true;
+  if (--p->pin_cnt == 0)
+    {
+      list_push_front (&lru_list, &p->lru_elem);
+
+      /* Shrink a cache that grew because nothing could be
+         evicted. */
+      if (page_cnt > CACHE_SIZE && !p->dirty && !p->writing)
+        discard (p);
+    }
+  lock_release (&cache_lock);
+}
+
+/* Returns the file system blocks of P, which must be pinned, for
+   which disk space has been reserved, as a bit mask with bit 0
+   for P's first block. */
+unsigned
+cache_get_reserved (struct cache_page *p)
+{
+  unsigned reserved;
+
+  ASSERT (p->pin_cnt > 0);
+  lock_acquire (&cache_lock);
+  reserved = p->reserved;
+  lock_release (&cache_lock);
+  return reserved;
+}
+
+/* Records that disk space has been reserved with
+   free_map_reserve() for the blocks of P in the bit mask
+   RESERVED.  The reservations are used when P is written back, or
+   given back if P is discarded first.  P must be pinned, and the
+   caller must dirty it when it puts it back. */
+void
+cache_add_reserved (struct cache_page *p, unsigned reserved)
+{
+  ASSERT (p->pin_cnt > 0);
+  lock_acquire (&cache_lock);
+  p->reserved |= reserved;
+  lock_release (&cache_lock);
+}
+
+/* Zeros the bytes from OFS to the end of page IDX of INODE, if
+   that page is cached.  Called when a file grows past its old end
+   in the middle of a page, since a mapping may have written past
+   the old end and those bytes must now read as zeros. */
+void
+cache_zero_tail (struct inode *inode, off_t idx, size_t ofs)
+{
+  struct cache_page *p;
+
+  ASSERT (ofs < PGSIZE);
+
+  lock_acquire (&cache_lock);
+  p = find (inode_get_inumber (inode), idx);
+  if (p != NULL && p->valid)
+    memset ((uint8_t *) p->kpage + ofs, 0, PGSIZE - ofs);
+  lock_release (&cache_lock);
+}
+
+/* Writes back all of INODE's dirty pages. */
+void
+cache_flush_inode (struct inode *inode)
+{
+  lock_acquire (&cache_lock);
+  flush (inode, true);
+  lock_release (&cache_lock);
+}
+
+/* Removes all of INODE's pages from the cache, first writing
+   back any dirty ones if FLUSH is true or discarding them if it
+   is false, as when INODE has been removed.  Called before
+   INODE's in-memory inode is freed, when it has no openers, so
+   none of its pages can be pinned. */
+void
+cache_drop_inode (struct inode *inode, bool flush_)
+{
+  struct list_elem *e;
+
+  lock_acquire (&cache_lock);
+  flush (inode, flush_);
+  for (e = list_begin (&lru_list); e != list_end (&lru_list); )
+    {
+      struct cache_page *p = list_entry (e, struct cache_page, lru_elem);
+      e = list_next (e);
+      if (p->inode == inode)
+        discard (p);
+    }
+  lock_release (&cache_lock);
+}
+
+/* Writes back every dirty page in the cache. */
+void
+cache_flush_all (void)
+{
+  lock_acquire (&cache_lock);
+  flush (NULL, true);
+  lock_release (&cache_lock);
+}
+
+/* Prints page cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Page cache: %lld hits, %lld misses, "
+          "%lld writebacks in %lld runs\n",
+          hit_cnt, miss_cnt, writeback_cnt, cluster_cnt);
+}
+
+/* Returns the cached page IDX of the inode in SECTOR, or a null
+   pointer if there is none.  The caller must hold cache_lock. */
+static struct cache_page *
+find (block_sector_t sector, off_t idx)
+{
+  struct cache_page key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  key.idx = idx;
+  e = hash_find (&pages, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct cache_page, hash_elem) : NULL;
+}
+
+/* Adds page IDX of INODE to the cache, unpinned and not yet
+   valid, with KPAGE as its contents, and returns it.  Returns a
+   null pointer, freeing KPAGE, if KPAGE is null or memory is
+   short.  The caller must hold cache_lock. */
+static struct cache_page *
+add_page (struct inode *inode, off_t idx, void *kpage)
+{
+  struct cache_page *p = kpage != NULL ? malloc (sizeof *p) : NULL;
+
+  if (p == NULL)
+    {
+      if (kpage != NULL)
+        palloc_free_page (kpage);
+      return NULL;
+    }
+  p->inode = inode;
+  p->sector = inode_get_inumber (inode);
+  p->idx = idx;
+  p->kpage = kpage;
+  p->valid = false;
+  p->dirty = false;
+  p->writing = false;
+  p->reserved = 0;
+  p->pin_cnt = 0;
+  lock_init (&p->io_lock);
+  hash_insert (&pages, &p->hash_elem);
+  list_push_front (&lru_list, &p->lru_elem);
+  page_cnt++;
+  return p;
+}
+
+/* Returns a page to hold a new cached page, evicting the least
+   recently used unpinned page if the cache is full, or a null
+   pointer if no page is available.  Clean pages are evicted in
+   preference to dirty ones, which have to be written back first.
+   The caller must hold cache_lock, which is released while a
+   dirty page is written back, so the cache may change before
+   this function returns. */
+static void *
+get_kpage (void)
+{
+  struct cache_page *victim;
+  void *kpage;
+
+  if (page_cnt < CACHE_SIZE)
+    {
+      kpage = palloc_get_page (0);
+      if (kpage != NULL)
+        return kpage;
+    }
+
+  for (;;)
+    {
+      struct cache_page *dirty = NULL;
+      struct list_elem *e;
+
+      victim = NULL;
+      for (e = list_rbegin (&lru_list); e != list_rend (&lru_list);
+           e = list_prev (e))
+        {
+          struct cache_page *p = list_entry (e, struct cache_page, lru_elem);
+          if (p->writing)
+            continue;
+          if (!p->dirty)
+            {
+              victim = p;
+              break;
+            }
+          if (dirty == NULL)
+            dirty = p;
+        }
+      if (victim != NULL)
+        break;
+      if (dirty == NULL)
+        return palloc_get_page (0);
+
+      /* Clean the least recently used dirty page and look
+         again, or grow the cache if it cannot be written back
+         without waiting. */
+      if (!write_back (dirty, false))
+        return palloc_get_page (0);
+    }
+
+  kpage = victim->kpage;
+  victim->kpage = NULL;
+  discard (victim);
+  return kpage;
+}
+
+/* Writes back the dirty pages of INODE, or of every inode if
+   INODE is null, if WRITE is true, and waits for any write-back
+   of those pages already under way to finish.  Afterward none of
+   those pages is WRITING, nor dirty if WRITE is true.  The caller
+   must hold cache_lock, which is released while waiting and
+   writing. */
+static void
+flush (struct inode *inode, bool write)
+{
+  for (;;)
+    {
+      struct cache_page *busy = NULL;
+      struct hash_iterator i;
+
+      hash_first (&i, &pages);
+      while (hash_next (&i))
+        {
+          struct cache_page *p = hash_entry (hash_cur (&i),
+                                             struct cache_page, hash_elem);
+          if ((inode == NULL || p->inode == inode)
+              && (p->writing || (write && p->dirty)))
+            {
+              busy = p;
+              break;
+            }
+        }
+      if (busy == NULL)
+        return;
+
+      /* The cache may change while we wait or write, so start
+         over afterward. */
+      if (busy->writing)
+        cond_wait (&writeback_done, &cache_lock);
+      else
+        write_back (busy, true);
+    }
+}
+
+/* Writes P, which must be dirty and not WRITING, back to disk
+   along with the dirty pages of the same file next to it,
+   allocating blocks for all of them at once.  The caller must
+   hold cache_lock, which is released while the pages are written,
+   as described at the top of this file.  If WAIT is false and
+   the blocks cannot be allocated without waiting for a journal
+   commit, leaves the pages dirty and returns false; otherwise
+   returns true. */
+static bool
+write_back (struct cache_page *p, bool wait)
+{
+  struct cache_page *run[CLUSTER_PAGES];
+  unsigned reserved_bits[CLUSTER_PAGES];
+  struct inode *inode = p->inode;
+  size_t reserved = 0;
+  off_t first = p->idx;
+  size_t cnt, i;
+
+  ASSERT (p->dirty && !p->writing);
+
+  /* Find the run of dirty pages around P and mark it. */
+  while (first > 0 && p->idx - first < CLUSTER_PAGES / 2)
+    {
+      struct cache_page *q = find (p->sector, first - 1);
+      if (q == NULL || !q->dirty || q->writing)
+        break;
+      first--;
+    }
+  for (cnt = 0; cnt < CLUSTER_PAGES; cnt++)
+    {
+      struct cache_page *q = find (p->sector, first + cnt);
+      if (q == NULL || !q->dirty || q->writing)
+        break;
+      run[cnt] = q;
+      reserved_bits[cnt] = q->reserved;
+      reserved += count_bits (q->reserved);
+      q->reserved = 0;
+      q->dirty = false;
+      q->writing = true;
+    }
+  ASSERT (cnt > 0);
+  lock_release (&cache_lock);
+
+  if (!inode_allocate (inode, first, cnt, reserved, wait))
+    {
+      /* Put the pages back as they were.  A page dirtied again
+         meanwhile may have reserved some of the same blocks
+         twice. */
+      lock_acquire (&cache_lock);
+      for (i = 0; i < cnt; i++)
+        {
+          unsigned twice = run[i]->reserved & reserved_bits[i];
+
+          if (twice != 0)
+            free_map_unreserve (count_bits (twice));
+          run[i]->reserved |= reserved_bits[i];
+          run[i]->dirty = true;
+          run[i]->writing = false;
+        }
+      cond_broadcast (&writeback_done, &cache_lock);
+      return false;
+    }
+  for (i = 0; i < cnt; i++)
+    inode_write_page (inode, run[i]->idx, run[i]->kpage);
+
+  lock_acquire (&cache_lock);
+  writeback_cnt += cnt;
+  cluster_cnt++;
+  for (i = 0; i < cnt; i++)
+    run[i]->writing = false;
+  cond_broadcast (&writeback_done, &cache_lock);
+  return true;
+}
+
+/* Removes P, which must be unpinned and not WRITING, from the
+   cache and frees it.  The caller must hold cache_lock. */
+static void
+discard (struct cache_page *p)
+{
+  ASSERT (p->pin_cnt == 0);
+  ASSERT (!p->writing);
+
+  if (p->reserved != 0)
+    free_map_unreserve (count_bits (p->reserved));
+  hash_delete (&pages, &p->hash_elem);
+  list_remove (&p->lru_elem);
+  page_cnt--;
+  if (p->kpage != NULL)
+    palloc_free_page (p->kpage);
+  free (p);
+}
+
+/* Returns the number of 1-bits in X. */
+static size_t
+count_bits (unsigned x)
+{
+  size_t cnt = 0;
+
+  for (; x != 0; x &= x - 1)
+    cnt++;
+  return cnt;
+}
+
+/* Returns a hash value for the page that E is embedded in. */
+static unsigned
+page_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_page *p = hash_entry (e, struct cache_page, hash_elem);
+  return hash_int (p->sector) ^ hash_int (p->idx);
+}
+
+/* Returns true if page A precedes page B. */
+static bool
+page_less (const struct hash_elem *a_, const struct hash_elem *b_,
+           void *aux UNUSED)
+{
+  const struct cache_page *a = hash_entry (a_, struct cache_page, hash_elem);
+  const struct cache_page *b = hash_entry (b_, struct cache_page, hash_elem);
+
+  if (a->sector != b->sector)
+    return a->sector < b->sector;
+  return a->idx < b->idx;
+}
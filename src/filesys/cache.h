@@ -0,0 +1,23 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "filesys/off_t.h"
+
+struct inode;
+struct cache_page;
+
+void cache_init (void);
+struct cache_page *cache_get (struct inode *, off_t page_idx, bool read);
+void *cache_data (struct cache_page *);
+void cache_put (struct cache_page *, bool dirty);
+unsigned cache_get_reserved (struct cache_page *);
+void cache_add_reserved (struct cache_page *, unsigned reserved);
+void cache_zero_tail (struct inode *, off_t page_idx, size_t ofs);
+void cache_flush_inode (struct inode *);
+void cache_drop_inode (struct inode *, bool flush);
+void cache_flush_all (void);
+void cache_print_stats (void);
+
+#endif /* filesys/cache.h */
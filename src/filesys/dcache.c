@@ -0,0 +1,253 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Dentry cache.
+
+   Maps a (directory inode sector, name) pair to the inode sector
+   that the name refers to in that directory, so that resolving a
+   path whose components have been looked up before needs neither
+   a directory scan nor a read of each intermediate directory's
+   inode.  A "negative" entry records that the name does not
+   exist in the directory, so that repeated lookups of missing
+   names are cheap too.
+
+   The cache is kept consistent by the directory code, which
+   invalidates a name whenever it is added to or removed from a
+   directory, and all the names in a directory when that
+   directory is removed.  At most DCACHE_SIZE entries are kept;
+   when the cache is full, the least recently used entry is
+   discarded. */
+#define DCACHE_SIZE 256
+
+/* A cached directory entry. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentries. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    block_sector_t dir;                 /* Directory inode sector. */
+    char name[NAME_MAX + 1];            /* Name within DIR. */
+    bool negative;                      /* True if NAME does not exist. */
+    block_sector_t sector;              /* Inode sector, if !NEGATIVE. */
+    bool is_dir;                        /* Whether SECTOR is a directory. */
+  };
+
+static struct hash dentries;            /* All cached entries. */
+static struct list lru_list;            /* Most recently used first. */
+static size_t dentry_cnt;               /* Number of cached entries. */
+static struct lock dcache_lock;         /* Protects all of the above. */
+static struct lock_stats dcache_lock_stats;
+
+/* Statistics. */
+static long long hit_cnt;               /* Lookups answered with an inode. */
+static long long negative_hit_cnt;      /* Lookups answered "no such name". */
+static long long miss_cnt;              /* Lookups not answered. */
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+static struct dentry *find (block_sector_t dir, const char *name);
+static void insert (block_sector_t dir, const char *name, bool negative,
+                    block_sector_t sector, bool is_dir);
+static void discard (struct dentry *);
+
+/* Initializes the dentry cache. */
+void
+dcache_init (void)
+{
+  hash_init (&dentries, dentry_hash, dentry_less, NULL);
+  list_init (&lru_list);
+  lock_init (&dcache_lock);
+  lock_stats_init (&dcache_lock_stats, "dentry cache");
+  lock_set_stats (&dcache_lock, &dcache_lock_stats);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   Returns DCACHE_HIT and sets *SECTOR to the inode sector of the
+   named file and *IS_DIR to whether it is a directory, if the
+   name is cached as existing; DCACHE_NEGATIVE if it is cached as
+   not existing; or DCACHE_MISS if nothing is cached for it. */
+enum dcache_result
+dcache_lookup (block_sector_t dir, const char *name,
+               block_sector_t *sector, bool *is_dir)
+{
+  enum dcache_result result = DCACHE_MISS;
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d == NULL)
+    miss_cnt++;
+  else
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&lru_list, &d->lru_elem);
+      if (d->negative)
+        {
+          negative_hit_cnt++;
+          result = DCACHE_NEGATIVE;
+        }
+      else
+        {
+          hit_cnt++;
+          *sector = d->sector;
+          *is_dir = d->is_dir;
+          result = DCACHE_HIT;
+        }
+    }
+  lock_release (&dcache_lock);
+
+  return result;
+}
+
+/* Records that NAME in the directory whose inode is in sector
+   DIR refers to the inode in SECTOR, which is a directory if
+   IS_DIR is true. */
+void
+dcache_insert (block_sector_t dir, const char *name,
+               block_sector_t sector, bool is_dir)
+{
+  insert (dir, name, false, sector, is_dir);
+}
+
+/* Records that there is no NAME in the directory whose inode is
+   in sector DIR. */
+void
+dcache_insert_negative (block_sector_t dir, const char *name)
+{
+  insert (dir, name, true, 0, false);
+}
+
+/* Forgets anything cached about NAME in the directory whose
+   inode is in sector DIR. */
+void
+dcache_invalidate (block_sector_t dir, const char *name)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    discard (d);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every name cached for the directory whose inode is in
+   sector DIR.  Called when the directory is removed, and again
+   when a directory is created, since a sector may be reused for
+   a different directory. */
+void
+dcache_invalidate_dir (block_sector_t dir)
+{
+  struct list_elem *e;
+
+  lock_acquire (&dcache_lock);
+  for (e = list_begin (&lru_list); e != list_end (&lru_list); )
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      e = list_next (e);
+      if (d->dir == dir)
+        discard (d);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Prints dentry cache statistics. */
+void
+dcache_print_stats (void)
+{
+  printf ("Dentry cache: %lld hits, %lld negative hits, %lld misses\n",
+          hit_cnt, negative_hit_cnt, miss_cnt);
+}
+
+/* Returns the cached entry for NAME in DIR, or a null pointer if
+   there is none.  The caller must hold dcache_lock. */
+static struct dentry *
+find (block_sector_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Caches an entry for NAME in DIR, replacing any existing one and
+   evicting the least recently used entry if the cache is full.
+   Names too long to exist are not cached. */
+static void
+insert (block_sector_t dir, const char *name, bool negative,
+        block_sector_t sector, bool is_dir)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    list_remove (&d->lru_elem);
+  else
+    {
+      if (dentry_cnt >= DCACHE_SIZE)
+        discard (list_entry (list_back (&lru_list),
+                             struct dentry, lru_elem));
+      d = malloc (sizeof *d);
+      if (d == NULL)
+        {
+          lock_release (&dcache_lock);
+          return;
+        }
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+      dentry_cnt++;
+    }
+  d->negative = negative;
+  d->sector = sector;
+  d->is_dir = is_dir;
+  list_push_front (&lru_list, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Removes D from the cache and frees it.  The caller must hold
+   dcache_lock. */
+static void
+discard (struct dentry *d)
+{
+  hash_delete (&dentries, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  dentry_cnt--;
+  free (d);
+}
+
+/* Returns a hash value for the dentry that E is embedded in. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
@@ -0,0 +1,25 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Result of a dentry cache lookup. */
+enum dcache_result
+  {
+    DCACHE_MISS,                /* Nothing known about the name. */
+    DCACHE_HIT,                 /* Name exists. */
+    DCACHE_NEGATIVE             /* Name is known not to exist. */
+  };
+
+void dcache_init (void);
+enum dcache_result dcache_lookup (block_sector_t dir, const char *name,
+                                  block_sector_t *sector, bool *is_dir);
+void dcache_insert (block_sector_t dir, const char *name,
+                    block_sector_t sector, bool is_dir);
+void dcache_insert_negative (block_sector_t dir, const char *name);
+void dcache_invalidate (block_sector_t dir, const char *name);
+void dcache_invalidate_dir (block_sector_t dir);
+void dcache_print_stats (void);
+
+#endif /* filesys/dcache.h */
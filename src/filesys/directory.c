@@ -2,37 +2,126 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
 /* A directory. */
-struct dir 
+struct dir
   {
     struct inode *inode;                /* Backing store. */
     off_t pos;                          /* Current position. */
   };
 
 /* A single directory entry. */
-struct dir_entry 
+struct dir_entry
   {
     block_sector_t inode_sector;        /* Sector number of header. */
+    off_t size;                         /* Size of a regular file. */
     char name[NAME_MAX + 1];            /* Null terminated file name. */
-    bool in_use;                        /* In use or free? */
+    uint8_t type;                       /* DT_REG or DT_DIR, 0 if free. */
   };
 
+/* Directory formats.
+
+   A small directory is "linear": the directory file is just an
+   array of struct dir_entry, which is searched from start to
+   end.
+
+   Once a linear directory would grow past LINEAR_MAX_ENTRIES,
+   it is converted to the "indexed" format, in which entries are
+   kept in leaf blocks selected by a hash of their names
+   (extendible hashing, in the style of the ext3 htree).  The
+   directory file then consists of:
+
+     - Block 0, a struct dir_index header.
+
+     - Blocks 1 through TABLE_BLOCKS, the bucket table: an array
+       of 1 << DEPTH block numbers.  A name whose hash has low
+       DEPTH bits equal to I lives in the leaf named by table
+       entry I.
+
+     - Leaf blocks, starting at FIRST_LEAF_BLOCK, each a struct
+       dir_leaf holding up to LEAF_ENTRY_CNT entries.
+
+   A lookup in an indexed directory reads the header, one table
+   block and one leaf, no matter how large the directory is.
+   When a leaf fills up, it is split in two by one more bit of
+   the hash, doubling the table first if necessary.
+
+   The first word of an indexed directory is DIR_INDEX_MAGIC,
+   which can never be the inode sector of a linear directory's
+   first entry. */
+#define DIR_BLOCK_SIZE BLOCK_SECTOR_SIZE
+#define DIR_INDEX_MAGIC 0x48545245      /* "HTRE". */
+#define LINEAR_MAX_ENTRIES \
+  ((off_t) (4 * DIR_BLOCK_SIZE / sizeof (struct dir_entry)))
+
+#define SLOTS_PER_BLOCK ((off_t) (DIR_BLOCK_SIZE / sizeof (uint32_t)))
+#define TABLE_BLOCKS 16
+#define MAX_DEPTH 11                    /* log2 (TABLE_BLOCKS * SLOTS_PER_BLOCK). */
+#define FIRST_LEAF_BLOCK (1 + TABLE_BLOCKS)
+#define TABLE_OFS ((off_t) DIR_BLOCK_SIZE)
+
+#define LEAF_ENTRY_CNT \
+  ((DIR_BLOCK_SIZE - sizeof (uint32_t)) / sizeof (struct dir_entry))
+
+/* Header of an indexed directory. */
+struct dir_index
+  {
+    uint32_t magic;                     /* DIR_INDEX_MAGIC. */
+    uint32_t depth;                     /* Table has 1 << DEPTH slots. */
+    uint32_t leaf_cnt;                  /* Number of leaf blocks. */
+    uint32_t unused[125];               /* Not used. */
+  };
+
+/* A leaf block of an indexed directory.  All of the names in a
+   leaf agree in the low DEPTH bits of their hashes. */
+struct dir_leaf
+  {
+    uint32_t depth;                     /* Local depth. */
+    struct dir_entry entries[LEAF_ENTRY_CNT];
+    uint8_t unused[DIR_BLOCK_SIZE - sizeof (uint32_t)
+                   - LEAF_ENTRY_CNT * sizeof (struct dir_entry)];
+  };
+
+static bool is_indexed (const struct dir *);
+static off_t leaf_ofs (uint32_t leaf_no);
+static unsigned name_hash (const char *);
+static bool index_lookup (const struct dir *, const char *name,
+                          struct dir_entry *, off_t *);
+static bool index_add (struct dir *, const struct dir_entry *);
+static bool convert_to_index (struct dir *);
+static bool next_entry (struct dir *, char name[NAME_MAX + 1]);
+static bool is_empty (struct inode *);
+
 /* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
+   given SECTOR, inside the directory whose inode is in sector
+   PARENT.  Returns true if successful, false on failure. */
 bool
-dir_create (block_sector_t sector, size_t entry_cnt)
+dir_create (block_sector_t sector, size_t entry_cnt, block_sector_t parent)
+{
+  /* SECTOR may have belonged to a removed directory whose ".."
+     or other names are still cached. */
+  dcache_invalidate_dir (sector);
+  return inode_create_dir (sector, entry_cnt * sizeof (struct dir_entry),
+                           parent);
+}
+
+/* Returns the number of journal credits, in the sense of
+   journal_begin(), for dir_create() with ENTRY_CNT entries. */
+size_t
+dir_create_credits (size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  return inode_credits (entry_cnt * sizeof (struct dir_entry));
 }
 
 /* Opens and returns the directory for the given INODE, of which
    it takes ownership.  Returns a null pointer on failure. */
 struct dir *
-dir_open (struct inode *inode) 
+dir_open (struct inode *inode)
 {
   struct dir *dir = calloc (1, sizeof *dir);
   if (inode != NULL && dir != NULL)
@@ -45,7 +134,7 @@ dir_open (struct inode *inode)
     {
       inode_close (inode);
       free (dir);
-      return NULL; 
+      return NULL;
     }
 }
 
@@ -60,14 +149,14 @@ dir_open_root (void)
 /* Opens and returns a new directory for the same inode as DIR.
    Returns a null pointer on failure. */
 struct dir *
-dir_reopen (struct dir *dir) 
+dir_reopen (struct dir *dir)
 {
   return dir_open (inode_reopen (dir->inode));
 }
 
 /* Destroys DIR and frees associated resources. */
 void
-dir_close (struct dir *dir) 
+dir_close (struct dir *dir)
 {
   if (dir != NULL)
     {
@@ -78,68 +167,126 @@ dir_close (struct dir *dir)
 
 /* Returns the inode encapsulated by DIR. */
 struct inode *
-dir_get_inode (struct dir *dir) 
+dir_get_inode (struct dir *dir)
 {
   return dir->inode;
 }
 
+/* Number of entries a linear directory reads per call to
+   inode_read_at(), and the resulting chunk size in bytes. */
+#define CHUNK_ENTRY_CNT (BLOCK_SECTOR_SIZE / sizeof (struct dir_entry))
+#define CHUNK_SIZE ((off_t) (CHUNK_ENTRY_CNT * sizeof (struct dir_entry)))
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   Otherwise, returns false and ignores EP.  In that case, if
+   OFSP is non-null, sets *OFSP to the offset of the first free
+   slot in a linear DIR, or to the end of the directory file if
+   it has no free slot, so that dir_add() need not search again.
+   (For an indexed DIR, *OFSP is not meaningful on failure.) */
 static bool
 lookup (const struct dir *dir, const char *name,
-        struct dir_entry *ep, off_t *ofsp) 
+        struct dir_entry *ep, off_t *ofsp)
 {
-  struct dir_entry e;
-  size_t ofs;
-  
+  struct dir_entry *chunk;
+  off_t free_ofs = -1;
+  off_t ofs;
+  bool found = false;
+
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
-  return false;
+  if (is_indexed (dir))
+    return index_lookup (dir, name, ep, ofsp);
+
+  chunk = malloc (CHUNK_SIZE);
+  if (chunk == NULL)
+    return false;
+
+  /* Read a sector's worth of entries at a time.
+     inode_read_at() will only return a short read at end of file.
+     Otherwise, we'd need to verify that we didn't get a short
+     read due to something intermittent such as low memory. */
+  for (ofs = 0; !found; ofs += CHUNK_SIZE)
+    {
+      off_t n = inode_read_at (dir->inode, chunk, CHUNK_SIZE, ofs);
+      size_t cnt = n / sizeof *chunk;
+      size_t i;
+
+      for (i = 0; i < cnt; i++)
+        if (chunk[i].type != 0 && !strcmp (name, chunk[i].name))
+          {
+            if (ep != NULL)
+              *ep = chunk[i];
+            if (ofsp != NULL)
+              *ofsp = ofs + i * sizeof *chunk;
+            found = true;
+            break;
+          }
+        else if (chunk[i].type == 0 && free_ofs < 0)
+          free_ofs = ofs + i * sizeof *chunk;
+
+      if (n < CHUNK_SIZE)
+        {
+          if (free_ofs < 0)
+            free_ofs = ofs + cnt * sizeof *chunk;
+          break;
+        }
+    }
+  free (chunk);
+
+  if (!found && ofsp != NULL)
+    *ofsp = free_ofs;
+  return found;
 }
 
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   Either way, the outcome is recorded in the dentry cache. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
-            struct inode **inode) 
+            struct inode **inode)
 {
+  block_sector_t dir_sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  dir_sector = inode_get_inumber (dir->inode);
+
+  /* The dentry cache is updated with the directory locked, so
+     that it cannot record the result of a lookup that a
+     concurrent dir_add() or dir_remove() has made stale. */
+  inode_lock_dir (dir->inode);
   if (lookup (dir, name, &e, NULL))
     *inode = inode_open (e.inode_sector);
   else
     *inode = NULL;
 
+  if (*inode != NULL)
+    dcache_insert (dir_sector, name, e.inode_sector, inode_is_dir (*inode));
+  else
+    dcache_insert_negative (dir_sector, name);
+  inode_unlock_dir (dir->inode);
+
   return *inode != NULL;
 }
 
 /* Adds a file named NAME to DIR, which must not already contain a
    file by that name.  The file's inode is in sector
-   INODE_SECTOR.
+   INODE_SECTOR, and it is a directory if IS_DIR is true, or a
+   regular file SIZE bytes long otherwise.
    Returns true if successful, false on failure.
-   Fails if NAME is invalid (i.e. too long) or a disk or memory
-   error occurs. */
+   Fails if NAME is invalid (i.e. too long, or "." or ".."), if
+   DIR has been removed, or if a disk or memory error occurs. */
 bool
-dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
+dir_add (struct dir *dir, const char *name, block_sector_t inode_sector,
+         bool is_dir, off_t size)
 {
   struct dir_entry e;
   off_t ofs;
@@ -149,49 +296,67 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   ASSERT (name != NULL);
 
   /* Check NAME for validity. */
-  if (*name == '\0' || strlen (name) > NAME_MAX)
+  if (*name == '\0' || strlen (name) > NAME_MAX
+      || !strcmp (name, ".") || !strcmp (name, ".."))
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  inode_lock_dir (dir->inode);
+
+  /* Nothing may be added to a directory once it is removed. */
+  if (inode_is_removed (dir->inode))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+  /* Any negative dentry for NAME is about to become wrong. */
+  dcache_invalidate (inode_get_inumber (dir->inode), name);
+
+  /* Check that NAME is not in use, finding a free slot along the
+     way. */
+  if (lookup (dir, name, NULL, &ofs))
+    goto done;
 
-  /* Write slot. */
-  e.in_use = true;
+  /* Fill in new entry. */
+  memset (&e, 0, sizeof e);
+  e.type = is_dir ? DT_DIR : DT_REG;
+  e.size = is_dir ? 0 : size;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+
+  /* A linear directory that has no free slot and is as large as
+     we allow switches to the indexed format. */
+  if (!is_indexed (dir)
+      && ofs >= LINEAR_MAX_ENTRIES * (off_t) sizeof e
+      && !convert_to_index (dir))
+    goto done;
+
+  if (is_indexed (dir))
+    success = index_add (dir, &e);
+  else
+    success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
  done:
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
 /* Removes any entry for NAME in DIR.
-   Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   Returns true if successful, false on failure, which occurs
+   only if there is no file with the given NAME, or if NAME is a
+   directory that is not empty or is open elsewhere (for
+   example, as some process's working directory). */
 bool
-dir_remove (struct dir *dir, const char *name) 
+dir_remove (struct dir *dir, const char *name)
 {
   struct dir_entry e;
   struct inode *inode = NULL;
+  bool victim_locked = false;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  inode_lock_dir (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -201,9 +366,22 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
+  /* Only remove a directory nobody else is using.  The victim
+     stays locked until it is marked removed, so that nothing can
+     be added to it in the meantime. */
+  if (inode_is_dir (inode))
+    {
+      inode_lock_dir (inode);
+      victim_locked = true;
+      if (inode_open_cnt (inode) > 1 || !is_empty (inode))
+        goto done;
+      dcache_invalidate_dir (e.inode_sector);
+    }
+  dcache_invalidate (inode_get_inumber (dir->inode), name);
+
   /* Erase directory entry. */
-  e.in_use = false;
-  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
+  e.type = 0;
+  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
     goto done;
 
   /* Remove inode. */
@@ -211,26 +389,450 @@ dir_remove (struct dir *dir, const char *name)
   success = true;
 
  done:
+  if (victim_locked)
+    inode_unlock_dir (inode);
+  inode_unlock_dir (dir->inode);
   inode_close (inode);
   return success;
 }
 
+/* Records the length of regular file INODE in its entry, named
+   NAME, in the directory whose inode is in sector DIR_SECTOR, so
+   that dir_getdents() can report it without opening INODE.  Does
+   nothing if INODE has been removed.  inode_writev() calls this
+   within the journal operation that extends INODE.
+
+   The length is read with DIR's lock held, so that of two
+   concurrent extensions, the later update records the later
+   length. */
+void
+dir_set_size (block_sector_t dir_sector, const char *name,
+              struct inode *inode)
+{
+  struct dir *dir;
+  struct dir_entry e;
+  off_t ofs;
+
+  /* If INODE has not been removed, neither has its directory,
+     which must be empty to be removed.  Should both be removed
+     from now on, the operation we are in keeps the directory's
+     sector from being reused until we are done with it. */
+  if (inode_is_removed (inode))
+    return;
+  dir = dir_open (inode_open (dir_sector));
+  if (dir == NULL)
+    return;
+
+  inode_lock_dir (dir->inode);
+  if (lookup (dir, name, &e, &ofs)
+      && e.inode_sector == inode_get_inumber (inode))
+    {
+      e.size = inode_length (inode);
+      inode_write_at (dir->inode, &e, sizeof e, ofs);
+    }
+  inode_unlock_dir (dir->inode);
+  dir_close (dir);
+}
+
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
    contains no more entries. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
+{
+  bool success;
+
+  inode_lock_dir (dir->inode);
+  success = next_entry (dir, name);
+  inode_unlock_dir (dir->inode);
+
+  return success;
+}
+
+/* Reads up to CNT of the next entries in DIR into ENTS, along
+   with the type of each and the size of each regular file, which
+   are recorded in the entry itself.
+   Returns the number of entries read, which is less than CNT only
+   if the directory contains no more entries.
+
+   Unlike dir_readdir(), reads the directory a sector's worth of
+   entries at a time, holding DIR's lock throughout, and opens
+   none of the entries' inodes. */
+size_t
+dir_getdents (struct dir *dir, struct dirent *ents, size_t cnt)
+{
+  struct dir_entry *chunk;
+  size_t ent_cnt = 0;
+
+  ASSERT (LEAF_ENTRY_CNT <= CHUNK_ENTRY_CNT);
+
+  chunk = malloc (CHUNK_SIZE);
+  if (chunk == NULL)
+    return 0;
+
+  inode_lock_dir (dir->inode);
+  while (ent_cnt < cnt)
+    {
+      off_t ofs, slot_cnt, i;
+
+      /* Read the rest of the current leaf of an indexed
+         directory, or the next chunk of a linear one. */
+      if (is_indexed (dir))
+        {
+          off_t slot = dir->pos % LEAF_ENTRY_CNT;
+          ofs = (leaf_ofs (dir->pos / LEAF_ENTRY_CNT)
+                 + offsetof (struct dir_leaf, entries)
+                 + slot * sizeof *chunk);
+          slot_cnt = LEAF_ENTRY_CNT - slot;
+        }
+      else
+        {
+          ofs = dir->pos * sizeof *chunk;
+          slot_cnt = CHUNK_ENTRY_CNT;
+        }
+      slot_cnt = (inode_read_at (dir->inode, chunk, slot_cnt * sizeof *chunk,
+                                 ofs)
+                  / sizeof *chunk);
+      if (slot_cnt == 0)
+        break;
+
+      for (i = 0; i < slot_cnt && ent_cnt < cnt; i++)
+        {
+          const struct dir_entry *e = &chunk[i];
+
+          dir->pos++;
+          if (e->type != 0)
+            {
+              struct dirent *d = &ents[ent_cnt++];
+
+              d->d_ino = e->inode_sector;
+              d->d_size = e->size;
+              d->d_type = e->type;
+              strlcpy (d->d_name, e->name, sizeof d->d_name);
+            }
+        }
+    }
+  inode_unlock_dir (dir->inode);
+  free (chunk);
+
+  return ent_cnt;
+}
+
+/* Reads the next directory entry in DIR into NAME, like
+   dir_readdir(), with DIR's lock already held.
+
+   In an indexed directory, DIR's position counts entry slots
+   across the leaf blocks, skipping the header and table. */
+static bool
+next_entry (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  for (;;)
     {
-      dir->pos += sizeof e;
-      if (e.in_use)
+      off_t ofs;
+
+      if (is_indexed (dir))
+        ofs = (leaf_ofs (dir->pos / LEAF_ENTRY_CNT)
+               + offsetof (struct dir_leaf, entries)
+               + dir->pos % LEAF_ENTRY_CNT * sizeof e);
+      else
+        ofs = dir->pos * sizeof e;
+
+      if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+        return false;
+      dir->pos++;
+      if (e.type != 0)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
           return true;
-        } 
+        }
+    }
+}
+
+/* Returns true if the directory whose inode is INODE contains
+   no entries.  The directory's lock must be held. */
+static bool
+is_empty (struct inode *inode)
+{
+  struct dir dir;
+  char name[NAME_MAX + 1];
+
+  dir.inode = inode;
+  dir.pos = 0;
+  return !next_entry (&dir, name);
+}
+
+/* Indexed directories. */
+
+/* Returns true if DIR is in the indexed format. */
+static bool
+is_indexed (const struct dir *dir)
+{
+  uint32_t magic;
+  return (inode_read_at (dir->inode, &magic, sizeof magic, 0) == sizeof magic
+          && magic == DIR_INDEX_MAGIC);
+}
+
+/* Returns the byte offset of leaf LEAF_NO in an indexed
+   directory. */
+static off_t
+leaf_ofs (uint32_t leaf_no)
+{
+  return (FIRST_LEAF_BLOCK + leaf_no) * DIR_BLOCK_SIZE;
+}
+
+/* Returns the hash of NAME used to select its leaf. */
+static unsigned
+name_hash (const char *name)
+{
+  return hash_string (name);
+}
+
+/* Reads entry SLOT of indexed directory DIR's bucket table and
+   returns the leaf number stored there. */
+static uint32_t
+table_get (const struct dir *dir, uint32_t slot)
+{
+  uint32_t leaf_no = 0;
+  inode_read_at (dir->inode, &leaf_no, sizeof leaf_no,
+                 TABLE_OFS + slot * sizeof leaf_no);
+  return leaf_no;
+}
+
+/* Sets entry SLOT of indexed directory DIR's bucket table to
+   LEAF_NO.  Returns true if successful, false on failure. */
+static bool
+table_set (struct dir *dir, uint32_t slot, uint32_t leaf_no)
+{
+  return inode_write_at (dir->inode, &leaf_no, sizeof leaf_no,
+                         TABLE_OFS + slot * sizeof leaf_no)
+         == sizeof leaf_no;
+}
+
+/* Reads the header of indexed directory DIR into *H. */
+static bool
+read_header (const struct dir *dir, struct dir_index *h)
+{
+  return inode_read_at (dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Reads into *LEAF the leaf of indexed directory DIR that holds
+   names with hash HASH, and stores its leaf number in *LEAF_NO.
+   Returns true if successful, false on failure. */
+static bool
+find_leaf (const struct dir *dir, unsigned hash,
+           struct dir_leaf *leaf, uint32_t *leaf_no)
+{
+  struct dir_index h;
+
+  if (!read_header (dir, &h))
+    return false;
+  *leaf_no = table_get (dir, hash & ((1u << h.depth) - 1));
+  return (*leaf_no < h.leaf_cnt
+          && inode_read_at (dir->inode, leaf, sizeof *leaf,
+                            leaf_ofs (*leaf_no)) == sizeof *leaf);
+}
+
+/* lookup() for an indexed directory. */
+static bool
+index_lookup (const struct dir *dir, const char *name,
+              struct dir_entry *ep, off_t *ofsp)
+{
+  struct dir_leaf *leaf = malloc (sizeof *leaf);
+  uint32_t leaf_no;
+  bool found = false;
+
+  if (leaf != NULL && find_leaf (dir, name_hash (name), leaf, &leaf_no))
+    {
+      size_t i;
+
+      for (i = 0; i < LEAF_ENTRY_CNT; i++)
+        {
+          struct dir_entry *e = &leaf->entries[i];
+          if (e->type != 0 && !strcmp (name, e->name))
+            {
+              if (ep != NULL)
+                *ep = *e;
+              if (ofsp != NULL)
+                *ofsp = (leaf_ofs (leaf_no)
+                         + offsetof (struct dir_leaf, entries)
+                         + i * sizeof *e);
+              found = true;
+              break;
+            }
+        }
     }
-  return false;
+  free (leaf);
+  return found;
+}
+
+/* Splits full leaf LEAF, number LEAF_NO, of indexed directory
+   DIR, whose header is *H, moving the entries whose hashes have
+   bit LEAF->depth set into a new leaf.  Doubles the bucket table
+   first if LEAF is already distinguished by every bit it
+   indexes.  Returns true if successful, false if the table is
+   already as large as it can be or on disk error. */
+static bool
+split_leaf (struct dir *dir, struct dir_index *h,
+            struct dir_leaf *leaf, uint32_t leaf_no, unsigned hash)
+{
+  struct dir_leaf *new_leaf;
+  uint32_t new_no, bit, slot;
+  size_t i;
+  bool success = false;
+
+  if (leaf->depth == h->depth)
+    {
+      uint32_t slot_cnt = 1u << h->depth;
+      uint32_t *table;
+
+      if (h->depth >= MAX_DEPTH)
+        return false;
+
+      /* Double the table: the upper half starts out as a copy of
+         the lower half. */
+      table = malloc (slot_cnt * sizeof *table);
+      if (table == NULL)
+        return false;
+      if (inode_read_at (dir->inode, table, slot_cnt * sizeof *table,
+                         TABLE_OFS) != (off_t) (slot_cnt * sizeof *table)
+          || inode_write_at (dir->inode, table, slot_cnt * sizeof *table,
+                             TABLE_OFS + slot_cnt * sizeof *table)
+             != (off_t) (slot_cnt * sizeof *table))
+        {
+          free (table);
+          return false;
+        }
+      free (table);
+      h->depth++;
+    }
+
+  new_leaf = calloc (1, sizeof *new_leaf);
+  if (new_leaf == NULL)
+    return false;
+
+  /* Move entries whose hashes have the new bit set. */
+  bit = 1u << leaf->depth;
+  leaf->depth++;
+  new_leaf->depth = leaf->depth;
+  for (i = 0; i < LEAF_ENTRY_CNT; i++)
+    {
+      struct dir_entry *e = &leaf->entries[i];
+      if (e->type != 0 && (name_hash (e->name) & bit) != 0)
+        {
+          new_leaf->entries[i] = *e;
+          e->type = 0;
+        }
+    }
+
+  /* Write both leaves and the header, then point the table slots
+     that select the new leaf at it.  Those are the slots that
+     agree with HASH in the bits below BIT and have BIT set. */
+  new_no = h->leaf_cnt++;
+  if (inode_write_at (dir->inode, new_leaf, sizeof *new_leaf,
+                      leaf_ofs (new_no)) != sizeof *new_leaf
+      || inode_write_at (dir->inode, leaf, sizeof *leaf,
+                         leaf_ofs (leaf_no)) != sizeof *leaf
+      || inode_write_at (dir->inode, h, sizeof *h, 0) != sizeof *h)
+    goto done;
+  for (slot = (hash & (bit - 1)) | bit; slot < (1u << h->depth);
+       slot += bit << 1)
+    if (!table_set (dir, slot, new_no))
+      goto done;
+  success = true;
+
+ done:
+  free (new_leaf);
+  return success;
+}
+
+/* Adds entry E to indexed directory DIR.
+   Returns true if successful, false on failure. */
+static bool
+index_add (struct dir *dir, const struct dir_entry *e)
+{
+  struct dir_leaf *leaf = malloc (sizeof *leaf);
+  unsigned hash = name_hash (e->name);
+  bool success = false;
+
+  if (leaf == NULL)
+    return false;
+
+  for (;;)
+    {
+      struct dir_index h;
+      uint32_t leaf_no;
+      size_t i;
+
+      if (!find_leaf (dir, hash, leaf, &leaf_no))
+        break;
+
+      for (i = 0; i < LEAF_ENTRY_CNT; i++)
+        if (leaf->entries[i].type == 0)
+          break;
+      if (i < LEAF_ENTRY_CNT)
+        {
+          off_t ofs = (leaf_ofs (leaf_no)
+                       + offsetof (struct dir_leaf, entries)
+                       + i * sizeof *e);
+          success = inode_write_at (dir->inode, e, sizeof *e, ofs)
+                    == sizeof *e;
+          break;
+        }
+
+      /* Leaf is full.  Split it and try again. */
+      if (!read_header (dir, &h) || !split_leaf (dir, &h, leaf, leaf_no, hash))
+        break;
+    }
+
+  free (leaf);
+  return success;
+}
+
+/* Converts linear directory DIR to the indexed format.
+   Returns true if successful, false on failure. */
+static bool
+convert_to_index (struct dir *dir)
+{
+  struct dir_entry *entries;
+  struct dir_index *h;
+  struct dir_leaf *leaf;
+  off_t size = inode_length (dir->inode);
+  off_t cnt = size / sizeof *entries;
+  uint32_t zero = 0;
+  bool success = false;
+  off_t i;
+
+  entries = malloc (size > 0 ? size : 1);
+  h = calloc (1, sizeof *h);
+  leaf = calloc (1, sizeof *leaf);
+  if (entries == NULL || h == NULL || leaf == NULL
+      || inode_read_at (dir->inode, entries, size, 0) != size)
+    goto done;
+
+  /* Write an empty index with a single leaf.  The leaf and table
+     slot 0 overwrite the old linear entries, which we hold in
+     memory. */
+  h->magic = DIR_INDEX_MAGIC;
+  h->depth = 0;
+  h->leaf_cnt = 1;
+  if (inode_write_at (dir->inode, leaf, sizeof *leaf, leaf_ofs (0))
+      != sizeof *leaf
+      || inode_write_at (dir->inode, &zero, sizeof zero, TABLE_OFS)
+         != sizeof zero
+      || inode_write_at (dir->inode, h, sizeof *h, 0) != sizeof *h)
+    goto done;
+
+  /* Reinsert the old entries. */
+  for (i = 0; i < cnt; i++)
+    if (entries[i].type != 0 && !index_add (dir, &entries[i]))
+      goto done;
+  success = true;
+
+ done:
+  free (leaf);
+  free (h);
+  free (entries);
+  return success;
 }
@@ -3,7 +3,9 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <dirent.h>
 #include "devices/block.h"
+#include "filesys/off_t.h"
 
 /* Maximum length of a file name component.
    This is the traditional UNIX maximum length.
@@ -11,10 +13,23 @@
    retained, but much longer full path names must be allowed. */
 #define NAME_MAX 14
 
+/* Journal credits, in the sense of journal_begin(), for
+   dir_add() and dir_remove().  Adding an entry may write the
+   header, the whole bucket table, the leaves touched by
+   converting a full linear directory or splitting a leaf down to
+   the deepest level, and the index sectors that grow the
+   directory file.  Removing one, or recording a file's size in it
+   with dir_set_size(), writes the sectors that hold the entry. */
+#define DIR_ADD_CREDITS 64
+#define DIR_REMOVE_CREDITS 2
+#define DIR_SET_SIZE_CREDITS 2
+
 struct inode;
 
 /* Opening and closing directories. */
-bool dir_create (block_sector_t sector, size_t entry_cnt);
+bool dir_create (block_sector_t sector, size_t entry_cnt,
+                 block_sector_t parent);
+size_t dir_create_credits (size_t entry_cnt);
 struct dir *dir_open (struct inode *);
 struct dir *dir_open_root (void);
 struct dir *dir_reopen (struct dir *);
@@ -23,8 +38,12 @@ struct inode *dir_get_inode (struct dir *);
 
 /* Reading and writing. */
 bool dir_lookup (const struct dir *, const char *name, struct inode **);
-bool dir_add (struct dir *, const char *name, block_sector_t);
+bool dir_add (struct dir *, const char *name, block_sector_t, bool is_dir,
+              off_t size);
 bool dir_remove (struct dir *, const char *name);
+void dir_set_size (block_sector_t dir_sector, const char *name,
+                   struct inode *);
 bool dir_readdir (struct dir *, char name[NAME_MAX + 1]);
+size_t dir_getdents (struct dir *, struct dirent *, size_t cnt);
 
 #endif /* filesys/directory.h */
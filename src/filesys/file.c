@@ -113,6 +113,45 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Reads from FILE into the IOVCNT buffers in IOV, filling each in
+   turn, starting at the file's current position.
+   Returns the number of bytes actually read,
+   which may be less than requested if end of file is reached.
+   Advances FILE's position by the number of bytes read. */
+off_t
+file_readv (struct file *file, const struct iovec *iov, int iovcnt) 
+{
+  off_t bytes_read = inode_readv (file->inode, iov, iovcnt, file->pos);
+  file->pos += bytes_read;
+  return bytes_read;
+}
+
+/* Writes the IOVCNT buffers in IOV, one after another, into FILE,
+   starting at the file's current position.
+   Returns the number of bytes actually written,
+   which may be less than requested if the disk fills up.
+   Advances FILE's position by the number of bytes written. */
+off_t
+file_writev (struct file *file, const struct iovec *iov, int iovcnt) 
+{
+  off_t bytes_written = inode_writev (file->inode, iov, iovcnt, file->pos);
+  file->pos += bytes_written;
+  return bytes_written;
+}
+
+/* Copies up to SIZE bytes from SRC, starting at offset SRC_OFS,
+   into DST, starting at offset DST_OFS, without passing them
+   through a caller's buffer.
+   Returns the number of bytes actually copied,
+   which may be less than SIZE if end of SRC is reached.
+   The files' current positions are unaffected. */
+off_t
+file_copy_at (struct file *src, off_t src_ofs, struct file *dst,
+              off_t dst_ofs, off_t size) 
+{
+  return inode_copy (src->inode, src_ofs, dst->inode, dst_ofs, size);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
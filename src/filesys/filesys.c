@@ -2,30 +2,71 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
-static void do_format (void);
+/* File system block size. */
+size_t fs_block_size;
+size_t fs_block_sectors;
+
+/* Identifies a superblock. */
+#define SUPER_MAGIC 0x50465342          /* "PFSB". */
+
+/* On-disk superblock, in SUPER_SECTOR.  Records the parameters
+   chosen when the file system was formatted.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct superblock
+  {
+    uint32_t magic;                     /* SUPER_MAGIC. */
+    uint32_t block_size;                /* Block size in bytes. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 2 * sizeof (uint32_t)];
+  };
+
+static void set_block_size (size_t);
+static void read_superblock (void);
+static void do_format (size_t block_size);
+static bool create (const char *path, off_t initial_size, bool is_dir);
+static bool resolve (const char *path, block_sector_t *dirp,
+                     char name[NAME_MAX + 1]);
+static struct dir *open_dir (block_sector_t);
+static bool lookup (block_sector_t dir, const char *name,
+                    block_sector_t *sectorp, bool *is_dirp,
+                    struct inode **inodep);
 
 /* Initializes the file system module.
-   If FORMAT is true, reformats the file system. */
+   If FORMAT is true, reformats the file system with BLOCK_SIZE
+   byte blocks.  Otherwise, BLOCK_SIZE is ignored in favor of the
+   block size that the file system was formatted with. */
 void
-filesys_init (bool format) 
+filesys_init (bool format, size_t block_size) 
 {
   fs_device = block_get_role (BLOCK_FILESYS);
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  if (format)
+    set_block_size (block_size);
+  else
+    read_superblock ();
+
   inode_init ();
+  cache_init ();
+  dcache_init ();
   free_map_init ();
+  journal_init (format);
 
   if (format) 
-    do_format ();
+    do_format (block_size);
 
   free_map_open ();
 }
@@ -35,30 +76,39 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  cache_flush_all ();
+
+  /* Commit once before closing the free map, so that it gives back
+     the blocks freed since the last commit and the free map written
+     below records them as free. */
+  journal_commit ();
   free_map_close ();
+  journal_done ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
+   NAME may be an absolute path or one relative to the current
+   working directory.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
+   if a directory along its path does not exist,
    or if internal memory allocation fails. */
 bool
 filesys_create (const char *name, off_t initial_size) 
 {
-  block_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
-                  && dir_add (dir, name, inode_sector));
-  if (!success && inode_sector != 0) 
-    free_map_release (inode_sector, 1);
-  dir_close (dir);
+  return create (name, initial_size, false);
+}
 
-  return success;
+/* Creates an empty directory named NAME.
+   Returns true if successful, false otherwise.
+   Fails in the same cases as filesys_create(). */
+bool
+filesys_mkdir (const char *name)
+{
+  return create (name, 0, true);
 }
 
-/* Opens the file with the given NAME.
+/* Opens the file or directory with the given NAME.
    Returns the new file if successful or a null pointer
    otherwise.
    Fails if no file named NAME exists,
@@ -66,38 +116,319 @@ filesys_create (const char *name, off_t initial_size)
 struct file *
 filesys_open (const char *name)
 {
-  struct dir *dir = dir_open_root ();
+  block_sector_t dir, sector;
+  char part[NAME_MAX + 1];
   struct inode *inode = NULL;
+  bool is_dir;
 
-  if (dir != NULL)
-    dir_lookup (dir, name, &inode);
-  dir_close (dir);
+  if (!resolve (name, &dir, part))
+    return NULL;
+  if (part[0] == '\0')
+    sector = dir;
+  else if (!lookup (dir, part, &sector, &is_dir, &inode))
+    return NULL;
 
+  if (inode == NULL)
+    inode = inode_open (sector);
   return file_open (inode);
 }
 
-/* Deletes the file named NAME.
+/* Deletes the file or empty directory named NAME.
    Returns true if successful, false on failure.
-   Fails if no file named NAME exists,
-   or if an internal memory allocation fails. */
+   Fails if no file named NAME exists, if NAME is a directory
+   that is not empty or is in use, or if an internal memory
+   allocation fails. */
 bool
 filesys_remove (const char *name) 
 {
-  struct dir *dir = dir_open_root ();
-  bool success = dir != NULL && dir_remove (dir, name);
+  block_sector_t parent;
+  char part[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  if (!resolve (name, &parent, part) || part[0] == '\0')
+    return false;
+
+  dir = open_dir (parent);
+  journal_begin (DIR_REMOVE_CREDITS);
+  success = dir != NULL && dir_remove (dir, part);
+  journal_end ();
   dir_close (dir); 
 
   return success;
 }
-
-/* Formats the file system. */
+
+/* Changes the current thread's working directory to NAME.
+   Returns true if successful, false if NAME does not exist or
+   is not a directory. */
+bool
+filesys_chdir (const char *name)
+{
+  struct thread *cur = thread_current ();
+  block_sector_t dir, sector;
+  char part[NAME_MAX + 1];
+  bool is_dir = true;
+  struct dir *cwd;
+
+  if (!resolve (name, &dir, part))
+    return false;
+  if (part[0] == '\0')
+    sector = dir;
+  else if (!lookup (dir, part, &sector, &is_dir, NULL) || !is_dir)
+    return false;
+
+  cwd = open_dir (sector);
+  if (cwd == NULL)
+    return false;
+  dir_close (cur->cwd);
+  cur->cwd = cwd;
+  return true;
+}
+
+/* Creates a file (or directory, if IS_DIR) at PATH. */
+static bool
+create (const char *path, off_t initial_size, bool is_dir)
+{
+  block_sector_t parent;
+  char name[NAME_MAX + 1];
+  block_sector_t inode_sector = 0;
+  struct dir *dir = NULL;
+  bool created, success;
+
+  if (resolve (path, &parent, name) && name[0] != '\0')
+    dir = open_dir (parent);
+  journal_begin (DIR_ADD_CREDITS + (is_dir ? dir_create_credits (16)
+                                    : inode_credits (initial_size)));
+  created = (dir != NULL
+             && free_map_allocate_near (1, parent, &inode_sector)
+             && (is_dir
+                 ? dir_create (inode_sector, 16, parent)
+                 : inode_create (inode_sector, initial_size, parent, name)));
+  success = created && dir_add (dir, name, inode_sector, is_dir,
+                                is_dir ? 0 : initial_size);
+  if (!success && created)
+    {
+      /* Release the inode along with its data sectors. */
+      struct inode *inode = inode_open (inode_sector);
+      if (inode != NULL)
+        inode_remove (inode);
+      inode_close (inode);
+    }
+  else if (!success && inode_sector != 0) 
+    free_map_release (inode_sector, 1);
+  journal_end ();
+  dir_close (dir);
+
+  return success;
+}
+
+/* Extracts a file name part from *SRCP into PART, and updates
+   *SRCP so that the next call will return the next file name
+   part.  Returns 1 if successful, 0 at end of string, -1 for a
+   too-long file name part. */
+static int
+get_next_part (char part[NAME_MAX + 1], const char **srcp)
+{
+  const char *src = *srcp;
+  char *dst = part;
+
+  /* Skip leading slashes.  If it's all slashes, we're done. */
+  while (*src == '/')
+    src++;
+  if (*src == '\0')
+    return 0;
+
+  /* Copy up to NAME_MAX character from SRC to DST.  Add null
+     terminator. */
+  while (*src != '/' && *src != '\0') 
+    {
+      if (dst < part + NAME_MAX)
+        *dst++ = *src;
+      else
+        return -1;
+      src++; 
+    }
+  *dst = '\0';
+
+  /* Advance source pointer. */
+  *srcp = src;
+  return 1;
+}
+
+/* Walks PATH up to, but not including, its last component.
+   On success, stores the inode sector of the directory that
+   contains the last component in *DIRP, stores the last
+   component in NAME, and returns true.  NAME is set to the empty
+   string if PATH names the root directory, e.g. "/".
+   Returns false if PATH is empty, if a component is too long, or
+   if a directory along the way does not exist.
+
+   Relative paths start from the current thread's working
+   directory.  Components that have been looked up before are
+   resolved from the dentry cache without touching the disk. */
+static bool
+resolve (const char *path, block_sector_t *dirp, char name[NAME_MAX + 1])
+{
+  struct dir *cwd = thread_current ()->cwd;
+  block_sector_t dir;
+  char part[NAME_MAX + 1];
+  int result;
+
+  if (*path == '\0')
+    return false;
+  if (*path == '/' || cwd == NULL)
+    dir = ROOT_DIR_SECTOR;
+  else
+    dir = inode_get_inumber (dir_get_inode (cwd));
+
+  name[0] = '\0';
+  while ((result = get_next_part (part, &path)) > 0)
+    {
+      /* The previous component must be a directory. */
+      if (name[0] != '\0')
+        {
+          bool is_dir;
+          if (!lookup (dir, name, &dir, &is_dir, NULL) || !is_dir)
+            return false;
+        }
+      strlcpy (name, part, NAME_MAX + 1);
+    }
+  if (result < 0)
+    return false;
+
+  *dirp = dir;
+  return true;
+}
+
+/* Opens the directory whose inode is in SECTOR.  Returns a null
+   pointer on failure, or if SECTOR is not a directory, which can
+   happen if the directory a path resolved to was removed, and its
+   sector reused, before it could be opened. */
+static struct dir *
+open_dir (block_sector_t sector)
+{
+  struct inode *inode = inode_open (sector);
+
+  if (inode != NULL && !inode_is_dir (inode))
+    {
+      inode_close (inode);
+      return NULL;
+    }
+  return dir_open (inode);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   On success, stores the inode sector of the named file in
+   *SECTORP and whether it is a directory in *IS_DIRP, and
+   returns true.  Consults the dentry cache first; on a miss,
+   dir_lookup() records the outcome of the directory search
+   there.
+
+   If INODEP is non-null, then on success *INODEP is set either
+   to the named inode, if the lookup had to open it anyway, which
+   the caller must close, or to a null pointer. */
+static bool
+lookup (block_sector_t dir, const char *name,
+        block_sector_t *sectorp, bool *is_dirp, struct inode **inodep)
+{
+  struct dir *d;
+  struct inode *inode;
+  bool found = true;
+
+  if (inodep != NULL)
+    *inodep = NULL;
+  if (!strcmp (name, "."))
+    {
+      *sectorp = dir;
+      *is_dirp = true;
+      return true;
+    }
+
+  switch (dcache_lookup (dir, name, sectorp, is_dirp))
+    {
+    case DCACHE_HIT:
+      return true;
+    case DCACHE_NEGATIVE:
+      return false;
+    case DCACHE_MISS:
+      break;
+    }
+
+  d = open_dir (dir);
+  if (d == NULL)
+    return false;
+  if (!strcmp (name, ".."))
+    {
+      *sectorp = inode_get_parent (dir_get_inode (d));
+      *is_dirp = true;
+      dcache_insert (dir, name, *sectorp, true);
+    }
+  else if (dir_lookup (d, name, &inode))
+    {
+      *sectorp = inode_get_inumber (inode);
+      *is_dirp = inode_is_dir (inode);
+      if (inodep != NULL)
+        *inodep = inode;
+      else
+        inode_close (inode);
+    }
+  else
+    found = false;
+  dir_close (d);
+
+  return found;
+}
+
+/* Sets the file system block size to BLOCK_SIZE bytes, panicking
+   if that is not a valid block size. */
 static void
-do_format (void)
+set_block_size (size_t block_size)
 {
-  printf ("Formatting file system...");
+  if (block_size < FS_BLOCK_MIN || block_size > FS_BLOCK_MAX
+      || (block_size & (block_size - 1)) != 0)
+    PANIC ("invalid file system block size %zu", block_size);
+  fs_block_size = block_size;
+  fs_block_sectors = block_size / BLOCK_SECTOR_SIZE;
+}
+
+/* Reads the superblock and adopts its block size. */
+static void
+read_superblock (void)
+{
+  struct superblock *sb = malloc (sizeof *sb);
+
+  ASSERT (sizeof *sb == BLOCK_SECTOR_SIZE);
+  if (sb == NULL)
+    PANIC ("out of memory reading superblock");
+  block_read (fs_device, SUPER_SECTOR, sb);
+  if (sb->magic != SUPER_MAGIC)
+    PANIC ("file system not formatted (use -f to format it)");
+  set_block_size (sb->block_size);
+  free (sb);
+}
+
+/* Formats the file system with BLOCK_SIZE-byte blocks, which the
+   caller has already adopted. */
+static void
+do_format (size_t block_size)
+{
+  struct superblock *sb = calloc (1, sizeof *sb);
+
+  if (sb == NULL)
+    PANIC ("out of memory writing superblock");
+  printf ("Formatting file system with %zu-byte blocks...", block_size);
+  sb->magic = SUPER_MAGIC;
+  sb->block_size = block_size;
+  block_write (fs_device, SUPER_SECTOR, sb);
+  free (sb);
+
+  journal_begin (inode_credits (free_map_sectors () * BLOCK_SECTOR_SIZE)
+                 + dir_create_credits (16));
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  if (!dir_create (ROOT_DIR_SECTOR, 16, ROOT_DIR_SECTOR))
     PANIC ("root directory creation failed");
   free_map_close ();
+  journal_end ();
+  journal_commit ();
   printf ("done.\n");
 }
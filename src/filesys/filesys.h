@@ -2,19 +2,40 @@
 #define FILESYS_FILESYS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
 #include "filesys/off_t.h"
 
-/* Sectors of system file inodes. */
-#define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
-#define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+/* Fixed sectors. */
+#define SUPER_SECTOR 0          /* Superblock. */
+#define FREE_MAP_SECTOR 1       /* Free map file inode sector. */
+#define ROOT_DIR_SECTOR 2       /* Root directory file inode sector. */
+#define JOURNAL_SECTOR 8        /* First sector of the journal. */
+
+/* File system block sizes, in bytes.  A block must be a power of
+   two that fits in a page, and the sectors above, except the
+   journal, must fit in the first FS_BLOCK_MAX bytes.  Every inode
+   and index sector takes a whole block, so larger blocks are
+   opt-in: they suit file systems of few, large files. */
+#define FS_BLOCK_MIN BLOCK_SECTOR_SIZE
+#define FS_BLOCK_MAX 4096
+#define FS_BLOCK_DEFAULT BLOCK_SECTOR_SIZE
 
 /* Block device that contains the file system. */
 struct block *fs_device;
 
-void filesys_init (bool format);
+/* Size of a file system block, the unit in which space is
+   allocated to files, in bytes and in sectors.  Chosen when the
+   file system is formatted. */
+extern size_t fs_block_size;
+extern size_t fs_block_sectors;
+
+void filesys_init (bool format, size_t block_size);
 void filesys_done (void);
 bool filesys_create (const char *name, off_t initial_size);
+bool filesys_mkdir (const char *name);
 struct file *filesys_open (const char *name);
 bool filesys_remove (const char *name);
+bool filesys_chdir (const char *name);
 
 #endif /* filesys/filesys.h */
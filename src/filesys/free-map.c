@@ -1,85 +1,615 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
-#include "filesys/file.h"
+#include <round.h>
+#include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
-static struct file *free_map_file;   /* Free map file. */
-static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct inode *free_map_inode; /* Free map file. */
+static struct bitmap *free_map;      /* Free map, one bit per block. */
+
+/* The free map tracks file system blocks, each fs_block_sectors
+   sectors long.  Its interface names a block by the number of its
+   first sector, but counts blocks, not sectors.
+
+   Free map summary.
+
+   The free map file is made up of sectors of bits, each of which
+   describes a "group" of GROUP_BITS consecutive blocks on the
+   file system device.  For each group we keep a summary in
+   memory: its number of free blocks, the lengths of the runs of
+   free blocks at its start and at its end, and the length of the
+   longest run of free blocks within it.  That is enough to tell,
+   without looking at any bits, whether a run of a given length
+   starts in a group, either inside it or in its tail and
+   continuing into the groups after it, so a search examines the
+   bits of only a group that is known to hold a fit.  The summary
+   of a group is recomputed from its bits, a byte at a time,
+   whenever they change.
+
+   We also remember which groups changed since the free map was
+   last written, so that free_map_flush() only has to write those
+   sectors of the free map file.  The free map file is metadata,
+   so those sectors go through the journal; they are written
+   there directly, rather than with inode_write_at(), so that
+   flushing the free map never waits on the page cache, which
+   allocates blocks when it writes back file data. */
+#define GROUP_BITS (BLOCK_SECTOR_SIZE * 8)
+
+/* Summary of a group. */
+struct group
+  {
+    size_t free_cnt;                 /* Free blocks. */
+    size_t head;                     /* Free blocks at its start. */
+    size_t tail;                     /* Free blocks at its end. */
+    size_t longest;                  /* Longest run of free blocks. */
+  };
+
+static size_t group_cnt;             /* Number of groups. */
+static struct group *groups;         /* Summary of each group. */
+static struct bitmap *dirty_groups;  /* Groups changed since last flush. */
+
+/* Reservations.
+
+   Blocks for file data are not allocated when the data is
+   written, but when the page cache writes it back, so that a file
+   written in many small pieces still gets one contiguous run of
+   blocks.  free_map_reserve() sets blocks aside at write time,
+   so that write-back cannot run out of space.  Reserved blocks
+   are not any particular blocks: they are simply not available
+   to allocations that don't say they have a reservation. */
+static size_t free_cnt;              /* Free blocks, reserved or not. */
+static size_t reserved_cnt;          /* Blocks set aside. */
+
+/* Allocation policy.
+
+   An allocation takes the first run of free blocks long enough
+   for it that starts at or after its locality hint, so that a
+   file's blocks follow its inode and each other.  Allocations
+   without a hint of their own use the block after the previous
+   such allocation ("next fit").  If no run after the hint is long
+   enough, the allocation takes a run in the group whose longest
+   free run is the shortest that fits ("best fit" by group), which
+   leaves long runs for the allocations that need them, and only
+   failing that the first run on the device, which must then span
+   groups. */
+static size_t next_fit;
+
+/* Protects all of the free map state above. */
+static struct lock free_map_lock;
+static struct lock_stats free_map_lock_stats;
+
+static void mark_blocks (size_t, size_t cnt, bool allocated);
+static void count_free_blocks (void);
+static void summarize (size_t group);
+static size_t find_free (size_t start, size_t end, size_t cnt);
+static size_t find_best (size_t cnt);
+static bool allocate (size_t cnt, size_t reserved, block_sector_t hint,
+                      block_sector_t *sectorp);
+static void write_group (size_t group);
 
 /* Initializes the free map. */
 void
-free_map_init (void) 
+free_map_init (void)
 {
-  free_map = bitmap_create (block_size (fs_device));
+  free_map = bitmap_create (block_size (fs_device) / fs_block_sectors);
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
-  bitmap_mark (free_map, FREE_MAP_SECTOR);
-  bitmap_mark (free_map, ROOT_DIR_SECTOR);
+
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_BITS);
+  groups = malloc (group_cnt * sizeof *groups);
+  dirty_groups = bitmap_create (group_cnt);
+  if (groups == NULL || dirty_groups == NULL)
+    PANIC ("free map summary creation failed");
+  count_free_blocks ();
+  next_fit = 0;
+  lock_init (&free_map_lock);
+  lock_stats_init (&free_map_lock_stats, "free map");
+  lock_set_stats (&free_map_lock, &free_map_lock_stats);
+
+  /* The superblock, the free map and root directory inodes, and
+     the journal occupy the start of the device. */
+  mark_blocks (0, DIV_ROUND_UP (JOURNAL_SECTOR + JOURNAL_SECTORS,
+                                fs_block_sectors), true);
 }
 
-/* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+/* Allocates CNT consecutive blocks from the free map and stores
+   the first sector of the first into *SECTORP.  The search starts
+   where the previous such allocation left off, as described under
+   "Allocation policy" above.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   blocks were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
-    }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (cnt, 0, next_fit * fs_block_sectors, sectorp);
+  if (success)
+    next_fit = *sectorp / fs_block_sectors + cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Allocates CNT consecutive blocks from the free map and stores
+   the first sector of the first into *SECTORP, preferring the
+   first free run at or after sector HINT, such as the sector of
+   the inode that will own the blocks or the sector after the
+   owner's last data block.  Falls back to the best fitting free
+   run elsewhere on the device, as described under "Allocation
+   policy" above.
+   Returns true if successful, false if not enough consecutive
+   blocks were available.
+
+   Only the in-memory free map is updated.  The free map file is
+   brought up to date by free_map_flush(). */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t hint,
+                        block_sector_t *sectorp)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (cnt, 0, hint, sectorp);
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Like free_map_allocate_near(), but RESERVED of the CNT blocks
+   are covered by earlier calls to free_map_reserve(), whose
+   reservations are used up if the allocation succeeds. */
+bool
+free_map_allocate_reserved (size_t cnt, size_t reserved,
+                            block_sector_t hint, block_sector_t *sectorp)
+{
+  bool success;
+
+  ASSERT (reserved <= cnt);
+
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved <= reserved_cnt);
+  success = allocate (cnt, reserved, hint, sectorp);
+  if (success)
+    reserved_cnt -= reserved;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Sets aside CNT free blocks, to be allocated later with
+   free_map_allocate_reserved().  Returns true if successful, false
+   if fewer than CNT blocks are both free and not yet set aside. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = free_cnt - reserved_cnt >= cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT blocks set aside by free_map_reserve() that
+   turned out not to be needed. */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (cnt <= reserved_cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Frees CNT blocks starting at the one that begins at SECTOR.
+   Journaled writes of their sectors that have not reached the
+   disk yet are revoked.  The blocks only become available once
+   the journal has checkpointed the transaction that freed them,
+   because until then the file system on disk may still refer to
+   them; the journal then calls free_map_reclaim(). */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
-  ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  size_t i;
+
+  ASSERT (sector % fs_block_sectors == 0);
+
+  lock_acquire (&free_map_lock);
+  ASSERT (bitmap_all (free_map, sector / fs_block_sectors, cnt));
+  lock_release (&free_map_lock);
+
+  for (i = 0; i < cnt * fs_block_sectors; i++)
+    journal_revoke (sector + i);
+  journal_release (sector, cnt);
+}
+
+/* Makes CNT blocks starting at the one that begins at SECTOR,
+   freed earlier by free_map_release(), available for use. */
+void
+free_map_reclaim (block_sector_t sector, size_t cnt)
+{
+  size_t block = sector / fs_block_sectors;
+
+  lock_acquire (&free_map_lock);
+  ASSERT (bitmap_all (free_map, block, cnt));
+  mark_blocks (block, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Returns the number of free blocks that are not set aside by
+   free_map_reserve(). */
+size_t
+free_map_available (void)
+{
+  size_t cnt;
+
+  lock_acquire (&free_map_lock);
+  cnt = free_cnt - reserved_cnt;
+  lock_release (&free_map_lock);
+  return cnt;
+}
+
+/* Returns the number of sectors in the free map file, which is
+   the most that one flush of the free map writes. */
+size_t
+free_map_sectors (void)
+{
+  return group_cnt;
+}
+
+/* Writes the sectors of the free map file that describe groups
+   changed since the last flush.  Called when the file system is
+   created and shut down; every journal commit does the same with
+   free_map_freeze(). */
+void
+free_map_flush (void)
+{
+  free_map_freeze ();
+  free_map_thaw ();
+}
+
+/* Writes the changed sectors of the free map file, like
+   free_map_flush(), and then keeps the free map from changing
+   until free_map_thaw() is called.  The journal uses this to take
+   a transaction that includes every allocation whose sector
+   number the transaction might have recorded. */
+void
+free_map_freeze (void)
+{
+  size_t group;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_inode != NULL)
+    for (group = 0; group < group_cnt; group++)
+      if (bitmap_test (dirty_groups, group))
+        write_group (group);
+}
+
+/* Lets the free map change again after free_map_freeze(). */
+void
+free_map_thaw (void)
+{
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
 void
-free_map_open (void) 
+free_map_open (void)
 {
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  uint8_t buffer[BLOCK_SECTOR_SIZE];
+  size_t group;
+
+  free_map_inode = inode_open (FREE_MAP_SECTOR);
+  if (free_map_inode == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
+  if (inode_length (free_map_inode) < (off_t) bitmap_file_size (free_map))
     PANIC ("can't read free map");
+  for (group = 0; group < group_cnt; group++)
+    {
+      off_t ofs = group * BLOCK_SECTOR_SIZE;
+      journal_read (inode_get_sector (free_map_inode, ofs), buffer);
+      bitmap_set_bytes (free_map, ofs, buffer, BLOCK_SECTOR_SIZE);
+    }
+  count_free_blocks ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
-free_map_close (void) 
+free_map_close (void)
 {
-  file_close (free_map_file);
+  free_map_flush ();
+  inode_close (free_map_inode);
+  free_map_inode = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
    it. */
 void
-free_map_create (void) 
+free_map_create (void)
 {
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
+  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), 0, ""))
     PANIC ("free map creation failed");
 
   /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  free_map_inode = inode_open (FREE_MAP_SECTOR);
+  if (free_map_inode == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
-    PANIC ("can't write free map");
+  bitmap_set_all (dirty_groups, true);
+  free_map_flush ();
+}
+
+/* Allocates CNT consecutive blocks, preferring the first free
+   run at or after sector HINT, as described under "Allocation
+   policy" above.  RESERVED of them may come out of the
+   blocks set aside by free_map_reserve(); the rest must not.
+   The caller must hold free_map_lock. */
+static bool
+allocate (size_t cnt, size_t reserved, block_sector_t hint,
+          block_sector_t *sectorp)
+{
+  size_t start = DIV_ROUND_UP (hint, fs_block_sectors);
+  size_t block = BITMAP_ERROR;
+
+  if (cnt == 0)
+    {
+      *sectorp = 0;
+      return true;
+    }
+  if (cnt - reserved > free_cnt - reserved_cnt)
+    return false;
+
+  if (start < bitmap_size (free_map))
+    block = find_free (start, bitmap_size (free_map), cnt);
+  if (block == BITMAP_ERROR)
+    block = find_best (cnt);
+  if (block == BITMAP_ERROR)
+    block = find_free (0, bitmap_size (free_map), cnt);
+  if (block == BITMAP_ERROR)
+    return false;
+
+  mark_blocks (block, cnt, true);
+  *sectorp = block * fs_block_sectors;
+  return true;
+}
+
+/* Marks CNT blocks starting at BLOCK as ALLOCATED or free,
+   keeping the group summary up to date. */
+static void
+mark_blocks (size_t block, size_t cnt, bool allocated)
+{
+  while (cnt > 0)
+    {
+      size_t group = block / GROUP_BITS;
+      size_t group_left = (group + 1) * GROUP_BITS - block;
+      size_t chunk = cnt < group_left ? cnt : group_left;
+
+      bitmap_set_multiple (free_map, block, chunk, allocated);
+      free_cnt -= groups[group].free_cnt;
+      summarize (group);
+      free_cnt += groups[group].free_cnt;
+      bitmap_mark (dirty_groups, group);
+
+      block += chunk;
+      cnt -= chunk;
+    }
+}
+
+/* Recomputes the summary of each group from the free map and
+   marks all groups clean. */
+static void
+count_free_blocks (void)
+{
+  size_t group;
+
+  free_cnt = 0;
+  for (group = 0; group < group_cnt; group++)
+    {
+      summarize (group);
+      free_cnt += groups[group].free_cnt;
+    }
+  bitmap_set_all (dirty_groups, false);
+}
+
+/* Returns the number of blocks in GROUP, which is GROUP_BITS
+   except in the last group. */
+static size_t
+group_size (size_t group)
+{
+  size_t left = bitmap_size (free_map) - group * GROUP_BITS;
+  return left < GROUP_BITS ? left : GROUP_BITS;
+}
+
+/* Copies GROUP's bits into BITS, which must have room for
+   GROUP_BITS bits.  Bit I of byte J describes block J * 8 + I of
+   the group. */
+static void
+get_group_bits (size_t group, uint8_t bits[GROUP_BITS / 8])
+{
+  memset (bits, 0, GROUP_BITS / 8);
+  bitmap_get_bytes (free_map, group * (GROUP_BITS / 8), bits,
+                    GROUP_BITS / 8);
+}
+
+/* Recomputes the summary of GROUP from its bits. */
+static void
+summarize (size_t group)
+{
+  uint8_t bits[GROUP_BITS / 8];
+  struct group *g = &groups[group];
+  size_t size = group_size (group);
+  size_t run = 0;
+  size_t i;
+
+  get_group_bits (group, bits);
+  g->free_cnt = g->longest = 0;
+  g->head = size;
+  for (i = 0; i < size; )
+    {
+      if (i % 8 == 0 && size - i >= 8 && (bits[i / 8] == 0x00
+                                          || bits[i / 8] == 0xff))
+        {
+          /* Take a whole byte at once if it is all free or all
+             in use. */
+          if (bits[i / 8] == 0x00)
+            {
+              run += 8;
+              g->free_cnt += 8;
+            }
+          else
+            {
+              if (g->head == size)
+                g->head = i;
+              run = 0;
+            }
+          i += 8;
+        }
+      else
+        {
+          if (bits[i / 8] & (1u << i % 8))
+            {
+              if (g->head == size)
+                g->head = i;
+              run = 0;
+            }
+          else
+            {
+              run++;
+              g->free_cnt++;
+            }
+          i++;
+        }
+      if (run > g->longest)
+        g->longest = run;
+    }
+  g->tail = run;
+}
+
+/* Writes the sector of the free map file that holds GROUP to the
+   journal and marks GROUP clean.  The caller must hold
+   free_map_lock. */
+static void
+write_group (size_t group)
+{
+  uint8_t buffer[BLOCK_SECTOR_SIZE];
+  off_t ofs = group * BLOCK_SECTOR_SIZE;
+
+  memset (buffer, 0, sizeof buffer);
+  bitmap_get_bytes (free_map, ofs, buffer, sizeof buffer);
+  journal_write (inode_get_sector (free_map_inode, ofs), buffer);
+  bitmap_reset (dirty_groups, group);
+}
+
+/* Returns the first block in GROUP at or after FROM that begins a
+   run of CNT free blocks lying within GROUP, or BITMAP_ERROR if
+   there is none. */
+static size_t
+scan_group (size_t group, size_t from, size_t cnt)
+{
+  uint8_t bits[GROUP_BITS / 8];
+  size_t first = group * GROUP_BITS;
+  size_t size = group_size (group);
+  size_t run = 0;
+  size_t i;
+
+  get_group_bits (group, bits);
+  for (i = from - first; i < size; i++)
+    if (i % 8 == 0 && bits[i / 8] == 0xff)
+      {
+        run = 0;
+        i += 7;
+      }
+    else if (bits[i / 8] & (1u << i % 8))
+      run = 0;
+    else if (++run == cnt)
+      return first + i + 1 - cnt;
+  return BITMAP_ERROR;
+}
+
+/* Returns the first block in [START, END) that begins a run of
+   CNT free blocks, or BITMAP_ERROR if there is none.  The run may
+   extend past END.  Uses the group summaries to look at the bits
+   of only those groups in which such a run is known to start. */
+static size_t
+find_free (size_t start, size_t end, size_t cnt)
+{
+  size_t run_start = BITMAP_ERROR;  /* Start of free run reaching GROUP. */
+  size_t group;
+
+  if (end > bitmap_size (free_map))
+    end = bitmap_size (free_map);
+  for (group = start / GROUP_BITS; group < group_cnt; group++)
+    {
+      const struct group *g = &groups[group];
+      size_t first = group * GROUP_BITS;
+      size_t size = group_size (group);
+      size_t lo = start > first ? start : first;
+
+      /* A run that starts in an earlier group and continues into
+         this one. */
+      if (run_start != BITMAP_ERROR && first - run_start + g->head >= cnt)
+        return run_start;
+      if (first >= end)
+        {
+          /* No run may start here, but one that started earlier
+             may continue through this group. */
+          if (run_start == BITMAP_ERROR || g->head != size)
+            break;
+          continue;
+        }
+
+      /* A run within this group. */
+      if (g->longest >= cnt)
+        {
+          size_t block = scan_group (group, lo, cnt);
+          if (block != BITMAP_ERROR)
+            return block < end ? block : BITMAP_ERROR;
+        }
+
+      /* The free run that reaches the end of this group, if any,
+         counting only blocks at or after START. */
+      if (g->head == size)
+        {
+          if (run_start == BITMAP_ERROR)
+            run_start = lo;
+        }
+      else if (g->tail == 0 || lo >= first + size)
+        run_start = BITMAP_ERROR;
+      else if (first + size - g->tail >= lo)
+        run_start = first + size - g->tail;
+      else
+        run_start = lo;
+      if (run_start != BITMAP_ERROR && run_start >= end)
+        break;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Returns the first block of a run of CNT free blocks within the
+   group whose longest free run is the shortest of those at least
+   CNT blocks long, or BITMAP_ERROR if no group has such a run. */
+static size_t
+find_best (size_t cnt)
+{
+  size_t best = BITMAP_ERROR;
+  size_t group;
+
+  for (group = 0; group < group_cnt; group++)
+    if (groups[group].longest >= cnt
+        && (best == BITMAP_ERROR
+            || groups[group].longest < groups[best].longest))
+      {
+        best = group;
+        if (groups[best].longest == cnt)
+          break;
+      }
+  return (best != BITMAP_ERROR
+          ? scan_group (best, best * GROUP_BITS, cnt)
+          : BITMAP_ERROR);
 }
@@ -12,6 +12,17 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (size_t, block_sector_t hint, block_sector_t *);
+bool free_map_allocate_reserved (size_t, size_t reserved,
+                                 block_sector_t hint, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+void free_map_reclaim (block_sector_t, size_t);
+size_t free_map_available (void);
+size_t free_map_sectors (void);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
+void free_map_flush (void);
+void free_map_freeze (void);
+void free_map_thaw (void);
 
 #endif /* filesys/free-map.h */
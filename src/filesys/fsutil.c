@@ -1,12 +1,16 @@
 #include "filesys/fsutil.h"
 #include <debug.h>
+#include <inttypes.h>
+#include <round.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ustar.h>
+#include "devices/timer.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/vaddr.h"
@@ -16,14 +20,20 @@ void
 fsutil_ls (char **argv UNUSED) 
 {
   struct dir *dir;
-  char name[NAME_MAX + 1];
+  struct dirent ents[16];
+  size_t cnt, i;
   
   printf ("Files in the root directory:\n");
   dir = dir_open_root ();
   if (dir == NULL)
     PANIC ("root dir open failed");
-  while (dir_readdir (dir, name))
-    printf ("%s\n", name);
+  do
+    {
+      cnt = dir_getdents (dir, ents, sizeof ents / sizeof *ents);
+      for (i = 0; i < cnt; i++)
+        printf ("%s\n", ents[i].d_name);
+    }
+  while (cnt == sizeof ents / sizeof *ents);
   dir_close (dir);
   printf ("End of listing.\n");
 }
@@ -67,8 +77,206 @@ fsutil_rm (char **argv)
     PANIC ("%s: delete failed\n", file_name);
 }
 
+/* Prints the size of file ARGV[1] and how its data is laid out
+   on disk: the number of blocks allocated to it and the number of
+   extents, or runs of consecutive blocks, that they form, and
+   whether it is stored compressed. */
+void
+fsutil_stat (char **argv)
+{
+  const char *file_name = argv[1];
+  struct file *file;
+  size_t block_cnt, extent_cnt;
+
+  file = filesys_open (file_name);
+  if (file == NULL)
+    PANIC ("%s: open failed", file_name);
+  block_cnt = inode_block_cnt (file_get_inode (file), &extent_cnt);
+  printf ("'%s': %"PROTd" bytes, %zu %zu-byte blocks in %zu extents%s\n",
+          file_name, file_length (file), block_cnt, fs_block_size,
+          extent_cnt,
+          inode_is_compressed (file_get_inode (file)) ? ", compressed" : "");
+  file_close (file);
+}
+
+/* Stores file ARGV[1] compressed and prints how many blocks that
+   saved. */
+void
+fsutil_compress (char **argv)
+{
+  const char *file_name = argv[1];
+  struct file *file;
+  struct inode *inode;
+  size_t old_cnt, new_cnt, extent_cnt;
+
+  printf ("Compressing '%s'...\n", file_name);
+  file = filesys_open (file_name);
+  if (file == NULL)
+    PANIC ("%s: open failed", file_name);
+  inode = file_get_inode (file);
+  old_cnt = inode_block_cnt (inode, &extent_cnt);
+  if (inode_compress (inode))
+    {
+      new_cnt = inode_block_cnt (inode, &extent_cnt);
+      printf ("'%s': %zu blocks, down from %zu\n",
+              file_name, new_cnt, old_cnt);
+    }
+  else
+    printf ("'%s': left uncompressed\n", file_name);
+  file_close (file);
+}
+
+/* Directory entries that the defragmenter reads at a time, and
+   levels of subdirectories that it descends into, which bounds
+   its use of the kernel stack. */
+#define DEFRAG_ENTS 16
+#define DEFRAG_MAX_DEPTH 16
+
+/* Totals gathered by the defragmenter. */
+struct defrag_stats
+  {
+    size_t file_cnt;            /* Regular files examined. */
+    size_t fragmented_cnt;      /* Files in more than one extent. */
+    size_t extent_cnt;          /* Extents in all files examined. */
+    size_t moved_cnt;           /* Files whose blocks were moved. */
+  };
+
+/* Measures the fragmentation of regular file INODE, which is
+   called LABEL, moves its blocks into a single extent with
+   inode_defrag() given HINTP, and adds to STATS. */
+static void
+defrag_file (struct inode *inode, const char *label, block_sector_t *hintp,
+             struct defrag_stats *stats)
+{
+  size_t block_cnt, extent_cnt, new_extent_cnt;
+
+  block_cnt = inode_block_cnt (inode, &extent_cnt);
+  stats->file_cnt++;
+  stats->extent_cnt += extent_cnt;
+  if (extent_cnt > 1)
+    stats->fragmented_cnt++;
+  if (inode_defrag (inode, hintp))
+    {
+      stats->moved_cnt++;
+      inode_block_cnt (inode, &new_extent_cnt);
+      printf ("%s: %zu blocks in %zu extents, now %zu\n",
+              label, block_cnt, extent_cnt, new_extent_cnt);
+    }
+}
+
+/* Defragments the regular files in DIR and in its subdirectories
+   down to DEPTH levels below it, adding to STATS.  Each file is
+   looked up by name when its turn comes, so files that are
+   created or removed meanwhile are handled correctly. */
+static void
+defrag_dir (struct dir *dir, int depth, struct defrag_stats *stats)
+{
+  struct dirent *ents = malloc (DEFRAG_ENTS * sizeof *ents);
+  size_t cnt, i;
+
+  if (ents == NULL)
+    return;
+  do
+    {
+      cnt = dir_getdents (dir, ents, DEFRAG_ENTS);
+      for (i = 0; i < cnt; i++)
+        {
+          struct inode *inode;
+
+          if (!dir_lookup (dir, ents[i].d_name, &inode))
+            continue;
+          if (!inode_is_dir (inode))
+            {
+              char label[DIRENT_NAME_MAX + 3];
+              snprintf (label, sizeof label, "'%s'", ents[i].d_name);
+              defrag_file (inode, label, NULL, stats);
+              inode_close (inode);
+            }
+          else if (depth > 0)
+            {
+              struct dir *subdir = dir_open (inode);
+              if (subdir != NULL)
+                defrag_dir (subdir, depth - 1, stats);
+              dir_close (subdir);
+            }
+          else
+            inode_close (inode);
+        }
+    }
+  while (cnt == DEFRAG_ENTS);
+  free (ents);
+}
+
+/* Walks the whole directory tree and moves the data of each
+   regular file that is in more than one extent into a single
+   run of consecutive blocks.  Files are moved one at a time, so
+   this may also be done while the file system is in use; files
+   open elsewhere are skipped. */
+void
+fsutil_defrag (char **argv UNUSED)
+{
+  struct defrag_stats stats = {0, 0, 0, 0};
+  struct dir *dir;
+
+  printf ("Defragmenting file system...\n");
+  dir = dir_open_root ();
+  if (dir == NULL)
+    PANIC ("root dir open failed");
+  defrag_dir (dir, DEFRAG_MAX_DEPTH, &stats);
+  dir_close (dir);
+  printf ("Examined %zu files in %zu extents, %zu fragmented; "
+          "moved %zu.\n", stats.file_cnt, stats.extent_cnt,
+          stats.fragmented_cnt, stats.moved_cnt);
+}
+
+/* Lays out the regular files that have been used since boot one
+   after another, in the order in which each was first opened,
+   so that a workload that reads them in that order again, such
+   as starting a program that opens the same files, finds them in
+   sequence on disk.  Run it after the workload, e.g.
+   "run PROG cluster". */
+void
+fsutil_cluster (char **argv UNUSED)
+{
+  struct defrag_stats stats = {0, 0, 0, 0};
+  block_sector_t *sectors, hint = 0;
+  size_t cnt, i;
+
+  printf ("Clustering recently used files...\n");
+  sectors = palloc_get_page (PAL_ASSERT);
+  cnt = inode_access_log (sectors, PGSIZE / sizeof *sectors);
+  for (i = 0; i < cnt; i++)
+    {
+      struct inode *inode = inode_open (sectors[i]);
+
+      if (inode != NULL && !inode_is_dir (inode)
+          && sectors[i] != FREE_MAP_SECTOR)
+        {
+          char label[32];
+          snprintf (label, sizeof label, "inode %"PRDSNu, sectors[i]);
+          defrag_file (inode, label, &hint, &stats);
+        }
+      inode_close (inode);
+    }
+  palloc_free_page (sectors);
+  printf ("Laid out %zu of %zu files in order of use.\n",
+          stats.moved_cnt, stats.file_cnt);
+}
+
+/* Number of pages, and of sectors, that fsutil_extract() reads
+   from the scratch device at a time. */
+#define EXTRACT_PAGES 8
+#define EXTRACT_SECTORS (EXTRACT_PAGES * PGSIZE / BLOCK_SECTOR_SIZE)
+
 /* Extracts a ustar-format tar archive from the scratch block
-   device into the Pintos file system. */
+   device into the Pintos file system.
+
+   Each file's data is read EXTRACT_SECTORS at a time and written
+   in chunks that, except for the last, are whole pages, so that
+   the page cache never reads in a page only to overwrite it.
+   The file's blocks are allocated in one run before it is
+   written, so that it ends up contiguous on disk if there is
+   room. */
 void
 fsutil_extract (char **argv UNUSED) 
 {
@@ -76,10 +284,13 @@ fsutil_extract (char **argv UNUSED)
 
   struct block *src;
   void *header, *data;
+  int64_t start = timer_ticks ();
+  int64_t total = 0, ms;
+  int file_cnt = 0;
 
   /* Allocate buffers. */
   header = malloc (BLOCK_SECTOR_SIZE);
-  data = malloc (BLOCK_SECTOR_SIZE);
+  data = palloc_get_multiple (0, EXTRACT_PAGES);
   if (header == NULL || data == NULL)
     PANIC ("couldn't allocate buffers");
 
@@ -124,13 +335,23 @@ fsutil_extract (char **argv UNUSED)
           if (dst == NULL)
             PANIC ("%s: open failed", file_name);
 
+          /* Allocate the file's blocks now, all at once.  Every
+             one of them is overwritten below. */
+          inode_allocate (file_get_inode (dst), 0,
+                          DIV_ROUND_UP (size, PGSIZE), 0, true);
+
           /* Do copy. */
+          file_cnt++;
+          total += size;
           while (size > 0)
             {
-              int chunk_size = (size > BLOCK_SECTOR_SIZE
-                                ? BLOCK_SECTOR_SIZE
+              int chunk_size = (size > EXTRACT_SECTORS * BLOCK_SECTOR_SIZE
+                                ? EXTRACT_SECTORS * BLOCK_SECTOR_SIZE
                                 : size);
-              block_read (src, sector++, data);
+              size_t sector_cnt = DIV_ROUND_UP (chunk_size, BLOCK_SECTOR_SIZE);
+
+              block_read_multiple (src, sector, sector_cnt, data);
+              sector += sector_cnt;
               if (file_write (dst, data, chunk_size) != chunk_size)
                 PANIC ("%s: write failed with %d bytes unwritten",
                        file_name, size);
@@ -151,7 +372,14 @@ fsutil_extract (char **argv UNUSED)
   block_write (src, 0, header);
   block_write (src, 1, header);
 
-  free (data);
+  ms = timer_elapsed (start) * 1000 / TIMER_FREQ;
+  printf ("Extracted %d files, %"PRId64" bytes, in %"PRId64" ms",
+          file_cnt, total, ms);
+  if (ms > 0)
+    printf (" (%"PRId64" kB/s)", total * 1000 / 1024 / ms);
+  printf (".\n");
+
+  palloc_free_multiple (data, EXTRACT_PAGES);
   free (header);
 }
 
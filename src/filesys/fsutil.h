@@ -4,6 +4,10 @@
 void fsutil_ls (char **argv);
 void fsutil_cat (char **argv);
 void fsutil_rm (char **argv);
+void fsutil_stat (char **argv);
+void fsutil_compress (char **argv);
+void fsutil_defrag (char **argv);
+void fsutil_cluster (char **argv);
 void fsutil_extract (char **argv);
 void fsutil_append (char **argv);
 
@@ -1,46 +1,261 @@
 #include "filesys/inode.h"
+#include <hash.h>
+#include <lz.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/directory.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of block pointers stored directly in the inode, and
+   number of block pointers that fit in one index sector. */
+#define DIRECT_CNT 118
+#define PTRS_PER_SECTOR ((off_t) (BLOCK_SECTOR_SIZE / sizeof (block_sector_t)))
+
+/* Number of data blocks reachable through each level of the
+   index, and the largest number of data blocks a file can have. */
+#define INDIRECT_CNT PTRS_PER_SECTOR
+#define DOUBLY_INDIRECT_CNT (PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+#define MAX_BLOCKS (DIRECT_CNT + INDIRECT_CNT + DOUBLY_INDIRECT_CNT)
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   Space is allocated to a file in file system blocks of
+   fs_block_size bytes.  The inode itself occupies the first
+   sector of a block of its own, and so does each index sector,
+   which is why the default block size is a single sector: with
+   4 kB blocks, each small file or directory costs 8 times the
+   space.  A block is named by the number of its first sector.
+
+   A file's data blocks are found through a multilevel index:
+   the first DIRECT_CNT through DIRECT, the next INDIRECT_CNT
+   through the sector of pointers named by INDIRECT, and the rest
+   through the sector of pointers to pointer sectors named by
+   DOUBLY_INDIRECT.  A pointer of 0 means "not allocated"; sector
+   0 always holds the superblock, so it is never data.
+
+   The index sectors for a file's whole length are allocated as
+   soon as it grows, but the data blocks of a regular file are
+   allocated only when the page cache writes the data back, by
+   inode_allocate(), so that a file built up by many small appends
+   still gets one run of consecutive blocks.  Until then they are
+   holes, which read as zeros.  The data blocks of directories and
+   the free map, which are written through the journal, are
+   allocated up front.
+
+   The data of a compressed regular file is stored differently;
+   see "Compressed files" below.
+
+   A regular file also records the directory it was created in
+   and its name there, so that inode_writev() can keep the size
+   in its directory entry up to date for dir_getdents(). */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint16_t is_dir;                    /* 1 for a directory, 0 for a file. */
+    uint16_t compressed;                /* 1 if data is compressed. */
+    block_sector_t parent;              /* Parent directory's inode sector. */
+    block_sector_t direct[DIRECT_CNT];  /* Direct data blocks. */
+    block_sector_t indirect;            /* Indirect index sector. */
+    block_sector_t doubly_indirect;     /* Doubly indirect index sector. */
+    char name[NAME_MAX + 1];            /* Regular file's name in PARENT. */
+    uint8_t unused;                     /* Not used. */
   };
 
-/* Returns the number of sectors to allocate for an inode SIZE
+/* Returns the number of blocks to allocate for an inode SIZE
    bytes long. */
 static inline size_t
-bytes_to_sectors (off_t size)
+bytes_to_blocks (off_t size)
 {
-  return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
+  return DIV_ROUND_UP (size, fs_block_size);
 }
 
-/* In-memory inode. */
+/* Compressed files.
+
+   A regular file may be converted by inode_compress() into a form
+   that takes less space, for data that is kept but seldom
+   written.  Its data is split into chunks of CHUNK_SIZE bytes,
+   each compressed separately with lz_compress(), so that any page
+   can be read by decompressing only its own chunk.  What is
+   stored through the index, in place of the data, is a table of
+   the CNT + 1 byte offsets within it at which each chunk starts,
+   the last being where the final chunk ends, padded out to a
+   block boundary, followed by the chunks themselves.  A chunk
+   that would not get any smaller is stored as is, so the offsets
+   of a chunk and of its successor differ by its length exactly if
+   it is not compressed.  LENGTH remains the length of the data.
+
+   A compressed file is read through the page cache like any
+   other, inode_read_page() decompressing the chunk that holds the
+   page.  It is never written in place: inode_writev() and mmap()
+   convert it back with inode_uncompress() first. */
+#define CHUNK_PAGES 4
+#define CHUNK_SIZE (CHUNK_PAGES * PGSIZE)
+
+/* Returns the number of chunks in a compressed file SIZE bytes
+   long. */
+static inline off_t
+bytes_to_chunks (off_t size)
+{
+  return DIV_ROUND_UP (size, CHUNK_SIZE);
+}
+
+/* Returns the number of blocks in a page of the page cache. */
+static inline int
+page_blocks (void)
+{
+  return PGSIZE / fs_block_size;
+}
+
+/* In-memory inode.
+
+   Locking: OPEN_CNT, ELEM, LRU_ELEM and EVICTING belong to
+   inode_table_lock.
+   DATA_LOCK is held for reading while the file's data is read
+   and for writing while it is written, which covers the data
+   blocks and DATA's index; DATA.LENGTH is only changed with
+   both DATA_LOCK and META_LOCK held, so it may be read with
+   either.  The same goes for DATA.COMPRESSED, which changes
+   along with the layout of the data on disk.  META_LOCK protects
+   REMOVED, DENY_WRITE_CNT, GEN and writes of the inode to disk.
+   ALLOC_LOCK serializes changes to DATA's index, which the page
+   cache makes during write-back without DATA_LOCK; readers of
+   the index do not take it.  CHUNK_LOCK protects CHUNK_BUF and
+   CHUNK_IDX.  DIR_LOCK is not used here; directory.c uses it to
+   serialize operations on a directory. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in inode table. */
+    struct list_elem lru_elem;          /* Element in closed_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
+    bool evicting;                      /* Being dropped from the table? */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    unsigned gen;                       /* Bumped by writes, layout changes
+                                           and opens; see get_gen(). */
+    struct lock meta_lock;              /* Protects metadata, see above. */
+    struct rwlock data_lock;            /* Protects file data. */
+    struct lock alloc_lock;             /* Changes to the index. */
+    struct lock dir_lock;               /* Directory operations. */
+    struct lock chunk_lock;             /* Protects the chunk buffer. */
+    uint8_t *chunk_buf;                 /* Decompressed chunk, or null. */
+    off_t chunk_idx;                    /* Chunk in CHUNK_BUF, or -1. */
     struct inode_disk data;             /* Inode content. */
   };
 
+static bool create (block_sector_t, off_t, bool is_dir,
+                    block_sector_t parent, const char *name);
+static bool extend (struct inode_disk *, block_sector_t inode_sector,
+                    off_t length, bool data, bool journaled);
+static void index_set (struct inode_disk *, off_t idx, block_sector_t,
+                       bool journaled);
+static void write_index (block_sector_t, const void *, bool journaled);
+static size_t index_credits (off_t first, off_t last);
+static void deallocate (struct inode_disk *);
+static bool reserve_blocks (struct inode *, struct cache_page *,
+                            off_t idx, int ofs, int cnt);
+static off_t iov_length (const struct iovec *, int iovcnt);
+static void iov_copy (const struct iovec **, size_t *ofsp, uint8_t *kdata,
+                      size_t cnt, bool to_iov);
+static void journal_page (struct inode *, off_t idx, const void *kpage,
+                          int ofs, int cnt);
+static size_t write_credits (struct inode *, off_t offset, off_t size);
+static unsigned get_gen (struct inode *);
+static void bump_gen (struct inode *);
+static bool build_uncompressed (struct inode *, struct inode_disk *);
+static void read_chunk_page (struct inode *, off_t idx, void *kpage);
+
+/* Returns the first sector of data block number IDX of the file
+   whose on-disk inode is DISK_INODE, or 0 if that data block has
+   not been allocated. */
+static block_sector_t
+index_lookup (const struct inode_disk *disk_inode, off_t idx)
+{
+  block_sector_t ptrs[PTRS_PER_SECTOR];
+
+  if (idx < DIRECT_CNT)
+    return disk_inode->direct[idx];
+  idx -= DIRECT_CNT;
+
+  if (idx < INDIRECT_CNT)
+    {
+      if (disk_inode->indirect == 0)
+        return 0;
+      journal_read (disk_inode->indirect, ptrs);
+      return ptrs[idx];
+    }
+  idx -= INDIRECT_CNT;
+
+  if (idx < DOUBLY_INDIRECT_CNT)
+    {
+      if (disk_inode->doubly_indirect == 0)
+        return 0;
+      journal_read (disk_inode->doubly_indirect, ptrs);
+      if (ptrs[idx / PTRS_PER_SECTOR] == 0)
+        return 0;
+      journal_read (ptrs[idx / PTRS_PER_SECTOR], ptrs);
+      return ptrs[idx % PTRS_PER_SECTOR];
+    }
+
+  return 0;
+}
+
+/* Returns the number of journal credits needed to write the
+   inode and the index sectors that point to data blocks FIRST
+   through LAST - 1, which is what extend() writes to grow a file
+   from FIRST blocks to LAST and what index_set() writes for any
+   of those blocks. */
+static size_t
+index_credits (off_t first, off_t last)
+{
+  size_t credits = 1;
+
+  if (last > MAX_BLOCKS)
+    last = MAX_BLOCKS;
+  if (first >= last)
+    return credits;
+
+  /* Indirect sector. */
+  if (first < DIRECT_CNT + INDIRECT_CNT && last > DIRECT_CNT)
+    credits++;
+
+  /* Doubly indirect sector and the sectors of pointers under it. */
+  if (last > DIRECT_CNT + INDIRECT_CNT)
+    {
+      off_t lo = first - DIRECT_CNT - INDIRECT_CNT;
+      off_t hi = last - 1 - DIRECT_CNT - INDIRECT_CNT;
+      if (lo < 0)
+        lo = 0;
+      credits += 1 + hi / PTRS_PER_SECTOR - lo / PTRS_PER_SECTOR + 1;
+    }
+  return credits;
+}
+
+/* Returns true if INODE's data is file system metadata, which is
+   written through the journal: a directory or the free map. */
+static bool
+is_metadata (const struct inode *inode)
+{
+  return inode_is_dir (inode) || inode->sector == FREE_MAP_SECTOR;
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, or 0 if the block containing it has not been
+   allocated.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 static block_sector_t
@@ -48,29 +263,118 @@ byte_to_sector (const struct inode *inode, off_t pos)
 {
   ASSERT (inode != NULL);
   if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
+    {
+      block_sector_t block = index_lookup (&inode->data,
+                                           pos / fs_block_size);
+      if (block == 0)
+        return 0;
+      return block + pos % fs_block_size / BLOCK_SECTOR_SIZE;
+    }
   else
     return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Table of in-memory inodes, hashed by sector, so that opening
+   a single inode twice returns the same `struct inode'.
+
+   Besides the open inodes, the table holds up to
+   CLOSED_INODE_CNT inodes whose last opener has closed them.
+   These are kept on closed_inodes, most recently closed first, so
+   that reopening a file that was just closed does not have to
+   read its inode sector again.  An inode's in-memory copy is
+   written through to disk whenever it changes, so a closed inode
+   can be dropped at any time, once its dirty pages are written
+   back.  That happens without inode_table_lock; meanwhile the
+   inode stays in the table marked EVICTING, and inode_open() of
+   its sector waits on inode_evicted until it is gone, since
+   write-back may still change its index. */
+#define CLOSED_INODE_CNT 64
+static struct hash inode_table;
+static struct list closed_inodes;
+static size_t closed_inode_cnt;
+static struct lock inode_table_lock;
+static struct condition inode_evicted;
+
+/* Lock contention statistics. */
+static struct lock_stats table_lock_stats;
+static struct lock_stats meta_lock_stats;
+static struct lock_stats data_lock_stats;
+static struct lock_stats dir_lock_stats;
+
+/* Access log: the sectors of the first ACCESS_LOG_CNT inodes
+   read in since boot, in the order they were first opened, so
+   that fsutil_defrag() can lay out files that are used together,
+   such as a program and the files it reads as it starts, one
+   after another.  The sector of an inode that is deleted is
+   dropped from the log before it is freed, so every sector in the
+   log holds a live inode.  Protected by inode_table_lock. */
+#define ACCESS_LOG_CNT 256
+static block_sector_t access_log[ACCESS_LOG_CNT];
+static size_t access_log_cnt;
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
+static void log_access (block_sector_t);
+static void forget_access (block_sector_t);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  hash_init (&inode_table, inode_hash, inode_less, NULL);
+  list_init (&closed_inodes);
+  closed_inode_cnt = 0;
+  access_log_cnt = 0;
+  lock_init (&inode_table_lock);
+  cond_init (&inode_evicted);
+
+  lock_stats_init (&table_lock_stats, "inode table");
+  lock_stats_init (&meta_lock_stats, "inode metadata");
+  lock_stats_init (&data_lock_stats, "inode data");
+  lock_stats_init (&dir_lock_stats, "directory");
+  lock_set_stats (&inode_table_lock, &table_lock_stats);
+}
+
+/* Initializes a file inode with LENGTH bytes of data, named NAME
+   in the directory whose inode is in sector PARENT, and writes
+   the new inode to sector SECTOR on the file system device.
+   PARENT is 0 for a file that is in no directory.
+   Returns true if successful.
+   Returns false if memory or disk allocation fails. */
+bool
+inode_create (block_sector_t sector, off_t length, block_sector_t parent,
+              const char *name)
+{
+  return create (sector, length, false, parent, name);
 }
 
-/* Initializes an inode with LENGTH bytes of data and
-   writes the new inode to sector SECTOR on the file system
-   device.
+/* Initializes a directory inode with LENGTH bytes of data whose
+   parent directory's inode is in sector PARENT, and writes the
+   new inode to sector SECTOR on the file system device.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
-inode_create (block_sector_t sector, off_t length)
+inode_create_dir (block_sector_t sector, off_t length,
+                  block_sector_t parent)
+{
+  return create (sector, length, true, parent, "");
+}
+
+/* Returns the number of journal credits, in the sense of
+   journal_begin(), that creating an inode LENGTH bytes long
+   takes. */
+size_t
+inode_credits (off_t length)
+{
+  return index_credits (0, bytes_to_blocks (length));
+}
+
+/* Initializes an inode with LENGTH bytes of data, of the given
+   kind and with the given PARENT and NAME, and writes it to
+   SECTOR. */
+static bool
+create (block_sector_t sector, off_t length, bool is_dir,
+        block_sector_t parent, const char *name)
 {
   struct inode_disk *disk_inode = NULL;
   bool success = false;
@@ -84,22 +388,19 @@ inode_create (block_sector_t sector, off_t length)
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
+      disk_inode->is_dir = is_dir;
+      disk_inode->parent = parent;
+      strlcpy (disk_inode->name, name, sizeof disk_inode->name);
+      if (extend (disk_inode, sector, length,
+                  is_dir || sector == FREE_MAP_SECTOR, true))
         {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
+          disk_inode->length = length;
+          journal_write (sector, disk_inode);
           success = true; 
-        } 
+        }
+      else
+        deallocate (disk_inode);
       free (disk_inode);
     }
   return success;
@@ -111,33 +412,70 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  lock_acquire (&inode_table_lock);
+
+  /* Check whether this inode is already in memory, either open or
+     recently closed, waiting for it to be dropped if that is
+     under way. */
+  key.sector = sector;
+  while ((e = hash_find (&inode_table, &key.elem)) != NULL
+         && hash_entry (e, struct inode, elem)->evicting)
+    cond_wait (&inode_evicted, &inode_table_lock);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      inode = hash_entry (e, struct inode, elem);
+      if (inode->open_cnt == 0)
         {
-          inode_reopen (inode);
-          return inode; 
+          list_remove (&inode->lru_elem);
+          closed_inode_cnt--;
         }
+      inode->open_cnt++;
+      lock_release (&inode_table_lock);
+
+      /* Note the open, which also waits for the opener that is
+         reading the inode in, if any. */
+      bump_gen (inode);
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&inode_table_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The inode is published in the table before it is
+     read, with its metadata lock held until the read completes, so
+     that the table lock is not held across disk I/O. */
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
+  inode->gen = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  inode->evicting = false;
+  lock_init (&inode->meta_lock);
+  lock_set_stats (&inode->meta_lock, &meta_lock_stats);
+  rwlock_init (&inode->data_lock);
+  rwlock_set_stats (&inode->data_lock, &data_lock_stats);
+  lock_init (&inode->alloc_lock);
+  lock_init (&inode->dir_lock);
+  lock_set_stats (&inode->dir_lock, &dir_lock_stats);
+  lock_init (&inode->chunk_lock);
+  inode->chunk_buf = NULL;
+  inode->chunk_idx = -1;
+  lock_acquire (&inode->meta_lock);
+  hash_insert (&inode_table, &inode->elem);
+  log_access (sector);
+  lock_release (&inode_table_lock);
+
+  journal_read (inode->sector, &inode->data);
+  lock_release (&inode->meta_lock);
   return inode;
 }
 
@@ -146,7 +484,12 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&inode_table_lock);
+      inode->open_cnt++;
+      lock_release (&inode_table_lock);
+      bump_gen (inode);
+    }
   return inode;
 }
 
@@ -157,6 +500,83 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;
 }
 
+/* Returns true if INODE is a directory. */
+bool
+inode_is_dir (const struct inode *inode)
+{
+  return inode->data.is_dir != 0;
+}
+
+/* Returns true if INODE's data is stored compressed. */
+bool
+inode_is_compressed (struct inode *inode)
+{
+  bool compressed;
+
+  lock_acquire (&inode->meta_lock);
+  compressed = inode->data.compressed != 0;
+  lock_release (&inode->meta_lock);
+  return compressed;
+}
+
+/* Returns the inode number of the directory that contains
+   directory INODE.  The root directory is its own parent. */
+block_sector_t
+inode_get_parent (const struct inode *inode)
+{
+  ASSERT (inode_is_dir (inode));
+  return inode->data.parent;
+}
+
+/* Returns the device sector that holds byte offset POS within
+   INODE, or 0 if that part of INODE has not been allocated. */
+block_sector_t
+inode_get_sector (const struct inode *inode, off_t pos)
+{
+  block_sector_t sector = byte_to_sector (inode, pos);
+  return sector != (block_sector_t) -1 ? sector : 0;
+}
+
+/* Returns the number of openers of INODE. */
+int
+inode_open_cnt (const struct inode *inode)
+{
+  int open_cnt;
+
+  lock_acquire (&inode_table_lock);
+  open_cnt = inode->open_cnt;
+  lock_release (&inode_table_lock);
+  return open_cnt;
+}
+
+/* Returns true if INODE has been removed. */
+bool
+inode_is_removed (struct inode *inode)
+{
+  bool removed;
+
+  lock_acquire (&inode->meta_lock);
+  removed = inode->removed;
+  lock_release (&inode->meta_lock);
+  return removed;
+}
+
+/* Acquires the lock that serializes operations on directory
+   INODE. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  ASSERT (inode_is_dir (inode));
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases the lock acquired by inode_lock_dir(). */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
+
 /* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
    If INODE was also a removed inode, frees its blocks. */
@@ -167,22 +587,129 @@ inode_close (struct inode *inode)
   if (inode == NULL)
     return;
 
+  lock_acquire (&inode_table_lock);
+
+  /* If this looks like the last opener, write back the file's
+     dirty pages first, without holding the table lock.  Our own
+     reference keeps the inode from going away meanwhile. */
+  if (inode->open_cnt == 1 && !inode_is_removed (inode))
+    {
+      lock_release (&inode_table_lock);
+      cache_flush_inode (inode);
+      lock_acquire (&inode_table_lock);
+    }
+
   /* Release resources if this was the last opener. */
   if (--inode->open_cnt == 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
+      /* Deallocate blocks if removed.  Nobody else can reach the
+         inode once it is out of the table. */
       if (inode->removed) 
         {
+          hash_delete (&inode_table, &inode->elem);
+          forget_access (inode->sector);
+          lock_release (&inode_table_lock);
+          cache_drop_inode (inode, false);
           free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
+          deallocate (&inode->data);
+          free (inode->chunk_buf);
+          free (inode); 
+          return;
         }
 
-      free (inode); 
+      /* Otherwise keep it in memory for a while, dropping the
+         least recently closed inode if there are too many.  The
+         victim's pages usually were written back when it was
+         closed, but another opener may have dirtied them after
+         that, so write them back without holding the table
+         lock, as described above. */
+      list_push_front (&closed_inodes, &inode->lru_elem);
+      if (++closed_inode_cnt > CLOSED_INODE_CNT)
+        {
+          struct inode *victim = list_entry (list_pop_back (&closed_inodes),
+                                             struct inode, lru_elem);
+          closed_inode_cnt--;
+          victim->evicting = true;
+          lock_release (&inode_table_lock);
+
+          cache_drop_inode (victim, true);
+
+          lock_acquire (&inode_table_lock);
+          hash_delete (&inode_table, &victim->elem);
+          cond_broadcast (&inode_evicted, &inode_table_lock);
+          lock_release (&inode_table_lock);
+          free (victim->chunk_buf);
+          free (victim);
+          return;
+        }
     }
+
+  lock_release (&inode_table_lock);
+}
+
+/* Returns a hash value for the inode that E is embedded in. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
+
+/* Returns true if inode A precedes inode B. */
+static bool
+inode_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct inode *a = hash_entry (a_, struct inode, elem);
+  const struct inode *b = hash_entry (b_, struct inode, elem);
+  return a->sector < b->sector;
+}
+
+/* Appends SECTOR to the access log, unless it is already there
+   or the log is full.  The caller must hold inode_table_lock. */
+static void
+log_access (block_sector_t sector)
+{
+  size_t i;
+
+  if (access_log_cnt >= ACCESS_LOG_CNT)
+    return;
+  for (i = 0; i < access_log_cnt; i++)
+    if (access_log[i] == sector)
+      return;
+  access_log[access_log_cnt++] = sector;
+}
+
+/* Removes SECTOR from the access log, if it is there.  The
+   caller must hold inode_table_lock. */
+static void
+forget_access (block_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < access_log_cnt; i++)
+    if (access_log[i] == sector)
+      {
+        memmove (access_log + i, access_log + i + 1,
+                 (access_log_cnt - i - 1) * sizeof *access_log);
+        access_log_cnt--;
+        return;
+      }
+}
+
+/* Stores up to CNT sectors from the access log, described above,
+   into SECTORS, in the order that their inodes were first opened.
+   Returns the number stored.  The inodes may include directories
+   and the free map as well as regular files. */
+size_t
+inode_access_log (block_sector_t *sectors, size_t cnt)
+{
+  lock_acquire (&inode_table_lock);
+  if (cnt > access_log_cnt)
+    cnt = access_log_cnt;
+  memcpy (sectors, access_log, cnt * sizeof *sectors);
+  lock_release (&inode_table_lock);
+  return cnt;
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -191,139 +718,1211 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&inode->meta_lock);
   inode->removed = true;
+  lock_release (&inode->meta_lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
 off_t
-inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
+inode_read_at (struct inode *inode, void *buffer, off_t size, off_t offset) 
 {
-  uint8_t *buffer = buffer_;
+  struct iovec iov;
+
+  iov.iov_base = buffer;
+  iov.iov_len = size;
+  return inode_readv (inode, &iov, 1, offset);
+}
+
+/* Reads from INODE into the IOVCNT buffers in IOV, filling each in
+   turn, starting at position OFFSET.  Returns the number of bytes
+   actually read, which may be less than the buffers' total length
+   if an error occurs or end of file is reached.
+
+   The buffers are filled in one pass over the file's pages, under
+   a single acquisition of its data lock, so a page that spans
+   several buffers is looked up in the cache only once and a
+   concurrent writer cannot be seen half way through. */
+off_t
+inode_readv (struct inode *inode, const struct iovec *iov, int iovcnt,
+             off_t offset) 
+{
+  off_t size = iov_length (iov, iovcnt);
+  size_t iov_ofs = 0;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
+  rwlock_acquire_read (&inode->data_lock);
   while (size > 0) 
     {
-      /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
-      int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      /* Page to read, starting byte offset within page. */
+      off_t page_idx = offset / PGSIZE;
+      int page_ofs = offset % PGSIZE;
+      struct cache_page *page;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      /* Bytes left in inode, bytes left in page, lesser of the two. */
+      off_t inode_left = inode->data.length - offset;
+      int page_left = PGSIZE - page_ofs;
+      int min_left = inode_left < page_left ? inode_left : page_left;
 
-      /* Number of bytes to actually copy out of this sector. */
+      /* Number of bytes to actually copy out of this page. */
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      page = cache_get (inode, page_idx, true);
+      if (page == NULL)
+        break;
+      iov_copy (&iov, &iov_ofs, (uint8_t *) cache_data (page) + page_ofs,
+                chunk_size, true);
+      cache_put (page, false);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+  rwlock_release_read (&inode->data_lock);
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if an error occurs.
+   A write past end of file extends the inode, filling any gap
+   between the old end of file and OFFSET with zeros.  Returns 0
+   if the file cannot be extended because the disk is full.  The
+   write also stops short if there is no room left for the data
+   blocks, which are reserved now but allocated at write-back. */
 off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
+inode_write_at (struct inode *inode, const void *buffer, off_t size,
                 off_t offset) 
 {
-  const uint8_t *buffer = buffer_;
+  struct iovec iov;
+
+  iov.iov_base = (void *) buffer;
+  iov.iov_len = size;
+  return inode_writev (inode, &iov, 1, offset);
+}
+
+/* Writes the contents of the IOVCNT buffers in IOV, one after
+   another, into INODE starting at OFFSET.  Behaves like a single
+   inode_write_at() of their concatenation: the file is extended
+   at most once, the write is one journal operation if it is
+   journaled at all, and each page is looked up in the cache
+   once however many buffers it spans.  A compressed file is
+   uncompressed first with inode_uncompress(). */
+off_t
+inode_writev (struct inode *inode, const struct iovec *iov, int iovcnt,
+              off_t offset) 
+{
+  off_t size = iov_length (iov, iovcnt);
+  size_t iov_ofs = 0;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  bool metadata = is_metadata (inode);
+  bool journaled;
+  bool extended = false;
+  bool denied;
 
-  if (inode->deny_write_cnt)
+  lock_acquire (&inode->meta_lock);
+  denied = inode->deny_write_cnt > 0;
+  lock_release (&inode->meta_lock);
+  if (denied)
     return 0;
 
+  /* Writes that change metadata go through the journal: those
+     that extend the file, and all writes to directories and the
+     free map.  If the file was compressed again after we
+     uncompressed it, start over. */
+ retry:
+  if (!inode_uncompress (inode))
+    return 0;
+  journaled = metadata || offset + size > inode_length (inode);
+  if (journaled)
+    journal_begin (write_credits (inode, offset, size));
+  rwlock_acquire_write (&inode->data_lock);
+  if (inode->data.compressed)
+    {
+      rwlock_release_write (&inode->data_lock);
+      if (journaled)
+        journal_end ();
+      goto retry;
+    }
+  if (size > 0)
+    bump_gen (inode);
+
+  /* Extend the file first if the write goes past its end.  A
+     mapping may have left junk past the old end in the cached
+     last page, which must now read as zeros. */
+  if (size > 0 && offset + size > inode->data.length)
+    {
+      off_t old_length = inode->data.length;
+
+      lock_acquire (&inode->alloc_lock);
+      extended = extend (&inode->data, inode->sector, offset + size,
+                         metadata, true);
+      lock_release (&inode->alloc_lock);
+      if (!extended)
+        {
+          rwlock_release_write (&inode->data_lock);
+          journal_end ();
+          return 0;
+        }
+      if (old_length % PGSIZE != 0)
+        cache_zero_tail (inode, old_length / PGSIZE, old_length % PGSIZE);
+      lock_acquire (&inode->meta_lock);
+      inode->data.length = offset + size;
+      journal_write (inode->sector, &inode->data);
+      lock_release (&inode->meta_lock);
+    }
+
   while (size > 0) 
     {
-      /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
-      int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      /* Page to write, starting byte offset within page. */
+      off_t page_idx = offset / PGSIZE;
+      int page_ofs = offset % PGSIZE;
+      struct cache_page *page;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      /* Bytes left in inode, bytes left in page, lesser of the two. */
+      off_t inode_left = inode->data.length - offset;
+      int page_left = PGSIZE - page_ofs;
+      int min_left = inode_left < page_left ? inode_left : page_left;
 
-      /* Number of bytes to actually write into this sector. */
+      /* Number of bytes to actually write into this page. */
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
+      /* There is no need to read in a page that is about to be
+         overwritten entirely. */
+      page = cache_get (inode, page_idx, chunk_size < PGSIZE);
+      if (page == NULL)
+        break;
+      if (!metadata
+          && !reserve_blocks (inode, page, page_idx, page_ofs, chunk_size))
         {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
+          cache_put (page, false);
+          break;
         }
+      iov_copy (&iov, &iov_ofs, (uint8_t *) cache_data (page) + page_ofs,
+                chunk_size, false);
+      if (metadata)
+        journal_page (inode, page_idx, cache_data (page),
+                      page_ofs, chunk_size);
+      cache_put (page, !metadata);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+  rwlock_release_write (&inode->data_lock);
+
+  /* Record the new length in the file's directory entry, in the
+     same operation, so that the two reach the disk together.
+     PARENT and NAME never change.  A directory's entry is not
+     updated: its parent's lock would be taken while its own is
+     held, the reverse of dir_remove()'s order. */
+  if (extended && !metadata && inode->data.parent != 0)
+    dir_set_size (inode->data.parent, inode->data.name, inode);
+  if (journaled)
+    journal_end ();
 
   return bytes_written;
 }
 
+/* Copies up to SIZE bytes from SRC, starting at SRC_OFS, into
+   DST, starting at DST_OFS.  Returns the number of bytes actually
+   copied, which is less than SIZE if end of SRC is reached or if
+   writing DST stops short as inode_write_at() may.
+
+   Each page of SRC is written to DST straight out of the page
+   cache, so the data is copied only once.  The source page is
+   kept pinned while DST is written, but SRC's data lock is not
+   held then: holding it across the write would deadlock against
+   a copy in the opposite direction.  Thus a concurrent write to
+   SRC may be seen in part, just as with a copy made by read() and
+   write() in page-sized pieces.  The caller must not pass ranges
+   of the same inode that overlap. */
+off_t
+inode_copy (struct inode *src, off_t src_ofs, struct inode *dst,
+            off_t dst_ofs, off_t size)
+{
+  off_t src_left = inode_length (src) - src_ofs;
+  off_t bytes_copied = 0;
+
+  if (size > src_left)
+    size = src_left;
+  while (size > 0)
+    {
+      /* Page to copy, starting byte offset within page. */
+      off_t page_idx = src_ofs / PGSIZE;
+      int page_ofs = src_ofs % PGSIZE;
+      struct cache_page *page;
+      off_t chunk_written;
+
+      /* Number of bytes to copy out of this page. */
+      int page_left = PGSIZE - page_ofs;
+      int chunk_size = size < page_left ? size : page_left;
+
+      rwlock_acquire_read (&src->data_lock);
+      page = cache_get (src, page_idx, true);
+      rwlock_release_read (&src->data_lock);
+      if (page == NULL)
+        break;
+      chunk_written = inode_write_at (dst,
+                                      (uint8_t *) cache_data (page) + page_ofs,
+                                      chunk_size, dst_ofs);
+      cache_put (page, false);
+
+      /* Advance. */
+      size -= chunk_written;
+      src_ofs += chunk_written;
+      dst_ofs += chunk_written;
+      bytes_copied += chunk_written;
+      if (chunk_written < chunk_size)
+        break;
+    }
+
+  return bytes_copied;
+}
+
+/* Returns the total length of the IOVCNT buffers in IOV. */
+static off_t
+iov_length (const struct iovec *iov, int iovcnt)
+{
+  off_t length = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    length += iov[i].iov_len;
+  return length;
+}
+
+/* Copies CNT bytes between KDATA and the buffers at *IOVP,
+   starting *OFSP bytes into the first one, and advances *IOVP and
+   *OFSP past the bytes copied.  Copies from KDATA into the
+   buffers if TO_IOV is true, in the other direction otherwise. */
+static void
+iov_copy (const struct iovec **iovp, size_t *ofsp, uint8_t *kdata,
+          size_t cnt, bool to_iov)
+{
+  while (cnt > 0)
+    {
+      const struct iovec *iov = *iovp;
+      uint8_t *udata = (uint8_t *) iov->iov_base + *ofsp;
+      size_t iov_left = iov->iov_len - *ofsp;
+      size_t chunk_size = cnt < iov_left ? cnt : iov_left;
+
+      if (to_iov)
+        memcpy (udata, kdata, chunk_size);
+      else
+        memcpy (kdata, udata, chunk_size);
+      kdata += chunk_size;
+      cnt -= chunk_size;
+      *ofsp += chunk_size;
+      if (*ofsp == iov->iov_len)
+        {
+          (*iovp)++;
+          *ofsp = 0;
+        }
+    }
+}
+
+/* Returns the number of journal credits for writing SIZE bytes at
+   OFFSET in INODE: the index sectors that extending the file
+   writes, the sectors of a metadata file's data that the write
+   covers, and the directory entry that records a regular file's
+   new size.  Any growth of the file meanwhile only shrinks the
+   extension. */
+static size_t
+write_credits (struct inode *inode, off_t offset, off_t size)
+{
+  off_t length = inode_length (inode);
+  off_t end = offset + size > length ? offset + size : length;
+  size_t credits;
+
+  credits = index_credits (bytes_to_blocks (length), bytes_to_blocks (end));
+  if (is_metadata (inode) && size > 0)
+    credits += ((offset + size - 1) / BLOCK_SECTOR_SIZE
+                - offset / BLOCK_SECTOR_SIZE + 1);
+  if (!is_metadata (inode) && end > length)
+    credits += DIR_SET_SIZE_CREDITS;
+  return credits;
+}
+
+/* Writes the sectors of page IDX of metadata file INODE that
+   overlap the CNT bytes starting at OFS to the journal, taking
+   their contents from KPAGE. */
+static void
+journal_page (struct inode *inode, off_t idx, const void *kpage,
+              int ofs, int cnt)
+{
+  const uint8_t *p = kpage;
+  int i;
+
+  for (i = ofs / BLOCK_SECTOR_SIZE; i * BLOCK_SECTOR_SIZE < ofs + cnt; i++)
+    {
+      off_t pos = idx * PGSIZE + i * BLOCK_SECTOR_SIZE;
+      journal_write (byte_to_sector (inode, pos), p + i * BLOCK_SECTOR_SIZE);
+    }
+}
+
+/* Reserves disk space for the blocks of PAGE, page IDX of regular
+   file INODE, that overlap the CNT bytes starting at OFS and are
+   neither allocated nor reserved yet.  Returns false if the disk
+   is full. */
+static bool
+reserve_blocks (struct inode *inode, struct cache_page *page, off_t idx,
+                int ofs, int cnt)
+{
+  unsigned reserved = cache_get_reserved (page);
+  unsigned need = 0;
+  size_t need_cnt = 0;
+  int i;
+
+  for (i = ofs / fs_block_size; i * (int) fs_block_size < ofs + cnt; i++)
+    if ((reserved & (1u << i)) == 0
+        && inode_get_sector (inode, idx * PGSIZE + i * fs_block_size) == 0)
+      {
+        need |= 1u << i;
+        need_cnt++;
+      }
+
+  if (need_cnt == 0)
+    return true;
+  if (!free_map_reserve (need_cnt))
+    return false;
+  cache_add_reserved (page, need);
+  return true;
+}
+
+/* Allocates the data blocks of regular file INODE in the CNT
+   pages starting at page FIRST that are within the file but not
+   yet allocated, for the page cache to write those pages back,
+   or for fsutil_extract() to lay out a file before overwriting
+   all of it.  RESERVED blocks were reserved for them when they
+   were written.
+   The blocks are allocated as one run placed right after the
+   data block that precedes them, if possible, or else one by one
+   as near to it as possible.  Blocks of a mapped page that were
+   never written with inode_write_at() have no reservation, so if
+   the disk is full they stay unallocated and changes to them are
+   lost.
+
+   Like inode_write_page(), does not take INODE's data lock.  The
+   index changes are made in a journal operation of their own.
+   The page cache may be writing back pages to make room while
+   its caller holds locks that an operation in progress is
+   waiting for, so unless WAIT is true this does not wait for a
+   commit: it returns false, allocating nothing, if the running
+   transaction has no room.  Otherwise returns true. */
+bool
+inode_allocate (struct inode *inode, off_t first, size_t cnt,
+                size_t reserved, bool wait)
+{
+  off_t start = first * page_blocks ();
+  off_t end = (first + cnt) * page_blocks ();
+  size_t credits = index_credits (start, end);
+  off_t idx, hole_cnt = 0, first_hole = -1;
+  block_sector_t sector, hint;
+  bool contiguous;
+
+  ASSERT (!is_metadata (inode));
+  ASSERT (!inode->data.compressed);
+
+  if (!journal_try_begin (credits))
+    {
+      if (!wait)
+        return false;
+      journal_begin (credits);
+    }
+
+  lock_acquire (&inode->alloc_lock);
+  if (end > (off_t) bytes_to_blocks (inode->data.length))
+    end = bytes_to_blocks (inode->data.length);
+  for (idx = start; idx < end; idx++)
+    if (index_lookup (&inode->data, idx) == 0)
+      {
+        if (first_hole < 0)
+          first_hole = idx;
+        hole_cnt++;
+      }
+
+  if (hole_cnt > 0)
+    {
+      size_t use = (size_t) hole_cnt < reserved ? (size_t) hole_cnt : reserved;
+
+      hint = first_hole > 0 ? index_lookup (&inode->data, first_hole - 1) : 0;
+      hint = hint != 0 ? hint + fs_block_sectors : inode->sector;
+      contiguous = free_map_allocate_reserved (hole_cnt, use, hint, &sector);
+      for (idx = first_hole; idx < end; idx++)
+        if (index_lookup (&inode->data, idx) == 0)
+          {
+            if (!contiguous)
+              {
+                size_t r = reserved > 0;
+                if (!free_map_allocate_reserved (1, r, hint, &sector))
+                  continue;
+                reserved -= r;
+              }
+            index_set (&inode->data, idx, sector, true);
+            sector += fs_block_sectors;
+            hint = sector;
+          }
+      if (contiguous)
+        reserved -= use;
+      if (first_hole < DIRECT_CNT)
+        {
+          lock_acquire (&inode->meta_lock);
+          journal_write (inode->sector, &inode->data);
+          lock_release (&inode->meta_lock);
+        }
+    }
+  lock_release (&inode->alloc_lock);
+  journal_end ();
+
+  if (reserved > 0)
+    free_map_unreserve (reserved);
+  return true;
+}
+
+/* Returns the number of data blocks allocated to INODE and stores
+   into *EXTENT_CNT the number of extents they form, that is, of
+   runs of consecutive blocks.  A file laid out contiguously has a
+   single extent. */
+size_t
+inode_block_cnt (struct inode *inode, size_t *extent_cnt)
+{
+  off_t blocks, idx;
+  block_sector_t prev = 0;
+  size_t cnt = 0;
+
+  *extent_cnt = 0;
+  lock_acquire (&inode->alloc_lock);
+  blocks = bytes_to_blocks (inode->data.length);
+  for (idx = 0; idx < blocks; idx++)
+    {
+      block_sector_t sector = index_lookup (&inode->data, idx);
+      if (sector != 0)
+        {
+          if (prev == 0 || sector != prev + fs_block_sectors)
+            (*extent_cnt)++;
+          cnt++;
+        }
+      prev = sector;
+    }
+  lock_release (&inode->alloc_lock);
+  return cnt;
+}
+
+/* Returns the first sector of the last data block allocated to
+   INODE, or 0 if it has none. */
+static block_sector_t
+last_block (struct inode *inode)
+{
+  off_t idx;
+
+  for (idx = bytes_to_blocks (inode->data.length) - 1; idx >= 0; idx--)
+    {
+      block_sector_t sector = index_lookup (&inode->data, idx);
+      if (sector != 0)
+        return sector;
+    }
+  return 0;
+}
+
+/* Blocks past sector *HINTP within which a file that
+   inode_defrag() is clustering may start and still count as in
+   place. */
+#define CLUSTER_SLACK 16
+
+/* Moves the data blocks of regular file INODE into one run of
+   consecutive blocks, so that it reads sequentially at full
+   speed.  Returns true if the blocks were moved.
+
+   If HINTP is null, or *HINTP is 0, the blocks are moved only if
+   they form more than one extent, to the first long enough free
+   run after the inode.  Otherwise INODE is being clustered with
+   files used along with it that have been laid out up to sector
+   *HINTP: its blocks are moved unless they already form one
+   extent that starts within CLUSTER_SLACK blocks after *HINTP, to
+   the first free run at or after *HINTP.  Either way, if HINTP is
+   non-null then *HINTP is advanced past INODE's last block.
+
+   Fails, leaving INODE as it was, if INODE is open more than once,
+   because another opener could have it mapped, or if no free run
+   is long enough.  The data is copied to the new blocks first,
+   holding only INODE's data lock, for reading, and outside any
+   journal operation, so that a pending commit does not wait for
+   the copy.  A short journal operation then switches the index
+   over to the copies and frees the old blocks, unless INODE's
+   length or blocks changed meanwhile, in which case the copies
+   are freed instead and this fails too.  A defragmenter that
+   calls this one file at a time thus never holds up the rest of
+   the file system for long. */
+bool
+inode_defrag (struct inode *inode, block_sector_t *hintp)
+{
+  block_sector_t first = 0, run = 0, sector;
+  block_sector_t *olds = NULL;
+  size_t cnt = 0, extent_cnt, staged, i;
+  off_t length, blocks, idx;
+  uint8_t *buf;
+  bool moved = false;
+
+  if (is_metadata (inode))
+    return false;
+  buf = malloc (PGSIZE);
+  if (buf == NULL)
+    return false;
+
+  /* Write back dirty pages first, so that the blocks hold the
+     current data, then copy them to a new run. */
+  cache_flush_inode (inode);
+  rwlock_acquire_read (&inode->data_lock);
+  length = inode->data.length;
+  blocks = bytes_to_blocks (length);
+  if (inode_open_cnt (inode) != 1)
+    goto copied;
+  cnt = inode_block_cnt (inode, &extent_cnt);
+  for (idx = 0; idx < blocks && first == 0; idx++)
+    first = index_lookup (&inode->data, idx);
+  if (cnt == 0
+      || (extent_cnt == 1
+          && (hintp == NULL || *hintp == 0
+              || (first >= *hintp
+                  && first < *hintp + CLUSTER_SLACK * fs_block_sectors))))
+    goto copied;
+  olds = malloc (cnt * sizeof *olds);
+  if (olds == NULL
+      || !free_map_allocate_near (cnt, hintp != NULL && *hintp != 0
+                                  ? *hintp : inode->sector, &run))
+    {
+      run = 0;
+      goto copied;
+    }
+
+  /* Copy the data, writing a page's worth of blocks at a time,
+     and remember where each block came from. */
+  sector = run;
+  staged = 0;
+  i = 0;
+  for (idx = 0; idx < blocks; idx++)
+    {
+      block_sector_t old = index_lookup (&inode->data, idx);
+      if (old == 0)
+        continue;
+      olds[i++] = old;
+      block_read_multiple (fs_device, old, fs_block_sectors,
+                           buf + staged * fs_block_size);
+      if (++staged == (size_t) page_blocks ())
+        {
+          block_write_multiple (fs_device, sector,
+                                staged * fs_block_sectors, buf);
+          sector += staged * fs_block_sectors;
+          staged = 0;
+        }
+    }
+  if (staged > 0)
+    block_write_multiple (fs_device, sector, staged * fs_block_sectors, buf);
+
+ copied:
+  rwlock_release_read (&inode->data_lock);
+  if (run == 0)
+    goto done;
+
+  /* Point the index at the copies and free the originals, if
+     nothing changed while we copied. */
+  journal_begin (index_credits (0, blocks));
+  rwlock_acquire_write (&inode->data_lock);
+  lock_acquire (&inode->alloc_lock);
+  moved = inode_open_cnt (inode) == 1 && inode->data.length == length;
+  for (idx = 0, i = 0; moved && idx < blocks; idx++)
+    {
+      block_sector_t old = index_lookup (&inode->data, idx);
+      if (old != 0)
+        moved = i < cnt && olds[i++] == old;
+    }
+  moved = moved && i == cnt;
+  if (moved)
+    {
+      sector = run;
+      for (i = 0, idx = 0; idx < blocks; idx++)
+        if (index_lookup (&inode->data, idx) != 0)
+          {
+            index_set (&inode->data, idx, sector, true);
+            free_map_release (olds[i++], 1);
+            sector += fs_block_sectors;
+          }
+      lock_acquire (&inode->meta_lock);
+      journal_write (inode->sector, &inode->data);
+      lock_release (&inode->meta_lock);
+    }
+  else
+    free_map_release (run, cnt);
+  lock_release (&inode->alloc_lock);
+  rwlock_release_write (&inode->data_lock);
+  journal_end ();
+
+ done:
+  if (hintp != NULL)
+    {
+      block_sector_t last;
+
+      rwlock_acquire_read (&inode->data_lock);
+      last = last_block (inode);
+      rwlock_release_read (&inode->data_lock);
+      if (last != 0)
+        *hintp = last + fs_block_sectors;
+    }
+  free (olds);
+  free (buf);
+  return moved;
+}
+
+/* Builds up the data of a file a block at a time in a new
+   on-disk inode, which nothing refers to yet, for
+   inode_compress() and inode_uncompress().  The new index and
+   data are written straight to disk, outside any journal
+   operation; only switching the file over to them is
+   journaled. */
+struct builder
+  {
+    struct inode_disk *disk;            /* New on-disk inode. */
+    block_sector_t sector;              /* Sector of the inode. */
+    block_sector_t hint;                /* Where to put the next block. */
+    uint8_t *block;                     /* Block for put_bytes() to fill. */
+    off_t pos;                          /* Bytes put by put_bytes(). */
+  };
+
+/* Adds data block IDX, which must come after every block added so
+   far, to the file that B is building, and writes DATA to it
+   unless DATA is a null pointer.  Blocks skipped over are left as
+   holes.  Returns false if the disk is full. */
+static bool
+put_block (struct builder *b, off_t idx, const void *data)
+{
+  block_sector_t sector;
+
+  if (!extend (b->disk, b->sector, (idx + 1) * fs_block_size, false, false))
+    return false;
+  b->disk->length = (idx + 1) * fs_block_size;
+  if (!free_map_allocate_near (1, b->hint, &sector))
+    return false;
+  if (data != NULL)
+    block_write_multiple (fs_device, sector, fs_block_sectors, data);
+  index_set (b->disk, idx, sector, false);
+  b->hint = sector + fs_block_sectors;
+  return true;
+}
+
+/* Appends the CNT bytes at DATA to those that B stores through
+   the index, starting at byte B->POS, writing each block out as
+   it fills up.  Returns false if the disk is full. */
+static bool
+put_bytes (struct builder *b, const void *data_, size_t cnt)
+{
+  const uint8_t *data = data_;
+
+  while (cnt > 0)
+    {
+      size_t block_ofs = b->pos % fs_block_size;
+      size_t block_left = fs_block_size - block_ofs;
+      size_t chunk_size = cnt < block_left ? cnt : block_left;
+
+      memcpy (b->block + block_ofs, data, chunk_size);
+      data += chunk_size;
+      cnt -= chunk_size;
+      b->pos += chunk_size;
+      if (b->pos % fs_block_size == 0
+          && !put_block (b, b->pos / fs_block_size - 1, b->block))
+        return false;
+    }
+  return true;
+}
+
+/* Switches INODE over to the data that NEW describes, keeping its
+   parent and name, and frees the blocks of its old data, using
+   OLD as scratch space.  The
+   caller must hold INODE's data lock for writing, and be in a
+   journal operation. */
+static void
+switch_data (struct inode *inode, const struct inode_disk *new,
+             struct inode_disk *old)
+{
+  lock_acquire (&inode->alloc_lock);
+  lock_acquire (&inode->meta_lock);
+  *old = inode->data;
+  inode->data = *new;
+  inode->data.parent = old->parent;
+  memcpy (inode->data.name, old->name, sizeof inode->data.name);
+  inode->gen++;
+  journal_write (inode->sector, &inode->data);
+  lock_release (&inode->meta_lock);
+  lock_release (&inode->alloc_lock);
+  deallocate (old);
+
+  lock_acquire (&inode->chunk_lock);
+  free (inode->chunk_buf);
+  inode->chunk_buf = NULL;
+  inode->chunk_idx = -1;
+  lock_release (&inode->chunk_lock);
+}
+
+/* Converts regular file INODE to compressed form, as described
+   under "Compressed files" above.  Returns true if INODE is
+   compressed afterward.  Fails, leaving INODE as it was, if INODE
+   is open more than once, because another opener could have it
+   mapped, if compression would not save at least one block, or if
+   memory or disk space runs out.
+
+   The compressed data is written to newly allocated blocks
+   holding only INODE's data lock, for reading, and outside any
+   journal operation, so that a pending commit does not wait for
+   it.  A short journal operation then switches the inode over to
+   the new blocks and frees the old ones, so that a crash leaves
+   either the old form or the new one.  If INODE was written or
+   opened meanwhile, the new blocks are freed instead and this
+   fails too. */
+bool
+inode_compress (struct inode *inode)
+{
+  struct builder b;
+  struct inode_disk *old = NULL;
+  uint32_t *table = NULL;
+  uint8_t *chunk = NULL, *packed = NULL, *work = NULL;
+  off_t length, chunk_cnt, table_blocks, c;
+  size_t table_size;
+  unsigned gen = 0;
+  bool built = false, success = false;
+
+  if (is_metadata (inode))
+    return false;
+
+  /* Write back dirty pages first, so that the blocks hold the
+     current data. */
+  cache_flush_inode (inode);
+  rwlock_acquire_read (&inode->data_lock);
+  b.disk = NULL;
+  b.block = NULL;
+  if (inode->data.compressed)
+    {
+      rwlock_release_read (&inode->data_lock);
+      return true;
+    }
+  if (inode_open_cnt (inode) != 1)
+    goto built;
+  gen = get_gen (inode);
+
+  length = inode->data.length;
+  chunk_cnt = bytes_to_chunks (length);
+  table_size = (chunk_cnt + 1) * sizeof *table;
+  table_blocks = DIV_ROUND_UP (table_size, fs_block_size);
+  b.disk = calloc (1, sizeof *b.disk);
+  b.block = malloc (fs_block_size);
+  old = malloc (sizeof *old);
+  table = malloc (table_size);
+  chunk = malloc (CHUNK_SIZE);
+  packed = malloc (CHUNK_SIZE);
+  work = malloc (LZ_WORK_SIZE);
+  if (b.disk == NULL || b.block == NULL || old == NULL || table == NULL
+      || chunk == NULL || packed == NULL || work == NULL)
+    goto built;
+  b.disk->magic = INODE_MAGIC;
+  b.disk->compressed = 1;
+  b.sector = inode->sector;
+  b.hint = inode->sector + fs_block_sectors;
+  b.pos = table_blocks * fs_block_size;
+
+  /* Allocate the table's blocks first, so that it comes before
+     the chunks on disk, but fill them in once it is known. */
+  for (c = 0; c < table_blocks; c++)
+    if (!put_block (&b, c, NULL))
+      goto built;
+
+  /* Compress and write out the chunks, giving up as soon as it is
+     clear that there will be no saving. */
+  for (c = 0; c < chunk_cnt; c++)
+    {
+      off_t chunk_left = length - c * CHUNK_SIZE;
+      size_t chunk_size = chunk_left < CHUNK_SIZE ? chunk_left : CHUNK_SIZE;
+      size_t packed_size;
+      size_t i;
+
+      for (i = 0; i * PGSIZE < chunk_size; i++)
+        inode_read_page (inode, c * CHUNK_PAGES + i, chunk + i * PGSIZE);
+      packed_size = lz_compress (chunk, chunk_size, packed, chunk_size - 1,
+                                 work);
+      table[c] = b.pos;
+      if (packed_size > 0
+          ? !put_bytes (&b, packed, packed_size)
+          : !put_bytes (&b, chunk, chunk_size))
+        goto built;
+      if (bytes_to_blocks (b.pos) >= bytes_to_blocks (length))
+        goto built;
+    }
+  table[chunk_cnt] = b.pos;
+  if (b.pos % fs_block_size != 0)
+    {
+      size_t block_ofs = b.pos % fs_block_size;
+      memset (b.block + block_ofs, 0, fs_block_size - block_ofs);
+      if (!put_block (&b, b.pos / fs_block_size, b.block))
+        goto built;
+    }
+
+  /* Fill in the table. */
+  for (c = 0; c < table_blocks; c++)
+    {
+      size_t ofs = c * fs_block_size;
+      size_t table_left = table_size - ofs;
+
+      memset (b.block, 0, fs_block_size);
+      memcpy (b.block, (uint8_t *) table + ofs,
+              table_left < fs_block_size ? table_left : fs_block_size);
+      block_write_multiple (fs_device, index_lookup (b.disk, c),
+                            fs_block_sectors, b.block);
+    }
+  b.disk->length = length;
+  built = true;
+
+ built:
+  rwlock_release_read (&inode->data_lock);
+
+  /* Switch over, if nothing changed while we built. */
+  if (built)
+    {
+      journal_begin (1);
+      rwlock_acquire_write (&inode->data_lock);
+      if (get_gen (inode) == gen)
+        {
+          switch_data (inode, b.disk, old);
+          success = true;
+        }
+      rwlock_release_write (&inode->data_lock);
+      if (!success)
+        deallocate (b.disk);
+      journal_end ();
+    }
+  else if (b.disk != NULL)
+    deallocate (b.disk);
+
+  free (work);
+  free (packed);
+  free (chunk);
+  free (table);
+  free (old);
+  free (b.block);
+  free (b.disk);
+  return success;
+}
+
+/* Converts compressed file INODE back to the usual form, so that
+   it can be written in place.  Returns true if INODE is not
+   compressed afterward, false if memory or disk space ran out.
+
+   Like inode_compress(), builds the new form holding only INODE's
+   data lock for reading and switches over in a short journal
+   operation.  A compressed file's data cannot change, but another
+   thread may convert it meanwhile, in which case we look again. */
+bool
+inode_uncompress (struct inode *inode)
+{
+  struct inode_disk *new, *old;
+  bool success = false;
+
+  if (!inode_is_compressed (inode))
+    return true;
+
+  new = malloc (sizeof *new);
+  old = malloc (sizeof *old);
+  if (new == NULL || old == NULL)
+    goto done;
+
+  for (;;)
+    {
+      unsigned gen;
+      bool switched = false;
+
+      rwlock_acquire_read (&inode->data_lock);
+      if (!inode->data.compressed)
+        {
+          rwlock_release_read (&inode->data_lock);
+          success = true;
+          break;
+        }
+      gen = get_gen (inode);
+      if (!build_uncompressed (inode, new))
+        {
+          rwlock_release_read (&inode->data_lock);
+          break;
+        }
+      rwlock_release_read (&inode->data_lock);
+
+      journal_begin (1);
+      rwlock_acquire_write (&inode->data_lock);
+      if (get_gen (inode) == gen)
+        {
+          switch_data (inode, new, old);
+          switched = true;
+        }
+      rwlock_release_write (&inode->data_lock);
+      if (!switched)
+        deallocate (new);
+      journal_end ();
+      if (switched)
+        {
+          success = true;
+          break;
+        }
+    }
+
+ done:
+  free (old);
+  free (new);
+  return success;
+}
+
+/* Returns true if the SIZE bytes at BUFFER are all zeros. */
+static bool
+is_zeros (const uint8_t *buffer, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    if (buffer[i] != 0)
+      return false;
+  return true;
+}
+
+/* Builds the uncompressed form of compressed file INODE in NEW,
+   as a builder does, for inode_uncompress().  The caller must
+   hold INODE's data lock.  Blocks of zeros are left as holes.
+   Returns false, leaving nothing allocated, if memory or disk
+   space runs out. */
+static bool
+build_uncompressed (struct inode *inode, struct inode_disk *new)
+{
+  struct builder b;
+  off_t length = inode->data.length;
+  off_t blocks = bytes_to_blocks (length);
+  off_t idx;
+  bool success = false;
+
+  memset (new, 0, sizeof *new);
+  b.disk = new;
+  b.block = malloc (PGSIZE);
+  if (b.block == NULL)
+    return false;
+  b.disk->magic = INODE_MAGIC;
+  b.sector = inode->sector;
+  b.hint = inode->sector + fs_block_sectors;
+
+  for (idx = 0; idx < blocks; idx++)
+    {
+      uint8_t *data = b.block + idx % page_blocks () * fs_block_size;
+
+      if (idx % page_blocks () == 0)
+        read_chunk_page (inode, idx / page_blocks (), b.block);
+      if (!is_zeros (data, fs_block_size) && !put_block (&b, idx, data))
+        goto done;
+    }
+
+  /* Trailing holes need their index sectors too. */
+  if (!extend (b.disk, b.sector, length, false, false))
+    goto done;
+  b.disk->length = length;
+  success = true;
+
+ done:
+  if (!success)
+    deallocate (b.disk);
+  free (b.block);
+  return success;
+}
+
+/* Reads the blocks of compressed file INODE's stored data that
+   hold the CNT bytes at offset POS, which must be at least 1,
+   into BUF, which must have room for CNT bytes plus two blocks.
+   Returns a pointer to those bytes within BUF. */
+static uint8_t *
+read_stored (struct inode *inode, off_t pos, size_t cnt, uint8_t *buf)
+{
+  off_t first = pos / fs_block_size;
+  off_t last = (pos + cnt - 1) / fs_block_size;
+  off_t idx;
+
+  for (idx = first; idx <= last; idx++)
+    {
+      block_sector_t sector = index_lookup (&inode->data, idx);
+      uint8_t *p = buf + (idx - first) * fs_block_size;
+
+      if (sector != 0)
+        block_read_multiple (fs_device, sector, fs_block_sectors, p);
+      else
+        memset (p, 0, fs_block_size);
+    }
+  return buf + pos % fs_block_size;
+}
+
+/* Makes INODE's chunk buffer hold chunk C of compressed file
+   INODE, reading and decompressing it unless it is already there.
+   A chunk that is corrupt reads as zeros.  The caller must hold
+   INODE's chunk lock. */
+static void
+load_chunk (struct inode *inode, off_t c)
+{
+  off_t chunk_left = inode->data.length - c * CHUNK_SIZE;
+  size_t chunk_size = chunk_left < CHUNK_SIZE ? chunk_left : CHUNK_SIZE;
+  uint32_t table[2];
+  size_t stored_size;
+  uint8_t *buf;
+  bool ok = false;
+
+  if (inode->chunk_idx == c)
+    return;
+  if (inode->chunk_buf == NULL)
+    inode->chunk_buf = malloc (CHUNK_SIZE);
+  buf = malloc (CHUNK_SIZE + 2 * fs_block_size);
+  if (inode->chunk_buf == NULL || buf == NULL)
+    PANIC ("out of memory reading compressed file");
+
+  memcpy (table, read_stored (inode, c * sizeof *table, sizeof table, buf),
+          sizeof table);
+  stored_size = table[1] - table[0];
+  if (table[1] > table[0] && stored_size <= chunk_size)
+    {
+      uint8_t *stored = read_stored (inode, table[0], stored_size, buf);
+      if (stored_size == chunk_size)
+        {
+          memcpy (inode->chunk_buf, stored, chunk_size);
+          ok = true;
+        }
+      else
+        ok = lz_decompress (stored, stored_size, inode->chunk_buf,
+                            chunk_size);
+    }
+  if (!ok)
+    {
+      printf ("inode %"PRDSNu": chunk %"PROTd" is corrupt\n",
+              inode->sector, c);
+      memset (inode->chunk_buf, 0, chunk_size);
+    }
+  inode->chunk_idx = c;
+  free (buf);
+}
+
+/* Reads page IDX of compressed file INODE into KPAGE. */
+static void
+read_chunk_page (struct inode *inode, off_t idx, void *kpage)
+{
+  off_t pos = idx * PGSIZE;
+  off_t length = inode->data.length;
+  size_t cnt;
+
+  if (pos >= length)
+    {
+      memset (kpage, 0, PGSIZE);
+      return;
+    }
+  cnt = length - pos < PGSIZE ? length - pos : PGSIZE;
+
+  lock_acquire (&inode->chunk_lock);
+  load_chunk (inode, pos / CHUNK_SIZE);
+  memcpy (kpage, inode->chunk_buf + pos % CHUNK_SIZE, cnt);
+  lock_release (&inode->chunk_lock);
+  memset ((uint8_t *) kpage + cnt, 0, PGSIZE - cnt);
+}
+
+/* Reads page IDX of INODE into KPAGE, for the page cache.  Parts
+   of the page past end of file, or in blocks that are not
+   allocated, read as zeros.  Each block of a regular file is read
+   in a single transfer, or, if the file is compressed, the page
+   is decompressed from its chunk.  Does not take INODE's data lock, because
+   the page cache calls this for files that are mapped as well as
+   ones being read: the index entries for the data within the
+   file's length never change once set, and a page whose blocks
+   are being allocated is already in the cache. */
+void
+inode_read_page (struct inode *inode, off_t idx, void *kpage)
+{
+  uint8_t *p = kpage;
+  off_t length = inode->data.length;
+  off_t pos = idx * PGSIZE;
+  int i;
+
+  if (inode->data.compressed)
+    {
+      read_chunk_page (inode, idx, kpage);
+      return;
+    }
+
+  for (i = 0; i < page_blocks (); i++, pos += fs_block_size)
+    {
+      uint8_t *block_buf = p + i * fs_block_size;
+      block_sector_t sector = pos < length ? byte_to_sector (inode, pos) : 0;
+
+      if (sector == 0)
+        memset (block_buf, 0, fs_block_size);
+      else
+        {
+          if (is_metadata (inode))
+            {
+              size_t j;
+              for (j = 0; j < fs_block_sectors; j++)
+                journal_read (sector + j, block_buf + j * BLOCK_SECTOR_SIZE);
+            }
+          else
+            block_read_multiple (fs_device, sector, fs_block_sectors,
+                                 block_buf);
+          if (length - pos < (off_t) fs_block_size)
+            memset (block_buf + (length - pos), 0,
+                    fs_block_size - (length - pos));
+        }
+    }
+}
+
+/* Writes KPAGE, the contents of page IDX of INODE, back to disk
+   for the page cache, one transfer per block.  Blocks wholly past
+   end of file are not written, and neither are holes, so the page
+   cache must call inode_allocate() first.  Never called for
+   metadata files, whose pages are written through the journal by
+   inode_write_at() instead.  Does not take INODE's data lock, for
+   the reason given above and because the page cache may write
+   back one file's page while the caller holds another file's data
+   lock. */
+void
+inode_write_page (struct inode *inode, off_t idx, const void *kpage)
+{
+  const uint8_t *p = kpage;
+  off_t length = inode->data.length;
+  off_t pos = idx * PGSIZE;
+  int i;
+
+  ASSERT (!is_metadata (inode));
+  ASSERT (!inode->data.compressed);
+
+  for (i = 0; i < page_blocks () && pos < length;
+       i++, pos += fs_block_size)
+    {
+      block_sector_t sector = byte_to_sector (inode, pos);
+      if (sector != 0)
+        block_write_multiple (fs_device, sector, fs_block_sectors,
+                              p + i * fs_block_size);
+    }
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode) 
 {
+  lock_acquire (&inode->meta_lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&inode->meta_lock);
 }
 
 /* Re-enables writes to INODE.
@@ -332,14 +1931,271 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  lock_acquire (&inode->meta_lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&inode->meta_lock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
 off_t
-inode_length (const struct inode *inode)
+inode_length (struct inode *inode)
+{
+  off_t length;
+
+  lock_acquire (&inode->meta_lock);
+  length = inode->data.length;
+  lock_release (&inode->meta_lock);
+  return length;
+}
+
+/* Returns INODE's generation number, which changes whenever
+   INODE's data may have changed: on every write, every change of
+   its layout on disk, and every open, since a new opener could
+   change it through a mapping.  Lets inode_compress() and
+   inode_uncompress() tell whether INODE changed while they built
+   its new form without holding its data lock for writing. */
+static unsigned
+get_gen (struct inode *inode)
+{
+  unsigned gen;
+
+  lock_acquire (&inode->meta_lock);
+  gen = inode->gen;
+  lock_release (&inode->meta_lock);
+  return gen;
+}
+
+/* Changes INODE's generation number.  See get_gen(). */
+static void
+bump_gen (struct inode *inode)
+{
+  lock_acquire (&inode->meta_lock);
+  inode->gen++;
+  lock_release (&inode->meta_lock);
+}
+
+/* Makes sure that every index sector of DISK_INODE needed to
+   hold LENGTH bytes is allocated and, if DATA is true, every data
+   block as well; otherwise new data blocks are left as holes for
+   inode_allocate().  Newly allocated sectors and blocks are
+   zeroed.  Each new data block is placed right after its
+   predecessor if possible, or after INODE_SECTOR for the first
+   one, so that a file that grows sequentially stays contiguous.
+   Does not change DISK_INODE's length, which is up to the caller.
+   Index sectors are written as write_index() does, given
+   JOURNALED.
+   Returns true if successful, false if the disk is full.  On
+   failure, blocks already allocated stay in the index and are
+   released by deallocate(). */
+static bool
+extend (struct inode_disk *disk_inode, block_sector_t inode_sector,
+        off_t length, bool data, bool journaled)
+{
+  static char zeros[FS_BLOCK_MAX];
+  block_sector_t *ptrs = NULL;          /* Innermost index sector. */
+  block_sector_t *ptrs2 = NULL;         /* Doubly indirect sector. */
+  block_sector_t ptrs_sector = 0;       /* Where PTRS lives on disk. */
+  bool ptrs_dirty = false;              /* PTRS needs to be written? */
+  off_t start = bytes_to_blocks (disk_inode->length);
+  off_t blocks = bytes_to_blocks (length);
+  block_sector_t prev;
+  bool success = false;
+  off_t idx;
+
+  if (blocks > MAX_BLOCKS)
+    return false;
+  if (start >= blocks)
+    return true;
+
+  ptrs = malloc (BLOCK_SECTOR_SIZE);
+  ptrs2 = malloc (BLOCK_SECTOR_SIZE);
+  if (ptrs == NULL || ptrs2 == NULL)
+    goto done;
+
+  prev = start > 0 ? index_lookup (disk_inode, start - 1) : 0;
+  if (prev == 0)
+    prev = inode_sector;
+  for (idx = start; idx < blocks; idx++)
+    {
+      block_sector_t *slot;
+
+      /* Find the slot that points to data block IDX, reading
+         and, if necessary, allocating the index sectors on the
+         way to it. */
+      if (idx < DIRECT_CNT)
+        slot = &disk_inode->direct[idx];
+      else if (idx < DIRECT_CNT + INDIRECT_CNT)
+        {
+          off_t i = idx - DIRECT_CNT;
+          if (i == 0 || idx == start)
+            {
+              if (disk_inode->indirect == 0)
+                {
+                  if (!free_map_allocate_near (1, prev,
+                                               &disk_inode->indirect))
+                    goto done;
+                  write_index (disk_inode->indirect, zeros, journaled);
+                }
+              ptrs_sector = disk_inode->indirect;
+              journal_read (ptrs_sector, ptrs);
+            }
+          slot = &ptrs[i];
+        }
+      else
+        {
+          off_t i = idx - DIRECT_CNT - INDIRECT_CNT;
+          if (i == 0 || idx == start)
+            {
+              if (ptrs_dirty)
+                {
+                  write_index (ptrs_sector, ptrs, journaled);
+                  ptrs_dirty = false;
+                }
+              if (disk_inode->doubly_indirect == 0)
+                {
+                  if (!free_map_allocate_near (
+                         1, prev, &disk_inode->doubly_indirect))
+                    goto done;
+                  write_index (disk_inode->doubly_indirect, zeros, journaled);
+                }
+              journal_read (disk_inode->doubly_indirect, ptrs2);
+            }
+          if (i % PTRS_PER_SECTOR == 0 || idx == start)
+            {
+              block_sector_t *outer = &ptrs2[i / PTRS_PER_SECTOR];
+              if (ptrs_dirty)
+                {
+                  write_index (ptrs_sector, ptrs, journaled);
+                  ptrs_dirty = false;
+                }
+              if (*outer == 0)
+                {
+                  if (!free_map_allocate_near (1, prev, outer))
+                    goto done;
+                  write_index (*outer, zeros, journaled);
+                  write_index (disk_inode->doubly_indirect, ptrs2, journaled);
+                }
+              ptrs_sector = *outer;
+              journal_read (ptrs_sector, ptrs);
+            }
+          slot = &ptrs[i % PTRS_PER_SECTOR];
+        }
+
+      /* Allocate the data block itself. */
+      if (*slot == 0 && data)
+        {
+          if (!free_map_allocate_near (1, prev + fs_block_sectors, slot))
+            goto done;
+          block_write_multiple (fs_device, *slot, fs_block_sectors, zeros);
+          if (idx >= DIRECT_CNT)
+            ptrs_dirty = true;
+        }
+      if (*slot != 0)
+        prev = *slot;
+    }
+  success = true;
+
+ done:
+  if (ptrs_dirty)
+    write_index (ptrs_sector, ptrs, journaled);
+  free (ptrs2);
+  free (ptrs);
+  return success;
+}
+
+/* Sets the pointer to data block IDX of DISK_INODE to SECTOR.
+   The index sectors on the way to it must already exist.  The
+   caller must write DISK_INODE itself if IDX < DIRECT_CNT.  The
+   pointer sector is written as write_index() does, given
+   JOURNALED. */
+static void
+index_set (struct inode_disk *disk_inode, off_t idx, block_sector_t sector,
+           bool journaled)
 {
-  return inode->data.length;
+  block_sector_t ptrs[PTRS_PER_SECTOR];
+  block_sector_t ptrs_sector;
+
+  if (idx < DIRECT_CNT)
+    {
+      disk_inode->direct[idx] = sector;
+      return;
+    }
+  idx -= DIRECT_CNT;
+
+  if (idx < INDIRECT_CNT)
+    ptrs_sector = disk_inode->indirect;
+  else
+    {
+      idx -= INDIRECT_CNT;
+      ASSERT (disk_inode->doubly_indirect != 0);
+      journal_read (disk_inode->doubly_indirect, ptrs);
+      ptrs_sector = ptrs[idx / PTRS_PER_SECTOR];
+      idx %= PTRS_PER_SECTOR;
+    }
+  ASSERT (ptrs_sector != 0);
+
+  journal_read (ptrs_sector, ptrs);
+  ptrs[idx] = sector;
+  write_index (ptrs_sector, ptrs, journaled);
+}
+
+/* Writes BUFFER to index sector SECTOR: through the journal if
+   JOURNALED, or else straight to disk, which is only for the
+   index of a file that inode_compress() or inode_uncompress() is
+   building, since nothing on disk refers to it yet.  A newly
+   allocated sector has no pending journal writes, so either way
+   journal_read() finds the new contents. */
+static void
+write_index (block_sector_t sector, const void *buffer, bool journaled)
+{
+  if (journaled)
+    journal_write (sector, buffer);
+  else
+    block_write (fs_device, sector, buffer);
+}
+
+/* Releases every data and index block allocated to DISK_INODE,
+   regardless of its length. */
+static void
+deallocate (struct inode_disk *disk_inode)
+{
+  block_sector_t *ptrs = malloc (BLOCK_SECTOR_SIZE);
+  block_sector_t *ptrs2 = malloc (BLOCK_SECTOR_SIZE);
+  off_t i, j;
+
+  if (ptrs == NULL || ptrs2 == NULL)
+    PANIC ("out of memory freeing inode");
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    if (disk_inode->direct[i] != 0)
+      free_map_release (disk_inode->direct[i], 1);
+
+  if (disk_inode->indirect != 0)
+    {
+      journal_read (disk_inode->indirect, ptrs);
+      for (i = 0; i < PTRS_PER_SECTOR; i++)
+        if (ptrs[i] != 0)
+          free_map_release (ptrs[i], 1);
+      free_map_release (disk_inode->indirect, 1);
+    }
+
+  if (disk_inode->doubly_indirect != 0)
+    {
+      journal_read (disk_inode->doubly_indirect, ptrs2);
+      for (i = 0; i < PTRS_PER_SECTOR; i++)
+        if (ptrs2[i] != 0)
+          {
+            journal_read (ptrs2[i], ptrs);
+            for (j = 0; j < PTRS_PER_SECTOR; j++)
+              if (ptrs[j] != 0)
+                free_map_release (ptrs[j], 1);
+            free_map_release (ptrs2[i], 1);
+          }
+      free_map_release (disk_inode->doubly_indirect, 1);
+    }
+
+  free (ptrs2);
+  free (ptrs);
 }
@@ -2,22 +2,50 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <uio.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
 struct bitmap;
 
 void inode_init (void);
-bool inode_create (block_sector_t, off_t);
+bool inode_create (block_sector_t, off_t, block_sector_t parent,
+                   const char *name);
+bool inode_create_dir (block_sector_t, off_t, block_sector_t parent);
+size_t inode_credits (off_t length);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
+bool inode_is_dir (const struct inode *);
+bool inode_is_compressed (struct inode *);
+block_sector_t inode_get_parent (const struct inode *);
+block_sector_t inode_get_sector (const struct inode *, off_t pos);
+int inode_open_cnt (const struct inode *);
+bool inode_is_removed (struct inode *);
+void inode_lock_dir (struct inode *);
+void inode_unlock_dir (struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_readv (struct inode *, const struct iovec *, int iovcnt,
+                   off_t offset);
+off_t inode_writev (struct inode *, const struct iovec *, int iovcnt,
+                    off_t offset);
+off_t inode_copy (struct inode *src, off_t src_ofs, struct inode *dst,
+                  off_t dst_ofs, off_t size);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
-off_t inode_length (const struct inode *);
+off_t inode_length (struct inode *);
+void inode_read_page (struct inode *, off_t idx, void *kpage);
+void inode_write_page (struct inode *, off_t idx, const void *kpage);
+bool inode_allocate (struct inode *, off_t first, size_t cnt,
+                     size_t reserved, bool wait);
+size_t inode_block_cnt (struct inode *, size_t *extent_cnt);
+bool inode_compress (struct inode *);
+bool inode_uncompress (struct inode *);
+bool inode_defrag (struct inode *, block_sector_t *hintp);
+size_t inode_access_log (block_sector_t *, size_t cnt);
 
 #endif /* filesys/inode.h */
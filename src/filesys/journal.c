@@ -0,0 +1,808 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata journal.
+
+   Writes of file system metadata (inodes, index sectors, and the
+   data of directories and of the free map file) do not go to
+   their home locations on disk directly.  Instead, each is
+   recorded in memory in the "running" transaction, where a later
+   write of the same sector replaces the earlier one.  Every
+   COMMIT_INTERVAL, or sooner if the running transaction fills
+   up, the journal thread commits it: it writes all of the
+   transaction's sectors to the journal region in one sequential
+   pass, followed by a commit record, and only then "checkpoints"
+   them by writing each to its home location.  If the system
+   stops partway, journal_init() finds the committed transaction
+   in the journal at the next boot and writes it home again, so
+   either all of a transaction reaches the disk or none of it
+   does.
+
+   A file system operation that changes several sectors brackets
+   its changes with journal_begin() and journal_end(), which
+   guarantees that they all land in one transaction: a commit
+   waits for operations in progress to finish and holds off new
+   ones until it has taken the transaction.  Operations started by
+   different threads in the meantime share the transaction, so one
+   sequential write commits all of them.
+
+   A transaction must fit in the journal, so each operation says
+   up front how many sectors it may add to the transaction, its
+   "credits", and journal_begin() commits the running transaction
+   first if the sectors already in it, those promised to
+   operations in progress, and the new ones together might not
+   fit.  Each sector that the operation adds to the transaction
+   uses up one of its credits, and those left over are given back
+   when it ends.  Room is also kept for the free map, which every
+   commit writes, and for write-back, which allocates blocks
+   while the caller may hold locks and so cannot wait for a
+   commit: it uses journal_try_begin(), which fails instead of
+   waiting, and asks the journal thread to commit soon.
+
+   The journal region holds a single transaction, starting at its
+   first sector.  A transaction is a descriptor sector listing the
+   home sectors of up to DESC_CNT data sectors, those data sectors,
+   more descriptors and data if needed, and a commit record with a
+   checksum of the data.  Commits are serialized and each is
+   checkpointed before the next is written, so by the time the
+   region is overwritten, everything in it is home.
+
+   Blocks that an operation frees stay allocated until the
+   transaction that freed them has been checkpointed, because
+   until then the file system on disk may still refer to them:
+   reused for file data, which is not journaled, they would
+   corrupt the file that had them if the system stopped before
+   the commit.  journal_release() records them in the running
+   transaction, and the commit gives them back to the free map
+   once they are no longer referenced on disk.  journal_revoke()
+   drops pending writes of a freed sector, so that replaying the
+   transaction that freed it, which stays in the journal after it
+   is checkpointed, cannot overwrite whatever it is reused for. */
+
+/* How often the journal thread commits, in timer ticks. */
+#define COMMIT_INTERVAL (5 * TIMER_FREQ)
+
+/* How often the journal thread checks whether a commit has been
+   asked for, in timer ticks. */
+#define POLL_INTERVAL (TIMER_FREQ / 10)
+
+/* Sectors of each transaction kept for operations that cannot
+   wait for a commit, beyond those set aside for the free map. */
+#define NOWAIT_SECTORS 16
+
+/* Journal record magic numbers. */
+#define DESC_MAGIC 0x4a444553           /* "JDES". */
+#define COMMIT_MAGIC 0x4a434d54         /* "JCMT". */
+
+/* Home sectors listed in a descriptor. */
+#define DESC_CNT ((BLOCK_SECTOR_SIZE - 3 * sizeof (uint32_t)) \
+                  / sizeof (block_sector_t))
+
+/* Most data sectors that fit in the journal along with their
+   descriptors and the commit record. */
+#define LOG_CAPACITY ((JOURNAL_SECTORS - 1) * DESC_CNT / (DESC_CNT + 1))
+
+/* Descriptor sector, followed in the journal by CNT data
+   sectors whose home locations are SECTORS.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_desc
+  {
+    uint32_t magic;                     /* DESC_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Number of SECTORS in use. */
+    block_sector_t sectors[DESC_CNT];   /* Home sectors. */
+  };
+
+/* Commit record, which ends a transaction.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_commit
+  {
+    uint32_t magic;                     /* COMMIT_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Data sectors in transaction. */
+    uint32_t checksum;                  /* Checksum of data sectors. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 4 * sizeof (uint32_t)];
+  };
+
+/* A sector's contents in a transaction. */
+struct jbuf
+  {
+    struct hash_elem elem;              /* Element in transaction's bufs. */
+    block_sector_t sector;              /* Home sector. */
+    bool revoked;                       /* Freed, so don't checkpoint. */
+    uint8_t data[BLOCK_SECTOR_SIZE];    /* Contents. */
+  };
+
+/* A run of blocks released in a transaction. */
+struct release
+  {
+    block_sector_t sector;              /* First sector of first block. */
+    size_t cnt;                         /* Number of blocks. */
+  };
+
+/* Releases in a transaction, in chunks of RELEASE_CNT. */
+#define RELEASE_CNT 64
+struct release_chunk
+  {
+    struct list_elem elem;              /* Element in transaction's releases. */
+    size_t cnt;                         /* Number of RELEASES in use. */
+    struct release releases[RELEASE_CNT];
+  };
+
+/* A transaction. */
+struct transaction
+  {
+    struct hash bufs;                   /* Sectors written, by home sector. */
+    size_t cnt;                         /* Number of BUFS. */
+    size_t credits;                     /* Credits of operations in progress. */
+    struct list releases;               /* List of struct release_chunk. */
+    size_t release_cnt;                 /* Blocks released. */
+  };
+
+/* The running transaction takes new writes.  The committing
+   transaction, if any, is being written to the journal and then
+   home; its sectors are still read from memory until it is done. */
+static struct transaction transactions[2];
+static struct transaction *running;
+static struct transaction *committing;
+
+/* Synchronization.  JOURNAL_LOCK protects the transactions and
+   the handle state below.  COMMIT_LOCK serializes commits.
+   CHECKPOINT_LOCK is held while a committing sector is written
+   home, and with JOURNAL_LOCK while a committing sector is marked
+   revoked, so that a sector cannot be overwritten by an old copy
+   after it has been freed. */
+static struct lock journal_lock;
+static struct lock commit_lock;
+static struct lock checkpoint_lock;
+static struct lock_stats journal_lock_stats;
+static int active_cnt;                  /* Operations in progress. */
+static bool frozen;                     /* New operations must wait? */
+static struct condition handles_done;   /* ACTIVE_CNT dropped to 0. */
+static struct condition thawed;         /* FROZEN became false. */
+static uint32_t next_seq;               /* Next transaction's number. */
+static bool commit_wanted;              /* Journal thread should commit? */
+
+/* Limits on CNT + CREDITS of the running transaction: WAIT_LIMIT
+   for journal_begin(), which can commit to make room, and
+   NOWAIT_LIMIT for operations that cannot. */
+static size_t wait_limit;
+static size_t nowait_limit;
+
+/* Statistics. */
+static long long commit_cnt;            /* Transactions committed. */
+static long long handle_cnt;            /* Operations started. */
+static long long write_cnt;             /* Calls to journal_write(). */
+static long long logged_cnt;            /* Sectors written to journal. */
+
+static thread_func journal_thread NO_RETURN;
+static hash_hash_func jbuf_hash;
+static hash_less_func jbuf_less;
+static hash_action_func jbuf_free;
+static struct jbuf *find (struct transaction *, block_sector_t);
+static bool fits (size_t credits, size_t limit);
+static void write_log (struct jbuf **, size_t cnt);
+static void checkpoint (struct jbuf **, size_t cnt);
+static void reclaim (struct transaction *);
+static void replay (void);
+static uint32_t checksum_add (uint32_t, block_sector_t, const void *);
+
+/* Initializes the journal.  If FORMAT is true, empties it;
+   otherwise replays the transaction in it, if it holds a complete
+   one.  Must be called before anything reads metadata from disk. */
+void
+journal_init (bool format)
+{
+  ASSERT (sizeof (struct journal_desc) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct journal_commit) == BLOCK_SECTOR_SIZE);
+  ASSERT (DIV_ROUND_UP (LOG_CAPACITY, DESC_CNT) + LOG_CAPACITY + 1
+          <= JOURNAL_SECTORS);
+
+  /* Keep room in every transaction for the whole free map. */
+  if (free_map_sectors () + NOWAIT_SECTORS + JOURNAL_MAX_CREDITS
+      > LOG_CAPACITY)
+    PANIC ("free map too large for journal--use larger blocks");
+  nowait_limit = LOG_CAPACITY - free_map_sectors ();
+  wait_limit = nowait_limit - NOWAIT_SECTORS;
+
+  hash_init (&transactions[0].bufs, jbuf_hash, jbuf_less, NULL);
+  hash_init (&transactions[1].bufs, jbuf_hash, jbuf_less, NULL);
+  transactions[0].cnt = transactions[1].cnt = 0;
+  transactions[0].credits = transactions[1].credits = 0;
+  list_init (&transactions[0].releases);
+  list_init (&transactions[1].releases);
+  transactions[0].release_cnt = transactions[1].release_cnt = 0;
+  running = &transactions[0];
+  committing = NULL;
+
+  lock_init (&journal_lock);
+  lock_init (&commit_lock);
+  lock_init (&checkpoint_lock);
+  lock_stats_init (&journal_lock_stats, "journal");
+  lock_set_stats (&journal_lock, &journal_lock_stats);
+  cond_init (&handles_done);
+  cond_init (&thawed);
+  active_cnt = 0;
+  frozen = false;
+  commit_wanted = false;
+
+  if (format)
+    {
+      static const char zeros[BLOCK_SECTOR_SIZE];
+      block_write (fs_device, JOURNAL_SECTOR, zeros);
+      next_seq = 1;
+    }
+  else
+    replay ();
+
+  thread_create ("journal", PRI_DEFAULT, journal_thread, NULL);
+}
+
+/* Starts a file system operation, so that all of the metadata
+   it writes goes into a single transaction.  The operation may
+   write at most CREDITS sectors that are not already in the
+   transaction, where CREDITS is at most JOURNAL_MAX_CREDITS.
+   Operations may nest; only the outermost counts, and its credits
+   must cover those nested in it.  Must not be called while
+   holding file system locks, because it may wait for a commit. */
+void
+journal_begin (size_t credits)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (credits <= JOURNAL_MAX_CREDITS);
+
+  if (t->journal_depth > 0)
+    {
+      t->journal_depth++;
+      return;
+    }
+
+  /* Commit first if the running transaction holds back more
+     released blocks than are free, so that the operation does not
+     run out of space for want of a commit. */
+  if (running->release_cnt > free_map_available ())
+    journal_commit ();
+
+  /* Wait for a commit in progress, or commit ourselves if the
+     running transaction might not have room for CREDITS.  A
+     transaction with nothing in it always has room. */
+  lock_acquire (&journal_lock);
+  for (;;)
+    if (frozen)
+      cond_wait (&thawed, &journal_lock);
+    else if (!fits (credits, wait_limit))
+      {
+        lock_release (&journal_lock);
+        journal_commit ();
+        lock_acquire (&journal_lock);
+      }
+    else
+      break;
+  running->credits += credits;
+  active_cnt++;
+  handle_cnt++;
+  lock_release (&journal_lock);
+  t->journal_depth = 1;
+  t->journal_credits = credits;
+}
+
+/* Like journal_begin(), but never waits: returns false without
+   starting an operation if a commit is in progress or the running
+   transaction does not have room for CREDITS, and asks the
+   journal thread to commit soon.  For writers that may hold locks
+   that an operation in progress is waiting for.  Within another
+   operation, adds CREDITS to it if there is room, since the outer
+   operation could not have counted them. */
+bool
+journal_try_begin (size_t credits)
+{
+  struct thread *t = thread_current ();
+  bool success;
+
+  ASSERT (credits <= JOURNAL_MAX_CREDITS);
+
+  lock_acquire (&journal_lock);
+  success = (t->journal_depth > 0 || !frozen) && fits (credits, nowait_limit);
+  if (success)
+    {
+      running->credits += credits;
+      t->journal_credits += credits;
+      if (t->journal_depth++ == 0)
+        {
+          active_cnt++;
+          handle_cnt++;
+        }
+    }
+  else
+    commit_wanted = true;
+  lock_release (&journal_lock);
+  return success;
+}
+
+/* Ends the operation started by journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  running->credits -= t->journal_credits;
+  t->journal_credits = 0;
+  if (--active_cnt == 0)
+    cond_broadcast (&handles_done, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Writes BUFFER as the new contents of metadata sector SECTOR.
+   Should be called within an operation, except by the free map,
+   for which every transaction keeps room. */
+void
+journal_write (block_sector_t sector, const void *buffer)
+{
+  struct thread *t = thread_current ();
+  struct jbuf *b;
+
+  lock_acquire (&journal_lock);
+  write_cnt++;
+  b = find (running, sector);
+  if (b == NULL)
+    {
+      b = malloc (sizeof *b);
+      if (b == NULL)
+        PANIC ("out of memory for journal");
+      b->sector = sector;
+      b->revoked = false;
+      hash_insert (&running->bufs, &b->elem);
+      running->cnt++;
+
+      /* The new sector uses up one of the operation's credits. */
+      if (t->journal_credits > 0)
+        {
+          t->journal_credits--;
+          running->credits--;
+        }
+    }
+  memcpy (b->data, buffer, BLOCK_SECTOR_SIZE);
+  lock_release (&journal_lock);
+}
+
+/* Reads the current contents of metadata sector SECTOR into
+   BUFFER, which may not have reached its home location yet. */
+void
+journal_read (block_sector_t sector, void *buffer)
+{
+  struct jbuf *b;
+
+  lock_acquire (&journal_lock);
+  b = find (running, sector);
+  if (b == NULL && committing != NULL)
+    {
+      b = find (committing, sector);
+      if (b != NULL && b->revoked)
+        b = NULL;
+    }
+  if (b != NULL)
+    memcpy (buffer, b->data, BLOCK_SECTOR_SIZE);
+  lock_release (&journal_lock);
+
+  if (b == NULL)
+    block_read (fs_device, sector, buffer);
+}
+
+/* Forgets any pending writes of SECTOR, which is being freed. */
+void
+journal_revoke (block_sector_t sector)
+{
+  struct jbuf *b;
+
+  lock_acquire (&checkpoint_lock);
+  lock_acquire (&journal_lock);
+  b = find (running, sector);
+  if (b != NULL)
+    {
+      hash_delete (&running->bufs, &b->elem);
+      running->cnt--;
+      free (b);
+    }
+  if (committing != NULL)
+    {
+      b = find (committing, sector);
+      if (b != NULL)
+        b->revoked = true;
+    }
+  lock_release (&journal_lock);
+  lock_release (&checkpoint_lock);
+}
+
+/* Records that the CNT blocks starting at the one that begins at
+   SECTOR have been freed by the running transaction.  The commit
+   gives them back to the free map with free_map_reclaim() after
+   the transaction has been checkpointed. */
+void
+journal_release (block_sector_t sector, size_t cnt)
+{
+  struct release_chunk *c = NULL;
+  struct release *r;
+
+  lock_acquire (&journal_lock);
+  running->release_cnt += cnt;
+  if (!list_empty (&running->releases))
+    {
+      /* Extend the last run if SECTOR follows it, as it does when
+         a contiguous file is freed. */
+      c = list_entry (list_back (&running->releases),
+                      struct release_chunk, elem);
+      r = &c->releases[c->cnt - 1];
+      if (r->sector + r->cnt * fs_block_sectors == sector)
+        {
+          r->cnt += cnt;
+          lock_release (&journal_lock);
+          return;
+        }
+    }
+  if (c == NULL || c->cnt >= RELEASE_CNT)
+    {
+      c = malloc (sizeof *c);
+      if (c == NULL)
+        PANIC ("out of memory for journal");
+      c->cnt = 0;
+      list_push_back (&running->releases, &c->elem);
+    }
+  r = &c->releases[c->cnt++];
+  r->sector = sector;
+  r->cnt = cnt;
+  lock_release (&journal_lock);
+}
+
+/* Commits the running transaction and writes it home.  Must not
+   be called within an operation. */
+void
+journal_commit (void)
+{
+  struct thread *t = thread_current ();
+  struct transaction *trans;
+  struct jbuf **bufs = NULL;
+  size_t cnt = 0;
+
+  ASSERT (t->journal_depth == 0);
+
+  lock_acquire (&commit_lock);
+
+  /* Hold off new operations and wait for those in progress. */
+  lock_acquire (&journal_lock);
+  frozen = true;
+  while (active_cnt > 0)
+    cond_wait (&handles_done, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* Now that no operation is half done, the in-memory free map
+     is consistent with the rest of the transaction, so add its
+     changes.  Write-back may allocate sectors even now, outside
+     any operation, so take the transaction before the free map
+     can change again: otherwise it could record a pointer to a
+     sector whose allocation goes into the next one. */
+  free_map_freeze ();
+
+  /* Take the transaction and let operations continue in a new
+     one. */
+  lock_acquire (&journal_lock);
+  trans = running;
+  if (trans->cnt > 0 || trans->release_cnt > 0)
+    {
+      struct hash_iterator i;
+
+      if (trans->cnt > 0)
+        {
+          bufs = malloc (trans->cnt * sizeof *bufs);
+          if (bufs == NULL)
+            PANIC ("out of memory for journal commit");
+          hash_first (&i, &trans->bufs);
+          while (hash_next (&i))
+            bufs[cnt++] = hash_entry (hash_cur (&i), struct jbuf, elem);
+        }
+      committing = trans;
+      running = trans == &transactions[0] ? &transactions[1] : &transactions[0];
+    }
+  else
+    trans = NULL;
+  commit_wanted = false;
+  frozen = false;
+  cond_broadcast (&thawed, &journal_lock);
+  lock_release (&journal_lock);
+  free_map_thaw ();
+
+  if (trans != NULL)
+    {
+      if (cnt > 0)
+        {
+          write_log (bufs, cnt);
+          checkpoint (bufs, cnt);
+          free (bufs);
+        }
+
+      /* Nothing on disk refers to the blocks that the transaction
+         freed any more.  (A transaction without writes of its own
+         only frees blocks dropped by earlier transactions, which
+         are already home.) */
+      reclaim (trans);
+
+      lock_acquire (&journal_lock);
+      committing = NULL;
+      hash_clear (&trans->bufs, jbuf_free);
+      trans->cnt = 0;
+      lock_release (&journal_lock);
+    }
+
+  lock_release (&commit_lock);
+}
+
+/* Commits the running transaction and empties the journal, so
+   that the next boot has nothing to replay. */
+void
+journal_done (void)
+{
+  static const char zeros[BLOCK_SECTOR_SIZE];
+
+  journal_commit ();
+  lock_acquire (&commit_lock);
+  block_write (fs_device, JOURNAL_SECTOR, zeros);
+  lock_release (&commit_lock);
+}
+
+/* Prints journal statistics. */
+void
+journal_print_stats (void)
+{
+  printf ("Journal: %lld transactions, %lld operations, "
+          "%lld writes, %lld sectors logged\n",
+          commit_cnt, handle_cnt, write_cnt, logged_cnt);
+}
+
+/* Commits the running transaction every COMMIT_INTERVAL, or
+   sooner if journal_try_begin() found it full. */
+static void
+journal_thread (void *aux UNUSED)
+{
+  int64_t last = timer_ticks ();
+
+  for (;;)
+    {
+      timer_sleep (POLL_INTERVAL);
+      if (commit_wanted || timer_elapsed (last) >= COMMIT_INTERVAL)
+        {
+          journal_commit ();
+          last = timer_ticks ();
+        }
+    }
+}
+
+/* Returns true if the running transaction has room for CREDITS
+   more sectors without its sectors and outstanding credits
+   exceeding LIMIT.  The caller must hold journal_lock. */
+static bool
+fits (size_t credits, size_t limit)
+{
+  return running->cnt + running->credits + credits <= limit;
+}
+
+/* Writes the CNT sectors in BUFS to the journal as one
+   transaction. */
+static void
+write_log (struct jbuf **bufs, size_t cnt)
+{
+  struct journal_desc *desc;
+  struct journal_commit *commit;
+  block_sector_t pos = JOURNAL_SECTOR;
+  uint32_t checksum = 0;
+  size_t i, j;
+
+  /* Credits keep transactions within LOG_CAPACITY. */
+  if (cnt > LOG_CAPACITY)
+    PANIC ("journal: %zu-sector transaction overflows the journal", cnt);
+
+  desc = malloc (sizeof *desc);
+  commit = calloc (1, sizeof *commit);
+  if (desc == NULL || commit == NULL)
+    PANIC ("out of memory for journal commit");
+
+  for (i = 0; i < cnt; i += desc->cnt)
+    {
+      memset (desc, 0, sizeof *desc);
+      desc->magic = DESC_MAGIC;
+      desc->seq = next_seq;
+      desc->cnt = cnt - i < DESC_CNT ? cnt - i : DESC_CNT;
+      for (j = 0; j < desc->cnt; j++)
+        desc->sectors[j] = bufs[i + j]->sector;
+      block_write (fs_device, pos++, desc);
+
+      for (j = 0; j < desc->cnt; j++)
+        {
+          struct jbuf *b = bufs[i + j];
+          block_write (fs_device, pos++, b->data);
+          checksum = checksum_add (checksum, b->sector, b->data);
+        }
+    }
+
+  commit->magic = COMMIT_MAGIC;
+  commit->seq = next_seq++;
+  commit->cnt = cnt;
+  commit->checksum = checksum;
+  block_write (fs_device, pos, commit);
+
+  commit_cnt++;
+  logged_cnt += cnt;
+  free (commit);
+  free (desc);
+}
+
+/* Writes each of the CNT sectors in BUFS to its home location,
+   unless it has been revoked. */
+static void
+checkpoint (struct jbuf **bufs, size_t cnt)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      lock_acquire (&checkpoint_lock);
+      if (!bufs[i]->revoked)
+        block_write (fs_device, bufs[i]->sector, bufs[i]->data);
+      lock_release (&checkpoint_lock);
+    }
+}
+
+/* Gives the blocks released in TRANS back to the free map.  Only
+   the committing thread touches a transaction's releases once it
+   has been taken, so no lock is needed. */
+static void
+reclaim (struct transaction *trans)
+{
+  while (!list_empty (&trans->releases))
+    {
+      struct release_chunk *c
+        = list_entry (list_pop_front (&trans->releases),
+                      struct release_chunk, elem);
+      size_t i;
+
+      for (i = 0; i < c->cnt; i++)
+        free_map_reclaim (c->releases[i].sector, c->releases[i].cnt);
+      free (c);
+    }
+  trans->release_cnt = 0;
+}
+
+/* Writes home the transaction in the journal, if it is complete,
+   then empties the journal.  Writing it home again is harmless if
+   it was already checkpointed before the system stopped. */
+static void
+replay (void)
+{
+  struct journal_desc *desc = malloc (sizeof *desc);
+  struct journal_commit *commit = (struct journal_commit *) desc;
+  uint8_t *data = malloc (BLOCK_SECTOR_SIZE);
+  block_sector_t *homes = malloc (JOURNAL_SECTORS * sizeof *homes);
+  block_sector_t *where = malloc (JOURNAL_SECTORS * sizeof *where);
+  block_sector_t pos = JOURNAL_SECTOR;
+  block_sector_t end = JOURNAL_SECTOR + JOURNAL_SECTORS;
+  uint32_t checksum = 0;
+  uint32_t seq;
+  size_t cnt = 0;
+  size_t i;
+
+  if (desc == NULL || data == NULL || homes == NULL || where == NULL)
+    PANIC ("out of memory for journal replay");
+
+  next_seq = 1;
+  block_read (fs_device, pos, desc);
+  if (desc->magic != DESC_MAGIC)
+    goto out;
+  seq = desc->seq;
+  next_seq = seq + 1;
+
+  /* Collect the transaction's sectors, checking that it is
+     complete. */
+  for (;;)
+    {
+      if (pos >= end)
+        goto done;
+      block_read (fs_device, pos, desc);
+      if (desc->seq != seq)
+        goto done;
+      if (desc->magic == COMMIT_MAGIC)
+        break;
+      if (desc->magic != DESC_MAGIC || desc->cnt > DESC_CNT
+          || pos + 1 + desc->cnt >= end)
+        goto done;
+
+      for (i = 0; i < desc->cnt; i++)
+        {
+          homes[cnt] = desc->sectors[i];
+          where[cnt++] = pos + 1 + i;
+        }
+      pos += 1 + desc->cnt;
+    }
+  for (i = 0; i < cnt; i++)
+    {
+      block_read (fs_device, where[i], data);
+      checksum = checksum_add (checksum, homes[i], data);
+    }
+  if (commit->cnt != cnt || commit->checksum != checksum)
+    goto done;
+
+  /* Write it home. */
+  for (i = 0; i < cnt; i++)
+    {
+      block_read (fs_device, where[i], data);
+      block_write (fs_device, homes[i], data);
+    }
+  printf ("journal: replayed transaction %u (%zu sectors)\n",
+          (unsigned) seq, cnt);
+
+ done:
+  memset (data, 0, BLOCK_SECTOR_SIZE);
+  block_write (fs_device, JOURNAL_SECTOR, data);
+ out:
+  free (where);
+  free (homes);
+  free (data);
+  free (desc);
+}
+
+/* Adds SECTOR, whose contents are DATA, to CHECKSUM. */
+static uint32_t
+checksum_add (uint32_t checksum, block_sector_t sector, const void *data)
+{
+  return checksum * 31 + hash_bytes (data, BLOCK_SECTOR_SIZE) + sector;
+}
+
+/* Returns the buffer for SECTOR in TRANS, or a null pointer if
+   there is none.  The caller must hold journal_lock. */
+static struct jbuf *
+find (struct transaction *trans, block_sector_t sector)
+{
+  struct jbuf key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&trans->bufs, &key.elem);
+  return e != NULL ? hash_entry (e, struct jbuf, elem) : NULL;
+}
+
+/* Returns a hash value for the buffer that E is embedded in. */
+static unsigned
+jbuf_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct jbuf, elem)->sector);
+}
+
+/* Returns true if buffer A precedes buffer B. */
+static bool
+jbuf_less (const struct hash_elem *a, const struct hash_elem *b,
+           void *aux UNUSED)
+{
+  return (hash_entry (a, struct jbuf, elem)->sector
+          < hash_entry (b, struct jbuf, elem)->sector);
+}
+
+/* Frees the buffer that E is embedded in. */
+static void
+jbuf_free (struct hash_elem *e, void *aux UNUSED)
+{
+  free (hash_entry (e, struct jbuf, elem));
+}
@@ -0,0 +1,29 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+/* Number of sectors reserved for the journal, starting at
+   JOURNAL_SECTOR. */
+#define JOURNAL_SECTORS 256
+
+/* Most credits that an operation may ask journal_begin() for:
+   enough to create a file with every index sector of the largest
+   file and add it to a directory. */
+#define JOURNAL_MAX_CREDITS 200
+
+void journal_init (bool format);
+void journal_begin (size_t credits);
+bool journal_try_begin (size_t credits);
+void journal_end (void);
+void journal_write (block_sector_t, const void *);
+void journal_read (block_sector_t, void *);
+void journal_revoke (block_sector_t);
+void journal_release (block_sector_t, size_t);
+void journal_commit (void);
+void journal_done (void);
+void journal_print_stats (void);
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,21 @@
+#ifndef __LIB_DIRENT_H
+#define __LIB_DIRENT_H
+
+/* Maximum length of a name in a struct dirent. */
+#define DIRENT_NAME_MAX 14
+
+/* Types of directory entries. */
+#define DT_REG 1                /* Regular file. */
+#define DT_DIR 2                /* Directory. */
+
+/* A directory entry, as returned by getdents().  Entries are
+   packed back to back in the caller's buffer. */
+struct dirent
+  {
+    int d_ino;                  /* Inode number. */
+    int d_size;                 /* Size in bytes, 0 for a directory. */
+    unsigned char d_type;       /* DT_REG or DT_DIR. */
+    char d_name[DIRENT_NAME_MAX + 1];   /* Null-terminated name. */
+  };
+
+#endif /* lib/dirent.h */
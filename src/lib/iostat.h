@@ -0,0 +1,31 @@
+#ifndef __LIB_IOSTAT_H
+#define __LIB_IOSTAT_H
+
+#include <stdint.h>
+
+/* Number of buckets in a latency histogram.  Bucket 0 counts
+   requests that took less than 2 microseconds and bucket I > 0
+   those that took from 2**I to 2**(I + 1) - 1 microseconds,
+   except that the last bucket also counts all slower ones. */
+#define IOSTAT_BUCKETS 24
+
+/* Statistics for a block device, as returned by iostat().
+   Requests are counted once they complete.  A request to a
+   partition is counted both for the partition and for the disk
+   that holds it. */
+struct iostat
+  {
+    char name[16];              /* Device name, e.g. "hda1". */
+    char type[8];               /* Device type, e.g. "filesys". */
+    uint64_t read_cnt;          /* Read requests. */
+    uint64_t write_cnt;         /* Write requests. */
+    uint64_t read_bytes;        /* Bytes read. */
+    uint64_t write_bytes;       /* Bytes written. */
+    uint64_t busy_us;           /* Microseconds with a request in flight. */
+    uint64_t latency_us;        /* Sum of request latencies, in us. */
+    uint32_t in_flight;         /* Requests submitted, not completed. */
+    uint32_t max_in_flight;     /* Most requests ever in flight at once. */
+    uint32_t latency_hist[IOSTAT_BUCKETS]; /* Latencies, as above. */
+  };
+
+#endif /* lib/iostat.h */
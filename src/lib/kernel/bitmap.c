@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include <string.h>
 #include "threads/malloc.h"
 #ifdef FILESYS
 #include "filesys/file.h"
@@ -325,6 +326,46 @@ bitmap_scan_and_flip (struct bitmap *b, size_t start, size_t cnt, bool value)
   return idx;
 }
 
+/* Byte access. */
+
+/* Copies up to SIZE bytes of B's file image, starting at byte
+   OFS, into BUFFER, and returns the number of bytes copied, which
+   is less than SIZE if the image ends first.  Together with
+   bitmap_set_bytes(), lets a caller store a large bitmap piece by
+   piece. */
+size_t
+bitmap_get_bytes (const struct bitmap *b, size_t ofs, void *buffer,
+                  size_t size)
+{
+  size_t image_size = byte_cnt (b->bit_cnt);
+
+  if (ofs >= image_size)
+    return 0;
+  if (size > image_size - ofs)
+    size = image_size - ofs;
+  memcpy (buffer, (const uint8_t *) b->bits + ofs, size);
+  return size;
+}
+
+/* Copies up to SIZE bytes from BUFFER into B's file image,
+   starting at byte OFS, and returns the number of bytes copied.
+   Bits past the end of B are ignored. */
+size_t
+bitmap_set_bytes (struct bitmap *b, size_t ofs, const void *buffer,
+                  size_t size)
+{
+  size_t image_size = byte_cnt (b->bit_cnt);
+
+  if (ofs >= image_size)
+    return 0;
+  if (size > image_size - ofs)
+    size = image_size - ofs;
+  memcpy ((uint8_t *) b->bits + ofs, buffer, size);
+  if (b->bit_cnt > 0)
+    b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+  return size;
+}
+
 /* File input and output. */
 
 #ifdef FILESYS
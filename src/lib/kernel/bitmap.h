@@ -37,6 +37,12 @@ bool bitmap_all (const struct bitmap *, size_t start, size_t cnt);
 size_t bitmap_scan (const struct bitmap *, size_t start, size_t cnt, bool);
 size_t bitmap_scan_and_flip (struct bitmap *, size_t start, size_t cnt, bool);
 
+/* Byte access. */
+size_t bitmap_get_bytes (const struct bitmap *, size_t ofs, void *,
+                         size_t size);
+size_t bitmap_set_bytes (struct bitmap *, size_t ofs, const void *,
+                         size_t size);
+
 /* File input and output. */
 #ifdef FILESYS
 struct file;
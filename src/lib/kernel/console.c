@@ -1,14 +1,20 @@
 #include <console.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/serial.h"
 #include "devices/vga.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 
 static void vprintf_helper (char, void *);
 static void putchar_have_lock (uint8_t c);
+static void putbuf_have_lock (const char *, size_t n);
+static void log_write (const char *, size_t n);
+static void flush_log (void);
+static thread_func console_thread;
 
 /* The console lock.
    Both the vga and serial layers do their own locking, so it's
@@ -59,21 +65,109 @@ static int console_lock_depth;
 /* Number of characters written to console. */
 static int64_t write_cnt;
 
+/* The kernel log, a ring buffer that holds console output until
+   the console thread writes it to the vga display and serial
+   port.  Printing thus costs no more than formatting, which
+   matters for debugging output from timing-sensitive code, and
+   interrupt handlers can print without waiting for the devices.
+
+   LOG_HEAD and LOG_TAIL count the characters ever put into the
+   log and ever written out of it, so that LOG_HEAD - LOG_TAIL
+   characters await writing.  The rest of the ring still holds
+   the most recent output already written, for
+   console_read_log(). */
+static char klog[CONSOLE_LOG_SIZE];
+static unsigned log_head;       /* Next character is logged here. */
+static unsigned log_tail;       /* Next character is written here. */
+
+/* True while the console thread writes out the log.  False
+   before it starts and after a kernel panic, when each
+   character is written out as soon as it is logged. */
+static bool log_queued;
+
+/* Wakes up the console thread, if LOG_WAKE_PENDING is false. */
+static struct semaphore log_ready;
+static bool log_wake_pending;
+
+/* Threads waiting for room in the log. */
+static struct semaphore log_room;
+static int log_room_waiters;
+
+/* Held while writing out the log from a thread. */
+static struct lock flush_lock;
+
+/* Number of characters dropped because the log was full and the
+   printer could not wait. */
+static int64_t drop_cnt;
+
 /* Enable console locking. */
 void
 console_init (void) 
 {
   lock_init (&console_lock);
+  sema_init (&log_ready, 0);
+  sema_init (&log_room, 0);
+  lock_init (&flush_lock);
   use_console_lock = true;
 }
 
+/* Starts the console thread, so that console output is logged
+   and written out later rather than written out right away.
+   The console thread runs at the lowest priority, so as to stay
+   out of the way of the threads doing the printing. */
+void
+console_init_queue (void)
+{
+  thread_create ("console", PRI_MIN, console_thread, NULL);
+  log_queued = true;
+}
+
 /* Notifies the console that a kernel panic is underway,
    which warns it to avoid trying to take the console lock from
-   now on. */
+   now on.  Also writes out everything logged but not yet
+   written, so that it comes before the panic message, and
+   writes out everything printed from now on right away. */
 void
 console_panic (void) 
 {
   use_console_lock = false;
+  log_queued = false;
+  flush_log ();
+}
+
+/* Writes out everything logged so far. */
+void
+console_flush (void)
+{
+  if (log_queued && !intr_context ())
+    {
+      lock_acquire (&flush_lock);
+      flush_log ();
+      lock_release (&flush_lock);
+    }
+  else
+    flush_log ();
+}
+
+/* Copies the last SIZE characters of console output into BUFFER,
+   or as many as the log retains if that is fewer, and returns
+   the number copied. */
+size_t
+console_read_log (char *buffer, size_t size)
+{
+  enum intr_level old_level = intr_disable ();
+  size_t cnt = log_head < CONSOLE_LOG_SIZE ? log_head : CONSOLE_LOG_SIZE;
+  size_t ofs, first;
+
+  if (cnt > size)
+    cnt = size;
+  ofs = (log_head - cnt) % CONSOLE_LOG_SIZE;
+  first = cnt < CONSOLE_LOG_SIZE - ofs ? cnt : CONSOLE_LOG_SIZE - ofs;
+  memcpy (buffer, klog + ofs, first);
+  memcpy (buffer + first, klog, cnt - first);
+  intr_set_level (old_level);
+
+  return cnt;
 }
 
 /* Prints console statistics. */
@@ -81,6 +175,8 @@ void
 console_print_stats (void) 
 {
   printf ("Console: %lld characters output\n", write_cnt);
+  if (drop_cnt > 0)
+    printf ("Console: %lld characters dropped\n", drop_cnt);
 }
 
 /* Acquires the console lock. */
@@ -119,19 +215,31 @@ console_locked_by_current_thread (void)
           || lock_held_by_current_thread (&console_lock));
 }
 
+/* Output buffered by vprintf(), so that it reaches the serial
+   port in chunks rather than a byte at a time. */
+struct vprintf_buf
+  {
+    int char_cnt;               /* Total characters written. */
+    size_t len;                 /* Number of characters in BUF. */
+    char buf[64];               /* Characters not yet written. */
+  };
+
 /* The standard vprintf() function,
    which is like printf() but uses a va_list.
    Writes its output to both vga display and serial port. */
 int
 vprintf (const char *format, va_list args) 
 {
-  int char_cnt = 0;
+  struct vprintf_buf aux;
 
+  aux.char_cnt = 0;
+  aux.len = 0;
   acquire_console ();
-  __vprintf (format, args, vprintf_helper, &char_cnt);
+  __vprintf (format, args, vprintf_helper, &aux);
+  putbuf_have_lock (aux.buf, aux.len);
   release_console ();
 
-  return char_cnt;
+  return aux.char_cnt;
 }
 
 /* Writes string S to the console, followed by a new-line
@@ -153,8 +261,7 @@ void
 putbuf (const char *buffer, size_t n) 
 {
   acquire_console ();
-  while (n-- > 0)
-    putchar_have_lock (*buffer++);
+  putbuf_have_lock (buffer, n);
   release_console ();
 }
 
@@ -171,11 +278,17 @@ putchar (int c)
 
 /* Helper function for vprintf(). */
 static void
-vprintf_helper (char c, void *char_cnt_) 
+vprintf_helper (char c, void *aux_) 
 {
-  int *char_cnt = char_cnt_;
-  (*char_cnt)++;
-  putchar_have_lock (c);
+  struct vprintf_buf *aux = aux_;
+
+  aux->char_cnt++;
+  aux->buf[aux->len++] = c;
+  if (aux->len >= sizeof aux->buf)
+    {
+      putbuf_have_lock (aux->buf, aux->len);
+      aux->len = 0;
+    }
 }
 
 /* Writes C to the vga display and serial port.
@@ -183,9 +296,131 @@ vprintf_helper (char c, void *char_cnt_)
    appropriate. */
 static void
 putchar_have_lock (uint8_t c) 
+{
+  char ch = c;
+
+  putbuf_have_lock (&ch, 1);
+}
+
+/* Writes the N characters in BUFFER to the vga display and
+   serial port, by way of the log.  The caller has already
+   acquired the console lock if appropriate. */
+static void
+putbuf_have_lock (const char *buffer, size_t n)
 {
   ASSERT (console_locked_by_current_thread ());
-  write_cnt++;
-  serial_putc (c);
-  vga_putc (c);
+  write_cnt += n;
+  log_write (buffer, n);
+}
+
+/* Wakes up the console thread to write out the log. */
+static void
+wake_console_thread (void)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  if (!log_wake_pending)
+    {
+      log_wake_pending = true;
+      sema_up (&log_ready);
+    }
+}
+
+/* Puts the N characters in BUFFER into the log.  If the console
+   thread is running, leaves them for it to write out, waiting
+   for room in the log if necessary, or dropping what does not
+   fit if the caller cannot wait.  Otherwise, writes them out
+   right away. */
+static void
+log_write (const char *buffer, size_t n)
+{
+  enum intr_level old_level = intr_disable ();
+
+  while (n > 0)
+    {
+      size_t ofs = log_head % CONSOLE_LOG_SIZE;
+      size_t room = CONSOLE_LOG_SIZE - (log_head - log_tail);
+      size_t cnt = n < room ? n : room;
+
+      if (cnt > CONSOLE_LOG_SIZE - ofs)
+        cnt = CONSOLE_LOG_SIZE - ofs;
+      memcpy (klog + ofs, buffer, cnt);
+      log_head += cnt;
+      buffer += cnt;
+      n -= cnt;
+
+      if (!log_queued)
+        flush_log ();
+      else if (n > 0 && cnt == room)
+        {
+          /* The log is full.  Interrupt handlers and code that
+             runs with interrupts off cannot wait for the
+             console thread to make room. */
+          if (old_level == INTR_OFF)
+            {
+              drop_cnt += n;
+              break;
+            }
+          wake_console_thread ();
+          log_room_waiters++;
+          sema_down (&log_room);
+        }
+    }
+  if (log_queued && log_head != log_tail)
+    wake_console_thread ();
+
+  intr_set_level (old_level);
+}
+
+/* Writes everything logged but not yet written out to the vga
+   display and serial port. */
+static void
+flush_log (void)
+{
+  for (;;)
+    {
+      enum intr_level old_level = intr_disable ();
+      size_t ofs = log_tail % CONSOLE_LOG_SIZE;
+      size_t cnt = log_head - log_tail;
+      size_t i;
+
+      intr_set_level (old_level);
+      if (cnt == 0)
+        break;
+      if (cnt > CONSOLE_LOG_SIZE - ofs)
+        cnt = CONSOLE_LOG_SIZE - ofs;
+
+      serial_putbuf (klog + ofs, cnt);
+      for (i = 0; i < cnt; i++)
+        vga_putc (klog[ofs + i]);
+
+      /* Wake up threads waiting for room once the log is half
+         empty, so that each of them can put in a good-sized
+         chunk. */
+      old_level = intr_disable ();
+      log_tail += cnt;
+      if (log_head - log_tail <= CONSOLE_LOG_SIZE / 2)
+        for (; log_room_waiters > 0; log_room_waiters--)
+          sema_up (&log_room);
+      intr_set_level (old_level);
+    }
+}
+
+/* Thread function that writes out the log whenever there is
+   something in it. */
+static void
+console_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      enum intr_level old_level;
+
+      sema_down (&log_ready);
+      old_level = intr_disable ();
+      log_wake_pending = false;
+      intr_set_level (old_level);
+
+      lock_acquire (&flush_lock);
+      flush_log ();
+      lock_release (&flush_lock);
+    }
 }
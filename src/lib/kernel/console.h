@@ -1,8 +1,16 @@
 #ifndef __LIB_KERNEL_CONSOLE_H
 #define __LIB_KERNEL_CONSOLE_H
 
+#include <stddef.h>
+
+/* Size of the kernel log of console output, in bytes. */
+#define CONSOLE_LOG_SIZE 16384
+
 void console_init (void);
+void console_init_queue (void);
 void console_panic (void);
+void console_flush (void);
+size_t console_read_log (char *, size_t size);
 void console_print_stats (void);
 
 #endif /* lib/kernel/console.h */
@@ -0,0 +1,227 @@
+/* Fast LZ77 compression.
+
+   The compressed form is a series of sequences, in the style of
+   LZ4.  A sequence starts with a token byte whose high 4 bits give
+   the number of literal bytes in it and whose low 4 bits give the
+   length of its match, less MIN_MATCH.  A value of 15 in either
+   field continues in the bytes that follow, each of which is added
+   to it, up to and including the first byte that is not 255.  The
+   literals come next, copied as is, and then the match: a 2-byte
+   little-endian distance back into the output, from which the
+   match is copied, followed by the continuation of its length.
+   The last sequence ends after its literals, so that it may have
+   no match.
+
+   The compressor looks for matches through a table of the last
+   position at which each hash of 4 bytes occurred.  It takes the
+   first match it finds and extends it as far as possible, trading
+   ratio for speed. */
+
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+#include "../debug.h"
+
+/* Shortest match worth encoding. */
+#define MIN_MATCH 4
+
+/* Bits in a hash, and entries in the hash table. */
+#define HASH_BITS 12
+#define HASH_CNT (1 << HASH_BITS)
+
+static bool put_count (uint8_t **opp, uint8_t *oend, size_t);
+static bool put_sequence (uint8_t **opp, uint8_t *oend,
+                          const uint8_t *lit, size_t lit_cnt,
+                          size_t distance, size_t match_len);
+static bool get_count (const uint8_t **ipp, const uint8_t *iend, size_t *);
+
+/* Returns the 4 bytes at P as a 32-bit number. */
+static inline uint32_t
+read32 (const uint8_t *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof v);
+  return v;
+}
+
+/* Returns a hash of the 4 bytes at P. */
+static inline unsigned
+hash4 (const uint8_t *p)
+{
+  return (read32 (p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Compresses the SRC_SIZE bytes at SRC into the DST_SIZE bytes
+   at DST, using the LZ_WORK_SIZE bytes at WORK as scratch space.
+   Returns the size of the compressed data, or 0 if it would not
+   fit in DST_SIZE bytes.  SRC_SIZE must not exceed
+   LZ_MAX_INPUT. */
+size_t
+lz_compress (const void *src_, size_t src_size,
+             void *dst_, size_t dst_size, void *work)
+{
+  const uint8_t *src = src_;
+  uint8_t *dst = dst_;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dst_size;
+
+  /* Position plus 1 of the last string with each hash, or 0.
+     Positions fit in 16 bits because of LZ_MAX_INPUT. */
+  uint16_t *table = work;
+  size_t ip = 0, anchor = 0;
+
+  ASSERT (src_size <= LZ_MAX_INPUT);
+  ASSERT (HASH_CNT * sizeof *table == LZ_WORK_SIZE);
+
+  memset (table, 0, LZ_WORK_SIZE);
+  while (ip + MIN_MATCH <= src_size)
+    {
+      unsigned h = hash4 (src + ip);
+      size_t ref = table[h];
+
+      table[h] = ip + 1;
+      if (ref != 0 && read32 (src + ref - 1) == read32 (src + ip))
+        {
+          size_t len = MIN_MATCH;
+
+          ref--;
+          while (ip + len < src_size && src[ref + len] == src[ip + len])
+            len++;
+          if (!put_sequence (&op, oend, src + anchor, ip - anchor,
+                             ip - ref, len))
+            return 0;
+          ip += len;
+          anchor = ip;
+        }
+      else
+        ip++;
+    }
+  if (!put_sequence (&op, oend, src + anchor, src_size - anchor, 0, 0))
+    return 0;
+  return op - dst;
+}
+
+/* Decompresses the SRC_SIZE bytes at SRC, produced by
+   lz_compress(), into the DST_SIZE bytes at DST.  Returns true if
+   successful, false if SRC is corrupt or does not decompress to
+   exactly DST_SIZE bytes.  Never reads or writes outside SRC and
+   DST, whatever SRC contains. */
+bool
+lz_decompress (const void *src, size_t src_size, void *dst, size_t dst_size)
+{
+  const uint8_t *ip = src;
+  const uint8_t *iend = ip + src_size;
+  uint8_t *op = dst;
+  uint8_t *oend = op + dst_size;
+
+  while (ip < iend)
+    {
+      unsigned token = *ip++;
+      size_t lit_cnt = token >> 4;
+      size_t match_len = token & 15;
+      size_t distance;
+
+      /* Literals. */
+      if (lit_cnt == 15 && !get_count (&ip, iend, &lit_cnt))
+        return false;
+      if ((size_t) (iend - ip) < lit_cnt || (size_t) (oend - op) < lit_cnt)
+        return false;
+      memcpy (op, ip, lit_cnt);
+      ip += lit_cnt;
+      op += lit_cnt;
+      if (ip == iend)
+        break;
+
+      /* Match, which may overlap the bytes it produces. */
+      if (iend - ip < 2)
+        return false;
+      distance = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (match_len == 15 && !get_count (&ip, iend, &match_len))
+        return false;
+      match_len += MIN_MATCH;
+      if (distance == 0 || distance > (size_t) (op - (uint8_t *) dst)
+          || (size_t) (oend - op) < match_len)
+        return false;
+      for (; match_len > 0; match_len--, op++)
+        *op = op[-distance];
+    }
+  return op == oend;
+}
+
+/* Appends to the output at *OPP, which may not go past OEND, a
+   sequence of the LIT_CNT literals at LIT followed, if MATCH_LEN
+   is nonzero, by a match of MATCH_LEN bytes DISTANCE back.
+   Returns false if the output does not fit. */
+static bool
+put_sequence (uint8_t **opp, uint8_t *oend, const uint8_t *lit,
+              size_t lit_cnt, size_t distance, size_t match_len)
+{
+  size_t extra = match_len > 0 ? match_len - MIN_MATCH : 0;
+  uint8_t *op = *opp;
+
+  if (op >= oend)
+    return false;
+  *op++ = ((lit_cnt < 15 ? lit_cnt : 15) << 4) | (extra < 15 ? extra : 15);
+  if (lit_cnt >= 15 && !put_count (&op, oend, lit_cnt - 15))
+    return false;
+  if ((size_t) (oend - op) < lit_cnt)
+    return false;
+  memcpy (op, lit, lit_cnt);
+  op += lit_cnt;
+
+  if (match_len > 0)
+    {
+      if (oend - op < 2)
+        return false;
+      *op++ = distance & 0xff;
+      *op++ = distance >> 8;
+      if (extra >= 15 && !put_count (&op, oend, extra - 15))
+        return false;
+    }
+  *opp = op;
+  return true;
+}
+
+/* Appends to the output at *OPP, which may not go past OEND, the
+   continuation bytes for a count field that has CNT left over.
+   Returns false if the output does not fit. */
+static bool
+put_count (uint8_t **opp, uint8_t *oend, size_t cnt)
+{
+  uint8_t *op = *opp;
+
+  for (;;)
+    {
+      if (op >= oend)
+        return false;
+      if (cnt < 255)
+        break;
+      *op++ = 255;
+      cnt -= 255;
+    }
+  *op++ = cnt;
+  *opp = op;
+  return true;
+}
+
+/* Adds the continuation bytes at *IPP, which may not go past
+   IEND, to the count field at *CNT, and advances *IPP past them.
+   Returns false if the input ends first. */
+static bool
+get_count (const uint8_t **ipp, const uint8_t *iend, size_t *cnt)
+{
+  const uint8_t *ip = *ipp;
+  unsigned b;
+
+  do
+    {
+      if (ip >= iend)
+        return false;
+      b = *ip++;
+      *cnt += b;
+    }
+  while (b == 255);
+  *ipp = ip;
+  return true;
+}
@@ -0,0 +1,22 @@
+#ifndef __LIB_KERNEL_LZ_H
+#define __LIB_KERNEL_LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Fast LZ77 compression, for compressed files.
+
+   See lz.c for the format. */
+
+/* Largest input that lz_compress() accepts, in bytes. */
+#define LZ_MAX_INPUT 65535
+
+/* Bytes of scratch memory that lz_compress() needs. */
+#define LZ_WORK_SIZE 8192
+
+size_t lz_compress (const void *src, size_t src_size,
+                    void *dst, size_t dst_size, void *work);
+bool lz_decompress (const void *src, size_t src_size,
+                    void *dst, size_t dst_size);
+
+#endif /* lib/kernel/lz.h */
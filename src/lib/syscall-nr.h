@@ -28,7 +28,25 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Positional and scatter-gather I/O. */
+    SYS_PREAD,                  /* Read from a file at an offset. */
+    SYS_PWRITE,                 /* Write to a file at an offset. */
+    SYS_READV,                  /* Read into several buffers. */
+    SYS_WRITEV,                 /* Write from several buffers. */
+    SYS_COPY_FILE_RANGE,        /* Copy data between files. */
+    SYS_GETDENTS,               /* Reads several directory entries. */
+
+    /* File storage. */
+    SYS_COMPRESS,               /* Stores a file compressed. */
+    SYS_DEFRAG,                 /* Makes a file contiguous on disk. */
+
+    /* Statistics. */
+    SYS_IOSTAT,                 /* Reports block device statistics. */
+
+    /* Kernel log. */
+    SYS_KLOG                    /* Reads recent console output. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -0,0 +1,17 @@
+#ifndef __LIB_UIO_H
+#define __LIB_UIO_H
+
+#include <stddef.h>
+
+/* One element of a scatter-gather list, as passed to readv() and
+   writev(). */
+struct iovec
+  {
+    void *iov_base;             /* Start of buffer. */
+    size_t iov_len;             /* Length of buffer in bytes. */
+  };
+
+/* Maximum number of elements in a scatter-gather list. */
+#define IOV_MAX 1024
+
+#endif /* lib/uio.h */
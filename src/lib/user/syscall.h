@@ -3,6 +3,9 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <dirent.h>
+#include <iostat.h>
+#include <uio.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -42,7 +45,26 @@ void munmap (mapid_t);
 bool chdir (const char *dir);
 bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
+int getdents (int fd, struct dirent *buffer, unsigned size);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Positional and scatter-gather I/O. */
+int pread (int fd, void *buffer, unsigned length, unsigned offset);
+int pwrite (int fd, const void *buffer, unsigned length, unsigned offset);
+int readv (int fd, const struct iovec *iov, int iovcnt);
+int writev (int fd, const struct iovec *iov, int iovcnt);
+int copy_file_range (int fd_in, unsigned off_in, int fd_out, unsigned off_out,
+                     unsigned length);
+
+/* File storage. */
+bool compress (int fd);
+int defrag (int fd);
+
+/* Statistics. */
+int iostat (struct iostat *stats, int cnt);
+
+/* Kernel log. */
+int klog (char *buffer, unsigned size);
+
 #endif /* lib/user/syscall.h */
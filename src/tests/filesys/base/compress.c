@@ -0,0 +1,83 @@
+/* Stores a file compressed, verifies that it reads back the same
+   both sequentially and at scattered offsets, then writes to it,
+   which must store it uncompressed again, and verifies it once
+   more.  Also checks that compression is refused for a file that
+   is open twice and for one that would not get smaller. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 45678
+
+static char buf[FILE_SIZE];
+static char buf2[FILE_SIZE];
+
+/* Reads back the 20 pieces of FILE_SIZE / 20 bytes of the file
+   open as FD in an order that jumps around, and compares them
+   with BUF. */
+static void
+check_pieces (int fd) 
+{
+  const int piece = FILE_SIZE / 20;
+  int i;
+
+  for (i = 0; i < 20; i++)
+    {
+      int ofs = (i * 7 % 20) * piece;
+      if (pread (fd, buf2, piece, ofs) != piece)
+        fail ("pread %d bytes at %d failed", piece, ofs);
+      if (memcmp (buf2, buf + ofs, piece))
+        fail ("%d bytes at %d differ", piece, ofs);
+    }
+}
+
+void
+test_main (void) 
+{
+  const char *text = "Once upon a time, there was a file system. ";
+  size_t text_len = strlen (text);
+  int fd, fd2;
+  size_t i;
+
+  for (i = 0; i < FILE_SIZE; i++)
+    buf[i] = text[i % text_len];
+
+  CHECK (create ("story", 0), "create \"story\"");
+  CHECK ((fd = open ("story")) > 1, "open \"story\"");
+  CHECK (write (fd, buf, FILE_SIZE) == FILE_SIZE,
+         "write %d bytes to \"story\"", FILE_SIZE);
+  CHECK ((fd2 = open ("story")) > 1, "open \"story\" again");
+  CHECK (!compress (fd), "compress \"story\" open twice (must fail)");
+  msg ("close \"story\" again");
+  close (fd2);
+  CHECK (compress (fd), "compress \"story\"");
+  msg ("read \"story\" in pieces");
+  check_pieces (fd);
+  msg ("close \"story\"");
+  close (fd);
+  check_file ("story", buf, FILE_SIZE);
+
+  CHECK ((fd = open ("story")) > 1, "open \"story\"");
+  memset (buf + 10000, 'x', 3000);
+  CHECK (pwrite (fd, buf + 10000, 3000, 10000) == 3000,
+         "pwrite 3000 bytes at 10000");
+  msg ("read \"story\" in pieces");
+  check_pieces (fd);
+  msg ("close \"story\"");
+  close (fd);
+  check_file ("story", buf, FILE_SIZE);
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("noise", FILE_SIZE), "create \"noise\"");
+  CHECK ((fd = open ("noise")) > 1, "open \"noise\"");
+  CHECK (write (fd, buf, FILE_SIZE) == FILE_SIZE,
+         "write %d bytes to \"noise\"", FILE_SIZE);
+  CHECK (!compress (fd), "compress \"noise\" (must fail)");
+  msg ("close \"noise\"");
+  close (fd);
+  check_file ("noise", buf, FILE_SIZE);
+}
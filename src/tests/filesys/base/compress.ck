@@ -0,0 +1,36 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(compress) begin
+(compress) create "story"
+(compress) open "story"
+(compress) write 45678 bytes to "story"
+(compress) open "story" again
+(compress) compress "story" open twice (must fail)
+(compress) close "story" again
+(compress) compress "story"
+(compress) read "story" in pieces
+(compress) close "story"
+(compress) open "story" for verification
+(compress) verified contents of "story"
+(compress) close "story"
+(compress) open "story"
+(compress) pwrite 3000 bytes at 10000
+(compress) read "story" in pieces
+(compress) close "story"
+(compress) open "story" for verification
+(compress) verified contents of "story"
+(compress) close "story"
+(compress) create "noise"
+(compress) open "noise"
+(compress) write 45678 bytes to "noise"
+(compress) compress "noise" (must fail)
+(compress) close "noise"
+(compress) open "noise" for verification
+(compress) verified contents of "noise"
+(compress) close "noise"
+(compress) end
+EOF
+pass;
@@ -0,0 +1,48 @@
+/* Copies a file with copy_file_range() in pieces that do not
+   line up with pages, then verifies the copy and checks that
+   copying overlapping ranges of one file is refused. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 23456
+
+static char buf[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  int in_fd, out_fd;
+  unsigned ofs;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create ("source", 0), "create \"source\"");
+  CHECK ((in_fd = open ("source")) > 1, "open \"source\"");
+  CHECK (write (in_fd, buf, FILE_SIZE) == FILE_SIZE,
+         "write %d bytes to \"source\"", FILE_SIZE);
+  CHECK (create ("copy", 0), "create \"copy\"");
+  CHECK ((out_fd = open ("copy")) > 1, "open \"copy\"");
+
+  msg ("copy \"source\" to \"copy\"");
+  for (ofs = 0; ofs < FILE_SIZE; )
+    {
+      int bytes_copied = copy_file_range (in_fd, ofs, out_fd, ofs, 5000);
+      if (bytes_copied <= 0)
+        fail ("copy_file_range at %u returned %d", ofs, bytes_copied);
+      ofs += bytes_copied;
+    }
+  CHECK (copy_file_range (in_fd, FILE_SIZE, out_fd, FILE_SIZE, 100) == 0,
+         "copy_file_range at end of file");
+  CHECK (copy_file_range (in_fd, 0, in_fd, 100, 200) == -1,
+         "copy_file_range of overlapping ranges (must fail)");
+
+  msg ("close \"source\"");
+  close (in_fd);
+  msg ("close \"copy\"");
+  close (out_fd);
+  check_file ("copy", buf, FILE_SIZE);
+}
@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(copy-range) begin
+(copy-range) create "source"
+(copy-range) open "source"
+(copy-range) write 23456 bytes to "source"
+(copy-range) create "copy"
+(copy-range) open "copy"
+(copy-range) copy "source" to "copy"
+(copy-range) copy_file_range at end of file
+(copy-range) copy_file_range of overlapping ranges (must fail)
+(copy-range) close "source"
+(copy-range) close "copy"
+(copy-range) open "copy" for verification
+(copy-range) verified contents of "copy"
+(copy-range) close "copy"
+(copy-range) end
+EOF
+pass;
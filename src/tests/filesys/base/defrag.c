@@ -0,0 +1,51 @@
+/* Writes two files in alternating small pieces, so that their
+   blocks may end up interleaved on disk, then defragments each
+   and checks that it ends up in a single extent with its
+   contents intact.  Also checks that defrag() refuses a bad file
+   descriptor. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 34567
+#define PIECE 1000
+
+static char buf_a[FILE_SIZE];
+static char buf_b[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  int fd_a, fd_b;
+  int ofs;
+
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+  random_bytes (buf_b, sizeof buf_b);
+
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK (create ("b", 0), "create \"b\"");
+  CHECK ((fd_a = open ("a")) > 1, "open \"a\"");
+  CHECK ((fd_b = open ("b")) > 1, "open \"b\"");
+  msg ("write \"a\" and \"b\" in alternating pieces");
+  for (ofs = 0; ofs < FILE_SIZE; ofs += PIECE)
+    {
+      int size = FILE_SIZE - ofs < PIECE ? FILE_SIZE - ofs : PIECE;
+      if (write (fd_a, buf_a + ofs, size) != size)
+        fail ("write %d bytes at %d to \"a\" failed", size, ofs);
+      if (write (fd_b, buf_b + ofs, size) != size)
+        fail ("write %d bytes at %d to \"b\" failed", size, ofs);
+    }
+
+  CHECK (defrag (fd_a) == 1, "defrag \"a\"");
+  CHECK (defrag (fd_b) == 1, "defrag \"b\"");
+  CHECK (defrag (1234) == -1, "defrag bad fd (must fail)");
+  msg ("close \"a\"");
+  close (fd_a);
+  msg ("close \"b\"");
+  close (fd_b);
+  check_file ("a", buf_a, FILE_SIZE);
+  check_file ("b", buf_b, FILE_SIZE);
+}
@@ -0,0 +1,85 @@
+/* Checks that iostat() reports every block device, including one
+   for the file system that has done some reading by now, and that
+   each device's statistics agree with each other, before and
+   after writing a file and reading it back. */
+
+#include <iostat.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define MAX_DEVICES 16
+#define FILE_SIZE 20000
+
+static struct iostat st[MAX_DEVICES];
+static char buf[FILE_SIZE];
+
+/* Checks the statistics in ST[0] through ST[CNT - 1] for
+   consistency, and returns the index of the file system device,
+   failing if there is none. */
+static int
+check_stats (int cnt)
+{
+  int filesys = -1;
+  int i, j;
+
+  for (i = 0; i < cnt; i++)
+    {
+      uint64_t hist_cnt = 0;
+
+      for (j = 0; j < IOSTAT_BUCKETS; j++)
+        hist_cnt += st[i].latency_hist[j];
+      if (hist_cnt != st[i].read_cnt + st[i].write_cnt)
+        fail ("%s: latency histogram counts %llu requests, not %llu",
+              st[i].name, hist_cnt, st[i].read_cnt + st[i].write_cnt);
+      if (st[i].read_bytes < st[i].read_cnt * 512
+          || st[i].read_bytes % 512 != 0
+          || st[i].write_bytes < st[i].write_cnt * 512
+          || st[i].write_bytes % 512 != 0)
+        fail ("%s: byte counts do not match request counts", st[i].name);
+      if (st[i].in_flight > st[i].max_in_flight)
+        fail ("%s: %u requests in flight, but at most %u ever",
+              st[i].name, st[i].in_flight, st[i].max_in_flight);
+      if (!strcmp (st[i].type, "filesys") && filesys < 0)
+        filesys = i;
+    }
+  if (filesys < 0)
+    fail ("no file system device");
+  if (st[filesys].read_cnt == 0)
+    fail ("%s: no reads", st[filesys].name);
+  return filesys;
+}
+
+void
+test_main (void)
+{
+  struct iostat before;
+  int cnt, fs, fd;
+
+  CHECK ((cnt = iostat (st, MAX_DEVICES)) > 0, "iostat");
+  CHECK (iostat (st, 0) == cnt, "iostat with no room");
+  if (cnt > MAX_DEVICES)
+    cnt = MAX_DEVICES;
+  fs = check_stats (cnt);
+  before = st[fs];
+
+  memset (buf, 'a', sizeof buf);
+  CHECK (create ("data", FILE_SIZE), "create \"data\"");
+  CHECK ((fd = open ("data")) > 1, "open \"data\"");
+  CHECK (write (fd, buf, FILE_SIZE) == FILE_SIZE,
+         "write %d bytes to \"data\"", FILE_SIZE);
+  msg ("close \"data\"");
+  close (fd);
+  check_file ("data", buf, FILE_SIZE);
+
+  CHECK (iostat (st, MAX_DEVICES) > 0, "iostat again");
+  if (strcmp (st[fs].name, before.name))
+    fail ("device %s became %s", before.name, st[fs].name);
+  check_stats (cnt);
+  if (st[fs].read_cnt < before.read_cnt
+      || st[fs].write_cnt < before.write_cnt
+      || st[fs].busy_us < before.busy_us
+      || st[fs].max_in_flight < before.max_in_flight)
+    fail ("%s: statistics went backward", st[fs].name);
+}
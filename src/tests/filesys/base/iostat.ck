@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(iostat) begin
+(iostat) iostat
+(iostat) iostat with no room
+(iostat) create "data"
+(iostat) open "data"
+(iostat) write 20000 bytes to "data"
+(iostat) close "data"
+(iostat) open "data" for verification
+(iostat) verified contents of "data"
+(iostat) close "data"
+(iostat) iostat again
+(iostat) end
+EOF
+pass;
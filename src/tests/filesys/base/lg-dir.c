@@ -0,0 +1,41 @@
+/* Creates a large number of files in the root directory, then
+   opens each of them.  Exercises directory lookup and insertion
+   in directories far larger than a single sector. */
+
+#include <syscall.h>
+#include <stdio.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 10000
+
+void
+test_main (void) 
+{
+  char file_name[16];
+  size_t i;
+
+  msg ("creating %d files", FILE_CNT);
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "file%zu", i);
+      CHECK (create (file_name, 0), "create \"%s\"", file_name);
+    }
+  quiet = false;
+
+  msg ("opening %d files", FILE_CNT);
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      int fd;
+
+      snprintf (file_name, sizeof file_name, "file%zu", i);
+      CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+      close (fd);
+    }
+  quiet = false;
+
+  snprintf (file_name, sizeof file_name, "file%d", FILE_CNT);
+  CHECK (open (file_name) == -1, "open \"%s\" (must fail)", file_name);
+}
@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(lg-dir) begin
+(lg-dir) creating 10000 files
+(lg-dir) opening 10000 files
+(lg-dir) open "file10000" (must fail)
+(lg-dir) end
+EOF
+pass;
@@ -0,0 +1,63 @@
+/* Writes a file with pwrite() and writev(), reads it back with
+   pread() and readv(), and verifies that pread() and pwrite()
+   leave the file position alone while readv() and writev()
+   advance it. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 12345
+
+static char buf[FILE_SIZE];
+static char buf2[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "blargle";
+  struct iovec iov[3];
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+
+  /* First 5000 bytes with pwrite(), the rest with writev() from
+     three buffers, one of them empty. */
+  CHECK (pwrite (fd, buf, 5000, 0) == 5000, "pwrite 5000 bytes at 0");
+  CHECK (tell (fd) == 0, "tell after pwrite");
+  seek (fd, 5000);
+  iov[0].iov_base = buf + 5000;
+  iov[0].iov_len = 100;
+  iov[1].iov_base = buf + 5100;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = buf + 5100;
+  iov[2].iov_len = FILE_SIZE - 5100;
+  CHECK (writev (fd, iov, 3) == FILE_SIZE - 5000,
+         "writev %d bytes at 5000", FILE_SIZE - 5000);
+  CHECK (tell (fd) == FILE_SIZE, "tell after writev");
+
+  /* Read it back with pread() from the middle and readv() from
+     the start. */
+  CHECK (pread (fd, buf2, 4000, 3000) == 4000, "pread 4000 bytes at 3000");
+  compare_bytes (buf2, buf + 3000, 4000, 3000, file_name);
+  CHECK (tell (fd) == FILE_SIZE, "tell after pread");
+  seek (fd, 0);
+  iov[0].iov_base = buf2;
+  iov[0].iov_len = 7;
+  iov[1].iov_base = buf2 + 7;
+  iov[1].iov_len = 4096;
+  iov[2].iov_base = buf2 + 4103;
+  iov[2].iov_len = FILE_SIZE;
+  CHECK (readv (fd, iov, 3) == FILE_SIZE, "readv %d bytes at 0", FILE_SIZE);
+  compare_bytes (buf2, buf, FILE_SIZE, 0, file_name);
+  CHECK (tell (fd) == FILE_SIZE, "tell after readv");
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, FILE_SIZE);
+}
@@ -0,0 +1,23 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(pread-iov) begin
+(pread-iov) create "blargle"
+(pread-iov) open "blargle"
+(pread-iov) pwrite 5000 bytes at 0
+(pread-iov) tell after pwrite
+(pread-iov) writev 7345 bytes at 5000
+(pread-iov) tell after writev
+(pread-iov) pread 4000 bytes at 3000
+(pread-iov) tell after pread
+(pread-iov) readv 12345 bytes at 0
+(pread-iov) tell after readv
+(pread-iov) close "blargle"
+(pread-iov) open "blargle" for verification
+(pread-iov) verified contents of "blargle"
+(pread-iov) close "blargle"
+(pread-iov) end
+EOF
+pass;
@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($dir);
+foreach my $i (0...119) {
+    if ($i % 10 == 0) {
+	$dir->{"d$i"} = {};
+    } else {
+	$dir->{"f$i"} = ["\0" x $i];
+    }
+}
+check_archive ({'a' => $dir});
+pass;
@@ -0,0 +1,64 @@
+/* Fills a directory with files and subdirectories, enough that
+   it no longer fits in the linear format, then lists it with
+   getdents() into a buffer that holds only a few entries at a
+   time, checking that each entry turns up exactly once with the
+   right type and size. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define ENTRY_CNT 120
+
+void
+test_main (void) 
+{
+  bool seen[ENTRY_CNT];
+  struct dirent ents[7];
+  char name[16];
+  int fd, size, cnt;
+  int i;
+
+  CHECK (mkdir ("a"), "mkdir \"a\"");
+  msg ("creating %d entries in \"a\"", ENTRY_CNT);
+  quiet = true;
+  for (i = 0; i < ENTRY_CNT; i++)
+    if (i % 10 == 0)
+      {
+        snprintf (name, sizeof name, "a/d%d", i);
+        CHECK (mkdir (name), "mkdir \"%s\"", name);
+      }
+    else
+      {
+        snprintf (name, sizeof name, "a/f%d", i);
+        CHECK (create (name, i), "create \"%s\"", name);
+      }
+  quiet = false;
+
+  CHECK ((fd = open ("a")) > 1, "open \"a\"");
+  msg ("read entries with getdents");
+  memset (seen, 0, sizeof seen);
+  cnt = 0;
+  while ((size = getdents (fd, ents, sizeof ents)) > 0)
+    for (i = 0; i < size / (int) sizeof *ents; i++)
+      {
+        const struct dirent *d = &ents[i];
+        int num = atoi (d->d_name + 1);
+
+        if (num < 0 || num >= ENTRY_CNT || seen[num])
+          fail ("unexpected entry \"%s\"", d->d_name);
+        seen[num] = true;
+        cnt++;
+        if (num % 10 == 0
+            ? d->d_name[0] != 'd' || d->d_type != DT_DIR
+            : d->d_name[0] != 'f' || d->d_type != DT_REG || d->d_size != num)
+          fail ("wrong type or size for \"%s\"", d->d_name);
+      }
+  CHECK (size == 0, "getdents at end of directory");
+  CHECK (cnt == ENTRY_CNT, "found %d entries", ENTRY_CNT);
+  msg ("close \"a\"");
+  close (fd);
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-getdents) begin
+(dir-getdents) mkdir "a"
+(dir-getdents) creating 120 entries in "a"
+(dir-getdents) open "a"
+(dir-getdents) read entries with getdents
+(dir-getdents) getdents at end of directory
+(dir-getdents) found 120 entries
+(dir-getdents) close "a"
+(dir-getdents) end
+EOF
+pass;
@@ -0,0 +1,32 @@
+/* Reads back console output through the klog system call, which
+   must return the most recent output, including this test's own
+   messages. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[4096];
+
+/* Returns true if the last bytes of the kernel log are S. */
+static bool
+log_ends_with (const char *s)
+{
+  int len = strlen (s);
+  int cnt = klog (buf, sizeof buf);
+
+  return cnt >= len && cnt <= (int) sizeof buf
+         && !memcmp (buf + cnt - len, s, len);
+}
+
+void
+test_main (void) 
+{
+  msg ("klog marker");
+  CHECK (log_ends_with ("(klog) klog marker\n"),
+         "log ends with marker");
+  CHECK (klog (buf, 8) == 8 && !memcmp (buf, " marker\n", 8),
+         "read last 8 bytes of log");
+  CHECK (klog (buf, 0) == 0, "read nothing from log");
+}
@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(klog) begin
+(klog) klog marker
+(klog) log ends with marker
+(klog) read last 8 bytes of log
+(klog) read nothing from log
+(klog) end
+klog: exit(0)
+EOF
+pass;
@@ -0,0 +1,41 @@
+/* Writes to a file through a mapping and reads the data back
+   with the read system call while the file is still mapped,
+   then writes with the write system call and checks that the
+   mapping sees the new data, also before unmapping. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define ACTUAL ((void *) 0x10000000)
+
+void
+test_main (void)
+{
+  size_t size = strlen (sample);
+  int handle;
+  mapid_t map;
+  char buf[1024];
+
+  CHECK (create ("sample.txt", size), "create \"sample.txt\"");
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK ((map = mmap (handle, ACTUAL)) != MAP_FAILED, "mmap \"sample.txt\"");
+
+  /* Write via mapping, read via read(). */
+  memcpy (ACTUAL, sample, size);
+  CHECK (read (handle, buf, size) == (int) size, "read \"sample.txt\"");
+  if (memcmp (buf, sample, size))
+    fail ("read() does not see data written through mapping");
+
+  /* Write via write(), read via mapping. */
+  memset (buf, 'x', size);
+  seek (handle, 0);
+  CHECK (write (handle, buf, size) == (int) size, "write \"sample.txt\"");
+  if (memcmp (ACTUAL, buf, size))
+    fail ("mapping does not see data written with write()");
+
+  munmap (map);
+  close (handle);
+}
@@ -4,6 +4,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <random.h>
+#include <round.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,8 +37,11 @@
 #include "vm/swap.h"
 #endif /* VM */
 #ifdef FILESYS
+#include "devices/ahci.h"
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
+#include "devices/virtio-blk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif /* FILESYS */
@@ -49,6 +53,12 @@ uint32_t *init_page_dir;
 /* -f: Format the file system? */
 static bool format_filesys;
 
+/* -no-dma: Transfer IDE disk data by PIO even if DMA works? */
+static bool ide_dma = true;
+
+/* -fs-block: Block size for a newly formatted file system. */
+static size_t filesys_block_size = FS_BLOCK_DEFAULT;
+
 /* -filesys, -scratch, -swap: Names of block devices to use,
    overriding the defaults. */
 static const char *filesys_bdev_name;
@@ -56,6 +66,19 @@ static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
+
+/* -ramdisk: RAM disks to create, each with a role and a size. */
+#define RAMDISK_MAX 4
+struct ramdisk_spec
+  {
+    enum block_type role;
+    size_t kb;
+  };
+static struct ramdisk_spec ramdisks[RAMDISK_MAX];
+static size_t ramdisk_cnt;
+
+static void parse_ramdisk (char *spec);
+static void create_ramdisks (void);
 #endif /* FILESYS */
 
 /* -ul: Maximum number of pages to put into palloc's user pool. */
@@ -128,13 +151,17 @@ main (void)
   /* Start thread scheduler and enable interrupts. */
   thread_start ();
   serial_init_queue ();
+  console_init_queue ();
   timer_calibrate ();
 
 #ifdef FILESYS
   /* Initialize file system. */
-  ide_init ();
+  create_ramdisks ();
+  virtio_blk_init ();
+  ahci_init ();
+  ide_init (ide_dma);
   locate_block_devices ();
-  filesys_init (format_filesys);
+  filesys_init (format_filesys, filesys_block_size);
 #ifdef VM
   /* after FS is initialized, initialize swap */
   swap_init ();
@@ -202,6 +229,41 @@ paging_init (void)
   asm volatile ("movl %0, %%cr3" : : "r" (vtop (init_page_dir)));
 }
 
+/* Maps the SIZE bytes of device memory at physical address PADDR
+   into the kernel's address space, with caching disabled, and
+   returns the virtual address of PADDR.  The mappings follow the
+   mapping of physical memory set up by paging_init().
+
+   Processes copy the kernel's page directory when they start, so
+   this should be called only while the kernel boots. */
+void *
+paging_map_io (uintptr_t paddr, size_t size)
+{
+  static uint8_t *next_vaddr;
+  uintptr_t ofs = paddr & PGMASK;
+  size_t page_cnt = DIV_ROUND_UP (ofs + size, PGSIZE);
+  uint8_t *vaddr;
+  size_t i;
+
+  if (next_vaddr == NULL)
+    next_vaddr = ptov (init_ram_pages * PGSIZE);
+  vaddr = next_vaddr;
+  next_vaddr += page_cnt * PGSIZE;
+
+  for (i = 0; i < page_cnt; i++)
+    {
+      uint8_t *page = vaddr + i * PGSIZE;
+      uint32_t *pde = &init_page_dir[pd_no (page)];
+
+      if (*pde == 0)
+        *pde = pde_create (palloc_get_page (PAL_ASSERT | PAL_ZERO));
+      pde_get_pt (*pde)[pt_no (page)] = ((paddr - ofs + i * PGSIZE)
+                                         | PTE_P | PTE_W | PTE_PWT
+                                         | PTE_PCD);
+    }
+  return vaddr + ofs;
+}
+
 /* Breaks the kernel command line into words and returns them as
    an argv-like array. */
 static char **
@@ -257,10 +319,16 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-no-dma"))
+        ide_dma = false;
+      else if (!strcmp (name, "-fs-block"))
+        filesys_block_size = atoi (value);
       else if (!strcmp (name, "-filesys"))
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-ramdisk"))
+        parse_ramdisk (value);
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -268,6 +336,13 @@ parse_options (char **argv)
 #endif
       else if (!strcmp (name, "-rs"))
         random_init (atoi (value));
+      else if (!strcmp (name, "-serial-bps"))
+        {
+          int bps = value != NULL ? atoi (value) : 0;
+          if (bps < 300 || bps > 115200 || 115200 % bps != 0)
+            PANIC ("-serial-bps must divide 115200 (use -h for help)");
+          serial_set_bps (bps);
+        }
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
 #ifdef USERPROG
@@ -306,6 +381,15 @@ run_task (char **argv)
   printf ("Execution of '%s' complete.\n", task);
 }
 
+#ifdef FILESYS
+/* Prints statistics for every block device. */
+static void
+print_iostat (char **argv UNUSED)
+{
+  block_print_iostat ();
+}
+#endif
+
 /* Executes all of the actions specified in ARGV[]
    up to the null pointer sentinel. */
 static void
@@ -327,6 +411,11 @@ run_actions (char **argv)
       {"ls", 1, fsutil_ls},
       {"cat", 2, fsutil_cat},
       {"rm", 2, fsutil_rm},
+      {"stat", 2, fsutil_stat},
+      {"compress", 2, fsutil_compress},
+      {"defrag", 1, fsutil_defrag},
+      {"cluster", 1, fsutil_cluster},
+      {"iostat", 1, print_iostat},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
 #endif
@@ -375,6 +464,11 @@ usage (void)
           "  ls                 List files in the root directory.\n"
           "  cat FILE           Print FILE to the console.\n"
           "  rm FILE            Delete FILE.\n"
+          "  stat FILE          Print FILE's size and on-disk layout.\n"
+          "  compress FILE      Store FILE compressed.\n"
+          "  defrag             Move each fragmented file into one extent.\n"
+          "  cluster            Lay out files in the order first used.\n"
+          "  iostat             Print block device I/O statistics.\n"
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  extract            Untar from scratch device into file system.\n"
           "  append FILE        Append FILE to tar file on scratch device.\n"
@@ -385,13 +479,18 @@ usage (void)
           "  -r                 Reboot after actions.\n"
 #ifdef FILESYS
           "  -f                 Format file system device during startup.\n"
+          "  -fs-block=BYTES    Use BYTES-byte blocks when formatting (512).\n"
+          "  -no-dma            Use PIO rather than DMA for IDE disks.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -ramdisk=ROLE:KB   Make a KB-kB RAM disk for ROLE (filesys,\n"
+          "                     scratch, or swap).  May be repeated.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
 #endif
           "  -rs=SEED           Set random number seed to SEED.\n"
+          "  -serial-bps=BPS    Run the serial port at BPS bits/s.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
@@ -401,6 +500,56 @@ usage (void)
 }
 
 #ifdef FILESYS
+/* Parses SPEC, the value of a -ramdisk option, which takes the
+   form ROLE:KB, and records the RAM disk it asks for. */
+static void
+parse_ramdisk (char *spec)
+{
+  struct ramdisk_spec *rd;
+  char *save_ptr;
+  char *role, *kb;
+  int i;
+
+  if (ramdisk_cnt >= RAMDISK_MAX)
+    PANIC ("too many -ramdisk options (at most %d)", RAMDISK_MAX);
+  rd = &ramdisks[ramdisk_cnt++];
+
+  role = spec != NULL ? strtok_r (spec, ":", &save_ptr) : NULL;
+  kb = role != NULL ? strtok_r (NULL, "", &save_ptr) : NULL;
+  if (kb == NULL || atoi (kb) <= 0)
+    PANIC ("-ramdisk requires ROLE:KB (use -h for help)");
+  rd->kb = atoi (kb);
+
+  for (i = BLOCK_FILESYS; i < BLOCK_ROLE_CNT; i++)
+    if (!strcmp (role, block_type_name (i)))
+      {
+        rd->role = i;
+        return;
+      }
+  PANIC ("unknown -ramdisk role `%s' (use -h for help)", role);
+}
+
+/* Creates the RAM disks requested on the command line.  They are
+   registered ahead of every other block device, so each one
+   takes its role unless a -filesys, -scratch, or -swap option
+   names some other device. */
+static void
+create_ramdisks (void)
+{
+  size_t i;
+
+  for (i = 0; i < ramdisk_cnt; i++)
+    {
+      struct ramdisk_spec *rd = &ramdisks[i];
+      block_sector_t size = rd->kb * (1024 / BLOCK_SECTOR_SIZE);
+
+      if (ramdisk_create (rd->role, size) == NULL)
+        PANIC ("not enough memory for %zu kB %s RAM disk "
+               "(give Pintos more memory or make the disk smaller)",
+               rd->kb, block_type_name (rd->role));
+    }
+}
+
 /* Figure out what block devices to cast in the various Pintos roles. */
 static void
 locate_block_devices (void)
@@ -412,27 +561,39 @@ locate_block_devices (void)
 #endif
 }
 
+/* Returns the block device with the given NAME, if NAME is
+   non-null, otherwise the first block device in probe order of
+   type ROLE, or a null pointer if there is none. */
+static struct block *
+find_block_device (enum block_type role, const char *name)
+{
+  struct block *block;
+
+  if (name != NULL)
+    return block_get_by_name (name);
+  for (block = block_first (); block != NULL; block = block_next (block))
+    if (block_type (block) == role)
+      break;
+  return block;
+}
+
 /* Figures out what block device to use for the given ROLE: the
    block device with the given NAME, if NAME is non-null,
    otherwise the first block device in probe order of type
-   ROLE. */
+   ROLE.  IDE disks come last in probe order, so we wait for
+   them to be detected only if no other device will do. */
 static void
 locate_block_device (enum block_type role, const char *name)
 {
-  struct block *block = NULL;
+  struct block *block = find_block_device (role, name);
 
-  if (name != NULL)
+  if (block == NULL)
     {
-      block = block_get_by_name (name);
-      if (block == NULL)
-        PANIC ("No such block device \"%s\"", name);
-    }
-  else
-    {
-      for (block = block_first (); block != NULL; block = block_next (block))
-        if (block_type (block) == role)
-          break;
+      ide_wait ();
+      block = find_block_device (role, name);
     }
+  if (block == NULL && name != NULL)
+    PANIC ("No such block device \"%s\"", name);
 
   if (block != NULL)
     {
@@ -9,4 +9,6 @@
 /* Page directory with kernel mappings only. */
 extern uint32_t *init_page_dir;
 
+void *paging_map_io (uintptr_t paddr, size_t size);
+
 #endif /* threads/init.h */
@@ -148,6 +148,21 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of free pages in the user pool if PAL_USER
+   is set in FLAGS, otherwise in the kernel pool. */
+size_t
+palloc_free_cnt (enum palloc_flags flags)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  size_t cnt;
+
+  lock_acquire (&pool->lock);
+  cnt = bitmap_count (pool->used_map, 0, bitmap_size (pool->used_map),
+                      false);
+  lock_release (&pool->lock);
+  return cnt;
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
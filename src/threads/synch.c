@@ -179,6 +179,16 @@ lock_init (struct lock *lock)
 
   lock->holder = NULL;
   sema_init (&lock->semaphore, 1);
+  lock->stats = NULL;
+}
+
+/* Makes acquisitions of LOCK count toward STATS. */
+void
+lock_set_stats (struct lock *lock, struct lock_stats *stats)
+{
+  ASSERT (lock != NULL);
+
+  lock->stats = stats;
 }
 
 /* Acquires LOCK, sleeping until it becomes available if
@@ -196,6 +206,15 @@ lock_acquire (struct lock *lock)
   ASSERT (!intr_context ());
   ASSERT (!lock_held_by_current_thread (lock));
 
+  if (lock->stats != NULL)
+    {
+      enum intr_level old_level = intr_disable ();
+      lock->stats->acquire_cnt++;
+      if (lock->semaphore.value == 0)
+        lock->stats->contend_cnt++;
+      intr_set_level (old_level);
+    }
+
   sema_down (&lock->semaphore);
   lock->holder = thread_current ();
 }
@@ -336,3 +355,146 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* List of all lock classes with statistics. */
+static struct list all_lock_stats = LIST_INITIALIZER (all_lock_stats);
+
+/* Initializes STATS as the statistics of a class of locks named
+   NAME, to be included in lock_print_stats(). */
+void
+lock_stats_init (struct lock_stats *stats, const char *name)
+{
+  ASSERT (stats != NULL);
+
+  stats->name = name;
+  stats->acquire_cnt = 0;
+  stats->contend_cnt = 0;
+  list_push_back (&all_lock_stats, &stats->elem);
+}
+
+/* Prints the contention statistics of each lock class. */
+void
+lock_print_stats (void)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&all_lock_stats); e != list_end (&all_lock_stats);
+       e = list_next (e))
+    {
+      struct lock_stats *stats = list_entry (e, struct lock_stats, elem);
+      printf ("Lock %s: %lld acquisitions, %lld contended\n",
+              stats->name, stats->acquire_cnt, stats->contend_cnt);
+    }
+}
+
+/* Initializes RWLOCK.  A readers-writer lock can be held by any
+   number of readers at once, or by a single writer. */
+void
+rwlock_init (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_init (&rwlock->lock);
+  cond_init (&rwlock->readers);
+  cond_init (&rwlock->writers);
+  rwlock->reader_cnt = 0;
+  rwlock->waiting_writer_cnt = 0;
+  rwlock->writer = NULL;
+  rwlock->stats = NULL;
+}
+
+/* Makes acquisitions of RWLOCK count toward STATS. */
+void
+rwlock_set_stats (struct rwlock *rwlock, struct lock_stats *stats)
+{
+  ASSERT (rwlock != NULL);
+
+  rwlock->stats = stats;
+}
+
+/* Counts an acquisition of RWLOCK, contended if MUST_WAIT.
+   RWLOCK's internal lock must be held. */
+static void
+rwlock_count (struct rwlock *rwlock, bool must_wait)
+{
+  if (rwlock->stats != NULL)
+    {
+      rwlock->stats->acquire_cnt++;
+      if (must_wait)
+        rwlock->stats->contend_cnt++;
+    }
+}
+
+/* Acquires RWLOCK for reading, sleeping while a writer holds it
+   or is waiting for it. */
+void
+rwlock_acquire_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (rwlock->writer != thread_current ());
+
+  lock_acquire (&rwlock->lock);
+  rwlock_count (rwlock, (rwlock->writer != NULL
+                         || rwlock->waiting_writer_cnt > 0));
+  while (rwlock->writer != NULL || rwlock->waiting_writer_cnt > 0)
+    cond_wait (&rwlock->readers, &rwlock->lock);
+  rwlock->reader_cnt++;
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for reading. */
+void
+rwlock_release_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_acquire (&rwlock->lock);
+  ASSERT (rwlock->reader_cnt > 0);
+  if (--rwlock->reader_cnt == 0)
+    cond_signal (&rwlock->writers, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Acquires RWLOCK for writing, sleeping until no other thread
+   holds it. */
+void
+rwlock_acquire_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (rwlock->writer != thread_current ());
+
+  lock_acquire (&rwlock->lock);
+  rwlock_count (rwlock, rwlock->writer != NULL || rwlock->reader_cnt > 0);
+  rwlock->waiting_writer_cnt++;
+  while (rwlock->writer != NULL || rwlock->reader_cnt > 0)
+    cond_wait (&rwlock->writers, &rwlock->lock);
+  rwlock->waiting_writer_cnt--;
+  rwlock->writer = thread_current ();
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for writing.
+   A waiting writer goes next; otherwise, all waiting readers. */
+void
+rwlock_release_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+  ASSERT (rwlock_held_for_write (rwlock));
+
+  lock_acquire (&rwlock->lock);
+  rwlock->writer = NULL;
+  if (rwlock->waiting_writer_cnt > 0)
+    cond_signal (&rwlock->writers, &rwlock->lock);
+  else
+    cond_broadcast (&rwlock->readers, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Returns true if the current thread holds RWLOCK for writing. */
+bool
+rwlock_held_for_write (const struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  return rwlock->writer == thread_current ();
+}
@@ -17,14 +17,28 @@ bool sema_try_down (struct semaphore *);
 void sema_up (struct semaphore *);
 void sema_self_test (void);
 
+/* Contention statistics shared by a class of locks. */
+struct lock_stats
+  {
+    const char *name;           /* Class name, for the report. */
+    long long acquire_cnt;      /* Number of acquisitions. */
+    long long contend_cnt;      /* Acquisitions that had to wait. */
+    struct list_elem elem;      /* Element in list of all classes. */
+  };
+
+void lock_stats_init (struct lock_stats *, const char *name);
+void lock_print_stats (void);
+
 /* Lock. */
 struct lock 
   {
     struct thread *holder;      /* Thread holding lock (for debugging). */
     struct semaphore semaphore; /* Binary semaphore controlling access. */
+    struct lock_stats *stats;   /* Contention statistics, or null. */
   };
 
 void lock_init (struct lock *);
+void lock_set_stats (struct lock *, struct lock_stats *);
 void lock_acquire (struct lock *);
 bool lock_try_acquire (struct lock *);
 void lock_release (struct lock *);
@@ -41,6 +55,28 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock.
+   Any number of readers may hold the lock at once, or a single
+   writer.  Waiting writers take precedence over new readers. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition readers;   /* Signaled when readers may proceed. */
+    struct condition writers;   /* Signaled when a writer may proceed. */
+    int reader_cnt;             /* Number of readers holding the lock. */
+    int waiting_writer_cnt;     /* Number of writers waiting. */
+    struct thread *writer;      /* Writer holding the lock, if any. */
+    struct lock_stats *stats;   /* Contention statistics, or null. */
+  };
+
+void rwlock_init (struct rwlock *);
+void rwlock_set_stats (struct rwlock *, struct lock_stats *);
+void rwlock_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+bool rwlock_held_for_write (const struct rwlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
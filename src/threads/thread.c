@@ -214,6 +214,12 @@ thread_create (const char *name, int priority,
   t->exec=NULL;
 #endif /* USERPROG */
 
+#ifdef FILESYS
+  t->cwd = NULL;
+  t->journal_depth = 0;
+  t->journal_credits = 0;
+#endif /* FILESYS */
+
 #ifdef VM
   t->spt = NULL;
   list_init(&t->mmap_list);
@@ -112,6 +112,15 @@ struct thread
     struct file *exec;                  /* the process executable file */
 #endif
 
+#ifdef FILESYS
+    /* Owned by filesys/filesys.c. */
+    struct dir *cwd;                    /* Working directory, or null for root. */
+
+    /* Owned by filesys/journal.c. */
+    int journal_depth;                  /* Nesting depth of journal handles. */
+    size_t journal_credits;             /* Credits held by outermost handle. */
+#endif
+
 #ifdef VM
     struct supp_page_table *spt;        /* supplemental page table (per process). */
     struct list mmap_list;              /* List of struct mmap_desc. */
@@ -11,6 +11,7 @@
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
@@ -39,9 +40,9 @@ static struct lock processes_dead_lock;
 static struct lock processes_waiting_lock;
 static struct lock processes_load_waiting_lock;
 
-/* returns the file corresponding to file descriptor fd
+/* returns the process_file entry for file descriptor fd
    of the current thread or NULL if not found */
-struct file* process_get_file (int fd)
+struct process_file* process_get_file_desc (int fd)
 {
   struct thread *t = thread_current();
   struct list_elem *e;
@@ -52,13 +53,22 @@ struct file* process_get_file (int fd)
       struct process_file *pf = list_entry (e, struct process_file, elem);
       if (fd == pf->fd)
         {
-          return pf->file;
+          return pf;
         }
     }
 
   return NULL;
 }
 
+/* returns the file corresponding to file descriptor fd
+   of the current thread or NULL if not found */
+struct file* process_get_file (int fd)
+{
+  struct process_file *pf = process_get_file_desc (fd);
+
+  return pf != NULL ? pf->file : NULL;
+}
+
 /* adds the file to the file_list of the current thread */
 int process_add_file (struct file *f)
 {
@@ -68,6 +78,17 @@ int process_add_file (struct file *f)
       return -1;
     }
   pf->file = f;
+  pf->dir = NULL;
+  if (inode_is_dir (file_get_inode (f)))
+    {
+      /* keep a directory handle for readdir () */
+      pf->dir = dir_open (inode_reopen (file_get_inode (f)));
+      if (!pf->dir)
+        {
+          free (pf);
+          return -1;
+        }
+    }
   pf->fd = thread_current()->fd;
   thread_current()->fd++;
 
@@ -155,6 +176,13 @@ start_process (void *file_name_)
   struct intr_frame if_;
   bool success;
   struct list_elem *e;
+  struct thread *parent;
+
+  /* inherit the working directory of the parent, which is
+     blocked in process_execute () until we have loaded */
+  parent = thread_retrieve (thread_current ()->parent_tid);
+  if (parent != NULL && parent->cwd != NULL)
+    thread_current ()->cwd = dir_reopen (parent->cwd);
 
   /* Initialize interrupt frame and load executable. */
   memset (&if_, 0, sizeof if_);
@@ -297,6 +325,8 @@ process_exit (int status)
     {
       file_close(cur->exec);
     }
+  dir_close (cur->cwd);
+  cur->cwd = NULL;
 
     struct list *mmlist = &cur->mmap_list;
   while (!list_empty(mmlist)) {
@@ -865,6 +895,7 @@ void process_close_file (int fd)
       if (fd == pf->fd || fd == -1)
         {
           file_close(pf->file);
+          dir_close(pf->dir);
           list_remove(&pf->elem);
           free(pf);
           if (fd != -1)
@@ -31,6 +31,7 @@ struct process_load_info
 struct process_file
   {
     struct file *file;
+    struct dir *dir;    /* non-null if file is a directory */
     int fd;
     struct list_elem elem;
   };
@@ -54,6 +55,7 @@ void process_activate (void);
 
 /* for filesystem */
 struct file* process_get_file (int fd);
+struct process_file* process_get_file_desc (int fd);
 int process_add_file(struct file *f);
 void process_close_file (int fd);
 
@@ -1,21 +1,25 @@
 #include "userprog/syscall.h"
 #include <stdio.h>
+#include <console.h>
 #include <syscall-nr.h>
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "userprog/process.h"
 #include "threads/vaddr.h"
 #include "userprog/pagedir.h"
+#include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
+#include "devices/block.h"
 #include "devices/shutdown.h"
 #include "devices/input.h"
 #include "vm/page.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "vm/page.h"
-
-/* lock for filesystem. */
-struct lock filesys_lock;
+#include <limits.h>
+#include <string.h>
 
 static void syscall_handler (struct intr_frame *);
 int (*syscall_table[SYSCALL_TOTAL]) (struct intr_frame *);
@@ -92,11 +96,69 @@ is_string_valid (const void *str, void *esp)
     return false;
 }
 
+/* Checks the validity of the SIZE bytes of user memory starting
+   at BUFFER.  Checks one address in each page the buffer touches,
+   since validity is decided a page at a time. */
+static bool
+is_buffer_valid (const void *buffer, size_t size, void *esp)
+{
+  const char *p = buffer;
+  const char *end = p + size;
+
+  if (size == 0)
+    return true;
+  if (end < p)
+    return false;
+  for (; p < end; p = (char *) pg_round_down (p) + PGSIZE)
+    if (is_uaddr_valid ((void *) p, esp) == false)
+      return false;
+  return is_uaddr_valid ((void *) (end - 1), esp);
+}
+
+/* Copies the IOVCNT-element scatter-gather list at user address
+   UIOV into a newly allocated kernel array, after checking that
+   the list and every buffer it names are valid user memory.
+   Returns the array, which the caller must free, or a null
+   pointer if IOVCNT is out of range, if the buffers' total length
+   does not fit in an int, or if memory is short.  Kills the
+   process if the list or a buffer is invalid. */
+static struct iovec *
+copy_in_iovec (const struct iovec *uiov, int iovcnt, void *esp)
+{
+  struct iovec *iov;
+  size_t total = 0;
+  int i;
+
+  if (iovcnt < 0 || iovcnt > IOV_MAX)
+    return NULL;
+  if (is_buffer_valid (uiov, iovcnt * sizeof *uiov, esp) == false)
+    syscall_exit (-1);
+
+  /* malloc(0) fails, but an empty list is valid. */
+  iov = malloc (iovcnt * sizeof *iov + 1);
+  if (iov == NULL)
+    return NULL;
+  memcpy (iov, uiov, iovcnt * sizeof *iov);
+  for (i = 0; i < iovcnt; i++)
+    {
+      if (iov[i].iov_len > (size_t) INT_MAX - total)
+        {
+          free (iov);
+          return NULL;
+        }
+      total += iov[i].iov_len;
+      if (is_buffer_valid (iov[i].iov_base, iov[i].iov_len, esp) == false)
+        {
+          free (iov);
+          syscall_exit (-1);
+        }
+    }
+  return iov;
+}
+
 void
 syscall_init (void)
 {
-  lock_init (&filesys_lock);
-
   syscall_table[SYS_HALT] = _syscall_halt;
   syscall_table[SYS_EXIT] = _syscall_exit;
   syscall_table[SYS_EXEC] = _syscall_exec;
@@ -112,6 +174,21 @@ syscall_init (void)
   syscall_table[SYS_CLOSE] = _syscall_close;
     syscall_table[SYS_MMAP] = _syscall_mmap;
     syscall_table[SYS_MUNMAP] = _syscall_munmap;
+  syscall_table[SYS_CHDIR] = _syscall_chdir;
+  syscall_table[SYS_MKDIR] = _syscall_mkdir;
+  syscall_table[SYS_READDIR] = _syscall_readdir;
+  syscall_table[SYS_ISDIR] = _syscall_isdir;
+  syscall_table[SYS_INUMBER] = _syscall_inumber;
+  syscall_table[SYS_PREAD] = _syscall_pread;
+  syscall_table[SYS_PWRITE] = _syscall_pwrite;
+  syscall_table[SYS_READV] = _syscall_readv;
+  syscall_table[SYS_WRITEV] = _syscall_writev;
+  syscall_table[SYS_COPY_FILE_RANGE] = _syscall_copy_file_range;
+  syscall_table[SYS_GETDENTS] = _syscall_getdents;
+  syscall_table[SYS_COMPRESS] = _syscall_compress;
+  syscall_table[SYS_DEFRAG] = _syscall_defrag;
+  syscall_table[SYS_IOSTAT] = _syscall_iostat;
+  syscall_table[SYS_KLOG] = _syscall_klog;
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
@@ -378,6 +455,343 @@ _syscall_close(struct intr_frame *f)
   return 0;
 }
 
+/* validates user addresses and calls syscall_chdir */
+int
+_syscall_chdir (struct intr_frame *f)
+{
+  const char *dir;
+
+  if ((is_uaddr_valid ((char *)f->esp + 4, f->esp) == false) ||
+      (is_string_valid (*((char **) ((char *)f->esp + 4)), f->esp) == false))
+    syscall_exit (-1);
+
+  dir = *((char **) ((char *)f->esp + 4));
+
+  f->eax = syscall_chdir (dir);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_mkdir */
+int
+_syscall_mkdir (struct intr_frame *f)
+{
+  const char *dir;
+
+  if ((is_uaddr_valid ((char *)f->esp + 4, f->esp) == false) ||
+      (is_string_valid (*((char **) ((char *)f->esp + 4)), f->esp) == false))
+    syscall_exit (-1);
+
+  dir = *((char **) ((char *)f->esp + 4));
+
+  f->eax = syscall_mkdir (dir);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_readdir */
+int
+_syscall_readdir (struct intr_frame *f)
+{
+  int fd;
+  char *name;
+
+  if ((is_uaddr_valid ((int *)f->esp + 1, f->esp) == false) ||
+      (is_uaddr_valid ((char *)f->esp + 8, f->esp) == false))
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+  name = *((char **) ((char *)f->esp + 8));
+
+  /* verify addresses for the whole name buffer */
+  int i;
+  for (i = 0; i < READDIR_MAX_LEN + 1; i++)
+    {
+      if (is_uaddr_valid (name + i, f->esp) == false)
+        syscall_exit (-1);
+    }
+
+  f->eax = syscall_readdir (fd, name);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_getdents */
+int
+_syscall_getdents (struct intr_frame *f)
+{
+  int fd;
+  struct dirent *buffer;
+  unsigned size;
+
+  if ((is_uaddr_valid ((int *)f->esp + 1, f->esp) == false) ||
+      (is_uaddr_valid ((char *)f->esp + 8, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 3, f->esp) == false))
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+  buffer = *((struct dirent **) ((char *)f->esp + 8));
+  size = *((unsigned *)f->esp + 3);
+
+  if (is_buffer_valid (buffer, size, f->esp) == false)
+    syscall_exit (-1);
+
+  f->eax = syscall_getdents (fd, buffer, size);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_isdir */
+int
+_syscall_isdir (struct intr_frame *f)
+{
+  int fd;
+
+  if (is_uaddr_valid ((int *)f->esp + 1, f->esp) == false)
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+
+  f->eax = syscall_isdir (fd);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_inumber */
+int
+_syscall_inumber (struct intr_frame *f)
+{
+  int fd;
+
+  if (is_uaddr_valid ((int *)f->esp + 1, f->esp) == false)
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+
+  f->eax = syscall_inumber (fd);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_pread */
+int
+_syscall_pread (struct intr_frame *f)
+{
+  int fd;
+  char *buffer;
+  unsigned size, offset;
+
+  if ((is_uaddr_valid ((int *)f->esp + 1, f->esp) == false) ||
+      (is_uaddr_valid ((char *)f->esp + 8, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 3, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 4, f->esp) == false))
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+  buffer = *((char **) ((char *)f->esp + 8));
+  size = *((unsigned *)f->esp + 3);
+  offset = *((unsigned *)f->esp + 4);
+
+  if (is_buffer_valid (buffer, size, f->esp) == false)
+    syscall_exit (-1);
+
+  f->eax = syscall_pread (fd, buffer, size, offset);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_pwrite */
+int
+_syscall_pwrite (struct intr_frame *f)
+{
+  int fd;
+  const char *buffer;
+  unsigned size, offset;
+
+  if ((is_uaddr_valid ((int *)f->esp + 1, f->esp) == false) ||
+      (is_uaddr_valid ((char *)f->esp + 8, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 3, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 4, f->esp) == false))
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+  buffer = *((char **) ((char *)f->esp + 8));
+  size = *((unsigned *)f->esp + 3);
+  offset = *((unsigned *)f->esp + 4);
+
+  if (is_buffer_valid (buffer, size, f->esp) == false)
+    syscall_exit (-1);
+
+  f->eax = syscall_pwrite (fd, buffer, size, offset);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_readv */
+int
+_syscall_readv (struct intr_frame *f)
+{
+  int fd, iovcnt;
+  const struct iovec *iov;
+  struct iovec *kiov;
+
+  if ((is_uaddr_valid ((int *)f->esp + 1, f->esp) == false) ||
+      (is_uaddr_valid ((char *)f->esp + 8, f->esp) == false) ||
+      (is_uaddr_valid ((int *)f->esp + 3, f->esp) == false))
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+  iov = *((struct iovec **) ((char *)f->esp + 8));
+  iovcnt = *((int *)f->esp + 3);
+
+  /* work on a kernel copy of the list, which is checked in full */
+  kiov = copy_in_iovec (iov, iovcnt, f->esp);
+  if (kiov == NULL)
+    {
+      f->eax = -1;
+      return 0;
+    }
+
+  f->eax = syscall_readv (fd, kiov, iovcnt);
+  free (kiov);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_writev */
+int
+_syscall_writev (struct intr_frame *f)
+{
+  int fd, iovcnt;
+  const struct iovec *iov;
+  struct iovec *kiov;
+
+  if ((is_uaddr_valid ((int *)f->esp + 1, f->esp) == false) ||
+      (is_uaddr_valid ((char *)f->esp + 8, f->esp) == false) ||
+      (is_uaddr_valid ((int *)f->esp + 3, f->esp) == false))
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+  iov = *((struct iovec **) ((char *)f->esp + 8));
+  iovcnt = *((int *)f->esp + 3);
+
+  /* work on a kernel copy of the list, which is checked in full */
+  kiov = copy_in_iovec (iov, iovcnt, f->esp);
+  if (kiov == NULL)
+    {
+      f->eax = -1;
+      return 0;
+    }
+
+  f->eax = syscall_writev (fd, kiov, iovcnt);
+  free (kiov);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_copy_file_range */
+int
+_syscall_copy_file_range (struct intr_frame *f)
+{
+  int fd_in, fd_out;
+  unsigned off_in, off_out, length;
+
+  if ((is_uaddr_valid ((int *)f->esp + 1, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 2, f->esp) == false) ||
+      (is_uaddr_valid ((int *)f->esp + 3, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 4, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 5, f->esp) == false))
+    syscall_exit (-1);
+
+  fd_in = *((int *)f->esp + 1);
+  off_in = *((unsigned *)f->esp + 2);
+  fd_out = *((int *)f->esp + 3);
+  off_out = *((unsigned *)f->esp + 4);
+  length = *((unsigned *)f->esp + 5);
+
+  f->eax = syscall_copy_file_range (fd_in, off_in, fd_out, off_out, length);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_compress */
+int
+_syscall_compress (struct intr_frame *f)
+{
+  int fd;
+
+  if (is_uaddr_valid ((int *)f->esp + 1, f->esp) == false)
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+
+  f->eax = syscall_compress (fd);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_defrag */
+int
+_syscall_defrag (struct intr_frame *f)
+{
+  int fd;
+
+  if (is_uaddr_valid ((int *)f->esp + 1, f->esp) == false)
+    syscall_exit (-1);
+
+  fd = *((int *)f->esp + 1);
+
+  f->eax = syscall_defrag (fd);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_iostat */
+int
+_syscall_iostat (struct intr_frame *f)
+{
+  struct iostat *stats;
+  int cnt;
+
+  if ((is_uaddr_valid ((char *)f->esp + 4, f->esp) == false) ||
+      (is_uaddr_valid ((int *)f->esp + 2, f->esp) == false))
+    syscall_exit (-1);
+
+  stats = *((struct iostat **) ((char *)f->esp + 4));
+  cnt = *((int *)f->esp + 2);
+
+  if (cnt < 0
+      || (size_t) cnt > SIZE_MAX / sizeof *stats
+      || is_buffer_valid (stats, cnt * sizeof *stats, f->esp) == false)
+    syscall_exit (-1);
+
+  f->eax = syscall_iostat (stats, cnt);
+
+  return 0;
+}
+
+/* validates user addresses and calls syscall_klog */
+int
+_syscall_klog (struct intr_frame *f)
+{
+  char *buffer;
+  unsigned size;
+
+  if ((is_uaddr_valid ((char *)f->esp + 4, f->esp) == false) ||
+      (is_uaddr_valid ((unsigned *)f->esp + 2, f->esp) == false))
+    syscall_exit (-1);
+
+  buffer = *((char **) ((char *)f->esp + 4));
+  size = *((unsigned *)f->esp + 2);
+
+  if (is_buffer_valid (buffer, size, f->esp) == false)
+    syscall_exit (-1);
+
+  f->eax = syscall_klog (buffer, size);
+
+  return 0;
+}
+
 void
 syscall_halt(void)
 {
@@ -406,52 +820,39 @@ syscall_wait(pid_t pid)
 bool
 syscall_create(const char* file, unsigned initial_size)
 {
-  bool success=false;
-  lock_acquire(&filesys_lock);
-  success = filesys_create(file,initial_size);
-  lock_release(&filesys_lock);
-  return success;
+  return filesys_create(file,initial_size);
 }
 
 bool
 syscall_remove(const char* file)
 {
-  bool success = false;
-  lock_acquire(&filesys_lock);
-  success = filesys_remove(file);
-  lock_release(&filesys_lock);
-  return success;
+  return filesys_remove(file);
 }
 
 int
 syscall_open(const char* file)
 {
-  lock_acquire(&filesys_lock);
     struct file *f = filesys_open(file);
     if (!f)
       {
-        lock_release(&filesys_lock);
         return -1;
       }
     int fd = process_add_file(f);
-    lock_release(&filesys_lock);
+    if (fd == -1)
+      file_close(f);
     return fd;
 }
 
 int
 syscall_filesize(int fd)
 {
-  lock_acquire(&filesys_lock);
   struct file *f = process_get_file(fd);
 
   if(!f)
     {
-      lock_release(&filesys_lock);
       return -1;
     }
-  int size = file_length(f);
-  lock_release(&filesys_lock);
-  return size;
+  return file_length(f);
 }
 
 int
@@ -469,17 +870,13 @@ syscall_read (int fd, void *buffer, unsigned size)
     }
   else
     {
-      lock_acquire(&filesys_lock);
       struct file *f = process_get_file(fd);
-      if(!f)
+      if(!f || inode_is_dir (file_get_inode (f)))
         {
-          lock_release(&filesys_lock);
           return -1;
         }
 
-      int bytes = file_read(f, buffer, size);
-      lock_release(&filesys_lock);
-      return bytes;
+      return file_read(f, buffer, size);
     }
 
 }
@@ -494,17 +891,13 @@ syscall_write(int fd, const void *buffer,unsigned size)
       status = (int)size;
   }else{
       /* write to filesystem */
-      lock_acquire(&filesys_lock);
          struct file *f = process_get_file(fd);
-         if (!f)
+         if (!f || inode_is_dir (file_get_inode (f)))
            {
-             /* error because file was null */
-             lock_release(&filesys_lock);
+             /* error because file was null or a directory */
              return -1;
            }
-         int bytes = file_write(f, buffer, size);
-         lock_release(&filesys_lock);
-    return bytes;
+    return file_write(f, buffer, size);
   }
 
 return status;
@@ -513,43 +906,292 @@ return status;
 void
 syscall_seek(int fd,unsigned position)
 {
-
-  lock_acquire(&filesys_lock);
   struct file *f = process_get_file(fd);
-  if(!f)
+  if(f)
     {
-      lock_release(&filesys_lock);
-    }
-  else{
       file_seek(f,position);
-      lock_release(&filesys_lock);
-  }
-
+    }
 }
 
 unsigned
 syscall_tell(int fd)
 {
-  lock_acquire(&filesys_lock);
   struct file *f = process_get_file(fd);
 
   if(!f)
     {
-      lock_release(&filesys_lock);
       return -1;
     }
 
-  off_t offset = file_tell(f);
-  lock_release(&filesys_lock);
-  return offset;
+  return file_tell(f);
 }
 
 void
 syscall_close(int fd)
 {
-  lock_acquire(&filesys_lock);
   process_close_file(fd);
-  lock_release(&filesys_lock);
+}
+
+bool
+syscall_chdir (const char *dir)
+{
+  return filesys_chdir (dir);
+}
+
+bool
+syscall_mkdir (const char *dir)
+{
+  return filesys_mkdir (dir);
+}
+
+bool
+syscall_readdir (int fd, char *name)
+{
+  struct process_file *pf = process_get_file_desc (fd);
+  if (pf && pf->dir)
+    return dir_readdir (pf->dir, name);
+  return false;
+}
+
+/* Reads as many of the next entries of the directory open as FD
+   as fit in the SIZE bytes at BUFFER.  Returns the number of
+   bytes stored, 0 at the end of the directory, or -1 if FD is
+   not a directory or BUFFER cannot hold even one entry. */
+int
+syscall_getdents (int fd, struct dirent *buffer, unsigned size)
+{
+  struct process_file *pf = process_get_file_desc (fd);
+  size_t cnt = size / sizeof *buffer;
+  size_t done = 0;
+  struct dirent *kbuf;
+
+  if (!pf || !pf->dir || cnt == 0)
+    return -1;
+
+  /* Gather entries a page at a time into kernel memory, so the
+     directory lock is never held while touching user memory. */
+  kbuf = palloc_get_page (0);
+  if (kbuf == NULL)
+    return -1;
+  while (done < cnt)
+    {
+      size_t want = cnt - done;
+      size_t got;
+
+      if (want > PGSIZE / sizeof *kbuf)
+        want = PGSIZE / sizeof *kbuf;
+      got = dir_getdents (pf->dir, kbuf, want);
+      memcpy (buffer + done, kbuf, got * sizeof *kbuf);
+      done += got;
+      if (got < want)
+        break;
+    }
+  palloc_free_page (kbuf);
+
+  return done * sizeof *buffer;
+}
+
+bool
+syscall_isdir (int fd)
+{
+  struct process_file *pf = process_get_file_desc (fd);
+  return pf && pf->dir;
+}
+
+int
+syscall_inumber (int fd)
+{
+  struct file *f = process_get_file (fd);
+  if (!f)
+    return -1;
+  return inode_get_inumber (file_get_inode (f));
+}
+
+/* Reads SIZE bytes from the file open as FD into BUFFER, starting
+   at OFFSET, without moving the file's position.  The console
+   has no positions, so fails for it. */
+int
+syscall_pread (int fd, void *buffer, unsigned size, unsigned offset)
+{
+  struct file *f = process_get_file (fd);
+
+  if (!f || inode_is_dir (file_get_inode (f)) || (int) offset < 0)
+    return -1;
+  return file_read_at (f, buffer, size, offset);
+}
+
+/* Writes SIZE bytes from BUFFER to the file open as FD, starting
+   at OFFSET, without moving the file's position. */
+int
+syscall_pwrite (int fd, const void *buffer, unsigned size, unsigned offset)
+{
+  struct file *f = process_get_file (fd);
+
+  if (!f || inode_is_dir (file_get_inode (f)) || (int) offset < 0)
+    return -1;
+  return file_write_at (f, buffer, size, offset);
+}
+
+/* Reads from FD into the IOVCNT user buffers in IOV, filling each
+   in turn.  IOV itself must be in kernel memory. */
+int
+syscall_readv (int fd, const struct iovec *iov, int iovcnt)
+{
+  int bytes_read = -1;
+
+  if (fd == STDIN_FILENO)
+    {
+      int i;
+      size_t j;
+
+      bytes_read = 0;
+      for (i = 0; i < iovcnt; i++)
+        for (j = 0; j < iov[i].iov_len; j++)
+          ((uint8_t *) iov[i].iov_base)[j] = input_getc ();
+      for (i = 0; i < iovcnt; i++)
+        bytes_read += iov[i].iov_len;
+    }
+  else
+    {
+      struct file *f = process_get_file (fd);
+      if (f && !inode_is_dir (file_get_inode (f)))
+        bytes_read = file_readv (f, iov, iovcnt);
+    }
+  return bytes_read;
+}
+
+/* Writes the IOVCNT user buffers in IOV, one after another, to FD.
+   IOV itself must be in kernel memory. */
+int
+syscall_writev (int fd, const struct iovec *iov, int iovcnt)
+{
+  int bytes_written = -1;
+
+  if (fd == STDOUT_FILENO)
+    {
+      int i;
+
+      bytes_written = 0;
+      for (i = 0; i < iovcnt; i++)
+        {
+          putbuf (iov[i].iov_base, iov[i].iov_len);
+          bytes_written += iov[i].iov_len;
+        }
+    }
+  else
+    {
+      struct file *f = process_get_file (fd);
+      if (f && !inode_is_dir (file_get_inode (f)))
+        bytes_written = file_writev (f, iov, iovcnt);
+    }
+  return bytes_written;
+}
+
+/* Copies up to LENGTH bytes from the file open as FD_IN, starting
+   at OFF_IN, to the file open as FD_OUT, starting at OFF_OUT,
+   inside the kernel.  Neither file's position moves.  Returns the
+   number of bytes copied, which is 0 at end of the input file, or
+   -1 if either descriptor is not an open regular file or if the
+   two ranges overlap within the same file. */
+int
+syscall_copy_file_range (int fd_in, unsigned off_in, int fd_out,
+                         unsigned off_out, unsigned length)
+{
+  struct file *in = process_get_file (fd_in);
+  struct file *out = process_get_file (fd_out);
+
+  if (!in || !out
+      || inode_is_dir (file_get_inode (in))
+      || inode_is_dir (file_get_inode (out))
+      || (int) off_in < 0 || (int) off_out < 0)
+    return -1;
+  if (length > INT_MAX)
+    length = INT_MAX;
+  if (file_get_inode (in) == file_get_inode (out)
+      && off_in < off_out + length && off_out < off_in + length)
+    return -1;
+  return file_copy_at (in, off_in, out, off_out, length);
+}
+
+/* Stores the regular file open as FD compressed, to save space.
+   Reads see the same data as before; the first write, or mmap(),
+   stores it uncompressed again.  Returns true if the file is
+   stored compressed afterward, false if FD is not an open regular
+   file, if the file is open elsewhere, or if compressing it would
+   not save space. */
+bool
+syscall_compress (int fd)
+{
+  struct file *f = process_get_file (fd);
+
+  if (!f || inode_is_dir (file_get_inode (f)))
+    return false;
+  return inode_compress (file_get_inode (f));
+}
+
+/* Moves the data of the regular file open as FD into one run of
+   consecutive blocks, if it is in more than one.  This is left
+   undone if the file is open elsewhere or no free run is long
+   enough.  Returns the number of extents that the file's data
+   forms afterward, or -1 if FD is not an open regular file. */
+int
+syscall_defrag (int fd)
+{
+  struct file *f = process_get_file (fd);
+  size_t extent_cnt;
+
+  if (!f || inode_is_dir (file_get_inode (f)))
+    return -1;
+  inode_defrag (file_get_inode (f), NULL);
+  inode_block_cnt (file_get_inode (f), &extent_cnt);
+  return extent_cnt;
+}
+
+/* Stores statistics for up to CNT block devices, in probe order,
+   into STATS.  Returns the number of block devices, which may be
+   more than CNT. */
+int
+syscall_iostat (struct iostat *stats, int cnt)
+{
+  struct block *block;
+  int i = 0;
+
+  for (block = block_first (); block != NULL; block = block_next (block), i++)
+    if (i < cnt)
+      {
+        /* Take the snapshot in kernel memory, since touching user
+           memory may fault, which must not happen with interrupts
+           off. */
+        struct iostat st;
+        block_get_stats (block, &st);
+        memcpy (&stats[i], &st, sizeof st);
+      }
+  return i;
+}
+
+/* Copies the last SIZE bytes of console output, or as many as
+   the kernel log retains if that is fewer, into BUFFER.  Returns
+   the number of bytes copied, or -1 if memory is short. */
+int
+syscall_klog (char *buffer, unsigned size)
+{
+  char *kbuf;
+  size_t cnt;
+
+  if (size > CONSOLE_LOG_SIZE)
+    size = CONSOLE_LOG_SIZE;
+  if (size == 0)
+    return 0;
+
+  /* Copy the log in kernel memory, since it must be copied with
+     interrupts off, and touching user memory may fault. */
+  kbuf = malloc (size);
+  if (kbuf == NULL)
+    return -1;
+  cnt = console_read_log (kbuf, size);
+  memcpy (buffer, kbuf, cnt);
+  free (kbuf);
+  return cnt;
 }
 
 static void
@@ -579,8 +1221,6 @@ mmapid_t syscall_mmap(int fd, void *upage) {
     if (fd <= 1) return -1; // 0 and 1 are unmappable
     struct thread *curr = thread_current();
 
-    lock_acquire (&filesys_lock);
-
     /* 1. Open file */
     struct file *f = NULL;
     struct process_file* file_d = find_file_desc(thread_current(), fd);
@@ -592,6 +1232,12 @@ mmapid_t syscall_mmap(int fd, void *upage) {
         f = file_reopen (file_d->file);
     }
 
+    // a mapped file is written in place, so it may not stay compressed
+    if (f != NULL && !inode_uncompress (file_get_inode (f))) {
+        file_close (f);
+        f = NULL;
+    }
+
 
     if(f == NULL){
 
@@ -615,10 +1261,8 @@ mmapid_t syscall_mmap(int fd, void *upage) {
         void *addr = upage + offset;
 
         size_t read_bytes = (offset + PGSIZE < file_size ? PGSIZE : file_size - offset);
-        size_t zero_bytes = PGSIZE - read_bytes;
 
-        spt_add_page(curr->spt,addr,/*writable*/true,f,
-        		offset,read_bytes,zero_bytes,FILE_SYS);
+        spt_add_mmap_page(curr->spt,addr,f,offset,read_bytes);
 
     }
 
@@ -636,15 +1280,13 @@ mmapid_t syscall_mmap(int fd, void *upage) {
     mmap_d->addr = upage;
     mmap_d->size = file_size;
     list_push_back (&curr->mmap_list, &mmap_d->elem);
-    // OK, release and return the mid
-    lock_release (&filesys_lock);
-
+    // OK, return the mid
     return mid;
 
 
     MMAP_FAIL:
-    // finally: release and return
-    lock_release (&filesys_lock);
+    // finally: close the reopened file and return
+    file_close (f);
     return -1;
 }
 
@@ -657,7 +1299,6 @@ bool syscall_munmap(mmapid_t mid)
         return false; // or fail_invalid_access() ?
     }
 
-    lock_acquire (&filesys_lock);
     {
         // Iterate through each page
         size_t offset, file_size = mmap_d->size;
@@ -668,9 +1309,9 @@ bool syscall_munmap(mmapid_t mid)
 
         // Free resources, and remove from the list
         list_remove(& mmap_d->elem);
+        file_close(mmap_d->file);
         free(mmap_d);
     }
-    lock_release (&filesys_lock);
 
     return true;
 }
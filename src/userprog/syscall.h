@@ -7,7 +7,7 @@
 #include "user/syscall.h"
 #include "userprog/process.h"
 
-#define SYSCALL_TOTAL 15
+#define SYSCALL_TOTAL 30
 
 
 
@@ -29,6 +29,21 @@ int _syscall_tell (struct intr_frame *f);
 int _syscall_close (struct intr_frame *f);
 int _syscall_mmap (struct intr_frame *f);
 int _syscall_munmap (struct intr_frame *f);
+int _syscall_chdir (struct intr_frame *f);
+int _syscall_mkdir (struct intr_frame *f);
+int _syscall_readdir (struct intr_frame *f);
+int _syscall_isdir (struct intr_frame *f);
+int _syscall_inumber (struct intr_frame *f);
+int _syscall_pread (struct intr_frame *f);
+int _syscall_pwrite (struct intr_frame *f);
+int _syscall_readv (struct intr_frame *f);
+int _syscall_writev (struct intr_frame *f);
+int _syscall_copy_file_range (struct intr_frame *f);
+int _syscall_getdents (struct intr_frame *f);
+int _syscall_compress (struct intr_frame *f);
+int _syscall_defrag (struct intr_frame *f);
+int _syscall_iostat (struct intr_frame *f);
+int _syscall_klog (struct intr_frame *f);
 
 //user implemented methods
 void syscall_halt(void);
@@ -46,6 +61,23 @@ unsigned syscall_tell(int fd);
 void syscall_close(int fd);
 bool syscall_munmap(mmapid_t mid);
 mmapid_t syscall_mmap(int fd, void *upage);
+bool syscall_chdir (const char *dir);
+bool syscall_mkdir (const char *dir);
+bool syscall_readdir (int fd, char *name);
+int syscall_getdents (int fd, struct dirent *buffer, unsigned size);
+bool syscall_isdir (int fd);
+int syscall_inumber (int fd);
+int syscall_pread (int fd, void *buffer, unsigned size, unsigned offset);
+int syscall_pwrite (int fd, const void *buffer, unsigned size,
+                    unsigned offset);
+int syscall_readv (int fd, const struct iovec *iov, int iovcnt);
+int syscall_writev (int fd, const struct iovec *iov, int iovcnt);
+int syscall_copy_file_range (int fd_in, unsigned off_in, int fd_out,
+                             unsigned off_out, unsigned length);
+bool syscall_compress (int fd);
+int syscall_defrag (int fd);
+int syscall_iostat (struct iostat *stats, int cnt);
+int syscall_klog (char *buffer, unsigned size);
 
 
 #endif /* userprog/syscall.h */
@@ -8,12 +8,13 @@
 #include "threads/palloc.h"
 #include "vm/frame.h"
 #include "filesys/file.h"
+#include "filesys/cache.h"
 
-extern struct lock filesys_lock;
 
 static unsigned spt_hash_func(const struct hash_elem *elem, void *aux);
 static bool     spt_less_hash_func(const struct hash_elem *a, const struct hash_elem *b, void *aux);
 static bool     load_from_filesys (struct supp_page_table_entry *spt_e, void *frame);
+static int      load_from_cache (struct supp_page_table_entry *spt_e, uint32_t *pagedir);
 
 /* allocate and initialize supplemental page table spt */
 void
@@ -41,6 +42,8 @@ spt_set_page (struct supp_page_table *spt, void *uaddr, bool writable)
   spt_entry->uaddr = uaddr;
   spt_entry->loc = FRAME;
   spt_entry->writable = writable;
+  spt_entry->mmapped = false;
+  spt_entry->cpage = NULL;
 
   bool inserted = (hash_insert (&spt->spt, &spt_entry->elem) == NULL) ? true : false;
 
@@ -85,6 +88,8 @@ spt_add_page (struct supp_page_table *spt, void *paddr, bool writable, struct fi
       spt_entry->read_bytes = read_bytes;
       spt_entry->zero_bytes = zero_bytes;
       spt_entry->loc = loc;
+      spt_entry->mmapped = false;
+      spt_entry->cpage = NULL;
 
       inserted = (hash_insert (&spt->spt, &spt_entry->elem) == NULL) ? true : false;
     }
@@ -92,6 +97,27 @@ spt_add_page (struct supp_page_table *spt, void *paddr, bool writable, struct fi
   return inserted;
 }
 
+/* add a page of the memory-mapped file FILE at offset OFS, of which READ_BYTES
+   bytes lie within the file. the page is not read into a private frame
+   when it is faulted in; the file's page cache page is mapped instead, so that
+   the mapping shares its data with read() and write(). Returns true if added. */
+bool
+spt_add_mmap_page (struct supp_page_table *spt, void *paddr, struct file *file,
+                   off_t ofs, uint32_t read_bytes)
+{
+  struct supp_page_table_entry *spt_e;
+
+  ASSERT (ofs % PGSIZE == 0);
+
+  if (!spt_add_page (spt, paddr, true, file, ofs, read_bytes,
+                     PGSIZE - read_bytes, FILE_SYS))
+    return false;
+
+  spt_e = spt_find_page (spt, paddr);
+  spt_e->mmapped = true;
+  return true;
+}
+
 /* spt hash function for hash */
 static unsigned
 spt_hash_func(const struct hash_elem *elem, void *aux UNUSED)
@@ -124,6 +150,11 @@ vm_load_page (struct supp_page_table *spt, uint32_t *pagedir, void *paddr, bool
       /* if the process was trying to write to a read-only page, kill it */
       if (!spt_e->writable && write)
         error_code = ACCESS_VIOLATION;
+      else if (spt_e->mmapped && spt_e->loc == FILE_SYS)
+        {
+          /* memory-mapped file pages come straight from the page cache */
+          error_code = load_from_cache (spt_e, pagedir);
+        }
       else
         {
           /* allocation a frame to store the page */
@@ -194,8 +225,6 @@ load_from_filesys (struct supp_page_table_entry *spt_e, void *frame)
       /* if there are bytes to be read from file */
       if (spt_e->read_bytes > 0)
         {
-          lock_acquire (&filesys_lock);
-
           if (file_read_at (spt_e->file, frame, spt_e->read_bytes, spt_e->ofs) !=
               (int) spt_e->read_bytes)
             {
@@ -203,8 +232,6 @@ load_from_filesys (struct supp_page_table_entry *spt_e, void *frame)
               vm_frame_free (frame);
               ret_val = false;
             }
-
-          lock_release (&filesys_lock);
         }
 
       if (ret_val)
@@ -216,6 +243,29 @@ load_from_filesys (struct supp_page_table_entry *spt_e, void *frame)
   return ret_val;
 }
 
+/* maps the page cache page that holds spt_e's part of its file into pagedir.
+   the cache page stays pinned until it is unmapped by vm_spt_mm_unmap(). */
+static int
+load_from_cache (struct supp_page_table_entry *spt_e, uint32_t *pagedir)
+{
+  struct cache_page *cpage;
+
+  cpage = cache_get (file_get_inode (spt_e->file), spt_e->ofs / PGSIZE, true);
+  if (cpage == NULL)
+    return MEM_ALLOC_FAIL;
+
+  if (!pagedir_set_page (pagedir, spt_e->uaddr, cache_data (cpage), spt_e->writable))
+    {
+      cache_put (cpage, false);
+      return MEM_ALLOC_FAIL;
+    }
+
+  pagedir_set_dirty (pagedir, spt_e->uaddr, false);
+  spt_e->cpage = cpage;
+  spt_e->loc = FRAME;
+  return true;
+}
+
 struct supp_page_table_entry*
 vm_spt_lookup (struct supp_page_table *supt, void *page)
 {
@@ -261,16 +311,16 @@ vm_spt_mm_unmap(
     {
         case FRAME:
         {
-            // Dirty frame handling (write into file)
-            // Check if the upage or mapped frame is dirty. If so, write to file.
-            bool is_dirty = false;
-            is_dirty = is_dirty || pagedir_is_dirty(pagedir, spte->uaddr);
-
-            if(is_dirty) {
-                file_write_at (f, spte->uaddr, PGSIZE, offset);
-            }
+            // The frame is the file's page cache page, so there is nothing
+            // to copy: just tell the cache whether the process dirtied it,
+            // and the cache writes it back.
+            bool is_dirty = pagedir_is_dirty(pagedir, spte->uaddr);
 
             pagedir_clear_page (pagedir, spte->uaddr);
+            if (spte->cpage != NULL) {
+                cache_put (spte->cpage, is_dirty);
+                spte->cpage = NULL;
+            }
             break;
         }
 
@@ -291,5 +341,6 @@ vm_spt_mm_unmap(
     // the supplemental page table entry is also removed.
     // so that the unmapped memory is unreachable. Later access will fault.
     hash_delete(& supt->spt, &spte->elem);
+    free (spte);
     return true;
 }
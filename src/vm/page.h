@@ -4,6 +4,7 @@
 #include "threads/thread.h"
 #include <hash.h>
 #include "filesys/off_t.h"
+#include "filesys/cache.h"
 
 /* page location */
 enum page_loc
@@ -41,6 +42,8 @@ struct supp_page_table_entry
     off_t ofs;                /* offset in file */
     uint32_t read_bytes;      /* no. of bytes in page to be read from exec */
     uint32_t zero_bytes;      /* remaining bytes which will be zeroed out */
+    bool mmapped;             /* true if the page is part of a memory-mapped file */
+    struct cache_page *cpage; /* page cache page mapped here, if mmapped and in memory */
   };
 
 void                          spt_init_supp_page_table (struct supp_page_table *);
@@ -50,6 +53,8 @@ struct supp_page_table_entry  *spt_find_page (struct supp_page_table *, void *);
 int                           vm_load_page (struct supp_page_table *, uint32_t *, void *, bool );
 bool                          spt_add_page (struct supp_page_table *, void *, bool ,
                                             struct file *, off_t , uint32_t , uint32_t , enum page_loc );
+bool                          spt_add_mmap_page (struct supp_page_table *, void *,
+                                                 struct file *, off_t , uint32_t );
 bool
 vm_spt_has_entry (struct supp_page_table *supt, void *page);
 bool
@@ -61,14 +61,11 @@ swap_write_to_unused_slot (void *page)
     {
       /* swap is not full, the page can be written */
 
-      int i;
-      for (i = 0; i < SECTORS_PER_PAGE; i++)
-        {
-          /* set the sector in swap as taken */
-          bitmap_flip (swap_bitmap, start + i);
-
-          block_write (swap_block, start + i, page + (BLOCK_SECTOR_SIZE * i));
-        }
+      /* set the sectors in swap as taken */
+      bitmap_set_multiple (swap_bitmap, start, SECTORS_PER_PAGE, false);
+
+      /* write the whole page in one request */
+      block_write_multiple (swap_block, start, SECTORS_PER_PAGE, page);
     }
   else
     {
@@ -98,11 +95,8 @@ swap_read_from_slot (size_t start_index, void *page)
       NOT_REACHED ();
     }
 
-  int i;
-  for (i = 0; i < SECTORS_PER_PAGE; i++)
-    {
-      block_read (swap_block, start_index + i, page);
-    }
+  /* read the whole page in one request */
+  block_read_multiple (swap_block, start_index, SECTORS_PER_PAGE, page);
 
   /* once we have read the 4 sectors, we can mark these as free */
   bitmap_set_multiple (swap_bitmap, start_index, SECTORS_PER_PAGE, true);